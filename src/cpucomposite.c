@@ -0,0 +1,642 @@
+/*
+ * Software compositing kernels for the CPU backend.
+ *
+ * Every operation is done one destination row at a time: the source row is
+ * first scaled into a per-thread buffer if needed, then copied or blended
+ * into place. Rows are handed out in bands to a pool of worker threads, the
+ * calling thread included. SSE2 and AVX2 versions of the row kernels are
+ * picked at runtime; blending matches GL's SRC_ALPHA, ONE_MINUS_SRC_ALPHA.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CPU_COMPOSITE_X86 1
+#endif
+
+#include "cpucomposite.h"
+
+#define			BAND_ROWS 16
+#define			MAX_THREADS 16
+
+/* Row kernels */
+
+typedef void (*fill_row_func) (uint32_t *dst, int count, uint32_t color);
+typedef void (*blend_row_func) (uint32_t *dst, const uint32_t *src, int count,
+								unsigned int alpha, int useSourceAlpha);
+typedef void (*nearest_row_func) (uint32_t *dst, const uint32_t *src, int count,
+								  uint32_t x, uint32_t step);
+typedef void (*bilinear_row_func) (uint32_t *dst, const uint32_t *row0, const uint32_t *row1,
+								   int count, uint32_t x, uint32_t step, int lastX, unsigned int fy);
+
+static fill_row_func	fill_row;
+static blend_row_func	blend_row;
+static nearest_row_func	nearest_row;
+static bilinear_row_func	bilinear_row;
+static const char		*kernelISA = "C";
+
+/* (x * a + y * (255 - a)) / 255, rounded; exact for 8 bit operands */
+static inline uint32_t
+lerp_255 (uint32_t x, uint32_t y, uint32_t a)
+{
+	uint32_t t = x * a + y * (255 - a) + 128;
+
+	return (t + (t >> 8)) >> 8;
+}
+
+static void
+fill_row_c (uint32_t *dst, int count, uint32_t color)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		dst[i] = color;
+}
+
+static void
+blend_row_c (uint32_t *dst, const uint32_t *src, int count,
+			 unsigned int alpha, int useSourceAlpha)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		uint32_t s = src[i], d = dst[i];
+		uint32_t a = useSourceAlpha ? lerp_255(s >> 24, 0, alpha) : alpha;
+
+		dst[i] = 0xFF000000 | lerp_255((s >> 16) & 0xFF, (d >> 16) & 0xFF, a) << 16 |
+				 lerp_255((s >> 8) & 0xFF, (d >> 8) & 0xFF, a) << 8 |
+				 lerp_255(s & 0xFF, d & 0xFF, a);
+	}
+}
+
+static void
+nearest_row_c (uint32_t *dst, const uint32_t *src, int count, uint32_t x, uint32_t step)
+{
+	int i;
+
+	for (i = 0; i < count; i++, x += step)
+		dst[i] = src[x >> 16];
+}
+
+/* Bilinear filtering of one row, from the two source rows around it.
+ * Weights are 8 bit fractions. */
+static void
+bilinear_row_c (uint32_t *dst, const uint32_t *row0, const uint32_t *row1,
+				int count, uint32_t x, uint32_t step, int lastX, unsigned int fy)
+{
+	int i, c;
+
+	for (i = 0; i < count; i++, x += step)
+	{
+		int ix = x >> 16, ix1 = ix < lastX ? ix + 1 : lastX;
+		unsigned int fx = (x >> 8) & 0xFF;
+		uint32_t out = 0;
+
+		for (c = 0; c < 32; c += 8)
+		{
+			uint32_t top = (((row0[ix] >> c) & 0xFF) * (256 - fx) + ((row0[ix1] >> c) & 0xFF) * fx) >> 8;
+			uint32_t bottom = (((row1[ix] >> c) & 0xFF) * (256 - fx) + ((row1[ix1] >> c) & 0xFF) * fx) >> 8;
+
+			out |= ((top * (256 - fy) + bottom * fy) >> 8) << c;
+		}
+
+		dst[i] = out;
+	}
+}
+
+#ifdef CPU_COMPOSITE_X86
+
+static void
+fill_row_sse2 (uint32_t *dst, int count, uint32_t color)
+{
+	__m128i c = _mm_set1_epi32(color);
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i *)(dst + i), c);
+
+	fill_row_c(dst + i, count - i, color);
+}
+
+/* Blends 2 pixels held as 16 bit channels. */
+static inline __m128i
+blend_pixels_sse2 (__m128i s, __m128i d, __m128i alpha, int useSourceAlpha)
+{
+	const __m128i rounding = _mm_set1_epi16(128);
+	const __m128i full = _mm_set1_epi16(255);
+	__m128i a = alpha;
+	__m128i t;
+
+	if (useSourceAlpha)
+	{
+		a = _mm_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3));
+		a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+		a = _mm_add_epi16(_mm_mullo_epi16(a, alpha), rounding);
+		a = _mm_srli_epi16(_mm_add_epi16(a, _mm_srli_epi16(a, 8)), 8);
+	}
+
+	t = _mm_add_epi16(_mm_mullo_epi16(s, a), _mm_mullo_epi16(d, _mm_sub_epi16(full, a)));
+	t = _mm_add_epi16(t, rounding);
+
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+static void
+blend_row_sse2 (uint32_t *dst, const uint32_t *src, int count,
+				unsigned int alpha, int useSourceAlpha)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i opaque = _mm_set1_epi32(0xFF000000);
+	__m128i a = _mm_set1_epi16(alpha);
+	int i = 0;
+
+	for (; i + 4 <= count; i += 4)
+	{
+		__m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+		__m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i lo, hi;
+
+		lo = blend_pixels_sse2(_mm_unpacklo_epi8(s, zero), _mm_unpacklo_epi8(d, zero), a, useSourceAlpha);
+		hi = blend_pixels_sse2(_mm_unpackhi_epi8(s, zero), _mm_unpackhi_epi8(d, zero), a, useSourceAlpha);
+
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(_mm_packus_epi16(lo, hi), opaque));
+	}
+
+	blend_row_c(dst + i, src + i, count - i, alpha, useSourceAlpha);
+}
+
+static void
+nearest_row_sse2 (uint32_t *dst, const uint32_t *src, int count, uint32_t x, uint32_t step)
+{
+	int i = 0;
+
+	// No gather before AVX2; at least keep the stores wide
+	for (; i + 4 <= count; i += 4, x += 4 * step)
+	{
+		__m128i p = _mm_setr_epi32(src[x >> 16], src[(x + step) >> 16],
+								   src[(x + 2 * step) >> 16], src[(x + 3 * step) >> 16]);
+		_mm_storeu_si128((__m128i *)(dst + i), p);
+	}
+
+	nearest_row_c(dst + i, src, count - i, x, step);
+}
+
+__attribute__((target("avx2"))) static void
+fill_row_avx2 (uint32_t *dst, int count, uint32_t color)
+{
+	__m256i c = _mm256_set1_epi32(color);
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8)
+		_mm256_storeu_si256((__m256i *)(dst + i), c);
+
+	fill_row_c(dst + i, count - i, color);
+}
+
+__attribute__((target("avx2"))) static inline __m256i
+blend_pixels_avx2 (__m256i s, __m256i d, __m256i alpha, int useSourceAlpha)
+{
+	const __m256i rounding = _mm256_set1_epi16(128);
+	const __m256i full = _mm256_set1_epi16(255);
+	__m256i a = alpha;
+	__m256i t;
+
+	if (useSourceAlpha)
+	{
+		a = _mm256_shufflelo_epi16(s, _MM_SHUFFLE(3, 3, 3, 3));
+		a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+		a = _mm256_add_epi16(_mm256_mullo_epi16(a, alpha), rounding);
+		a = _mm256_srli_epi16(_mm256_add_epi16(a, _mm256_srli_epi16(a, 8)), 8);
+	}
+
+	t = _mm256_add_epi16(_mm256_mullo_epi16(s, a), _mm256_mullo_epi16(d, _mm256_sub_epi16(full, a)));
+	t = _mm256_add_epi16(t, rounding);
+
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2"))) static void
+blend_row_avx2 (uint32_t *dst, const uint32_t *src, int count,
+				unsigned int alpha, int useSourceAlpha)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i opaque = _mm256_set1_epi32(0xFF000000);
+	__m256i a = _mm256_set1_epi16(alpha);
+	int i = 0;
+
+	// Unpacking works within 128 bit lanes, and so does packing it back
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+		__m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+		__m256i lo, hi;
+
+		lo = blend_pixels_avx2(_mm256_unpacklo_epi8(s, zero), _mm256_unpacklo_epi8(d, zero), a, useSourceAlpha);
+		hi = blend_pixels_avx2(_mm256_unpackhi_epi8(s, zero), _mm256_unpackhi_epi8(d, zero), a, useSourceAlpha);
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(_mm256_packus_epi16(lo, hi), opaque));
+	}
+
+	blend_row_sse2(dst + i, src + i, count - i, alpha, useSourceAlpha);
+}
+
+__attribute__((target("avx2"))) static void
+nearest_row_avx2 (uint32_t *dst, const uint32_t *src, int count, uint32_t x, uint32_t step)
+{
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i steps = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(step));
+	int i = 0;
+
+	for (; i + 8 <= count; i += 8, x += 8 * step)
+	{
+		__m256i coords = _mm256_add_epi32(_mm256_set1_epi32(x), steps);
+		__m256i index = _mm256_srli_epi32(coords, 16);
+
+		_mm256_storeu_si256((__m256i *)(dst + i), _mm256_i32gather_epi32((const int *)src, index, 4));
+	}
+
+	nearest_row_c(dst + i, src, count - i, x, step);
+}
+
+/* Same as bilinear_row_c, two pixels per iteration. */
+static void
+bilinear_row_sse2 (uint32_t *dst, const uint32_t *row0, const uint32_t *row1,
+				   int count, uint32_t x, uint32_t step, int lastX, unsigned int fy)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(256);
+	__m128i wy = _mm_set1_epi16(fy);
+	__m128i wy0 = _mm_sub_epi16(full, wy);
+	int i;
+
+	for (i = 0; i < count; i += 2)
+	{
+		uint32_t xa = x, xb = (i + 1 < count) ? x + step : x;
+		int ia = xa >> 16, ib = xb >> 16;
+		int ia1 = ia < lastX ? ia + 1 : lastX, ib1 = ib < lastX ? ib + 1 : lastX;
+		unsigned int fa = (xa >> 8) & 0xFF, fb = (xb >> 8) & 0xFF;
+
+		__m128i left0 = _mm_unpacklo_epi8(_mm_setr_epi32(row0[ia], row0[ib], 0, 0), zero);
+		__m128i right0 = _mm_unpacklo_epi8(_mm_setr_epi32(row0[ia1], row0[ib1], 0, 0), zero);
+		__m128i left1 = _mm_unpacklo_epi8(_mm_setr_epi32(row1[ia], row1[ib], 0, 0), zero);
+		__m128i right1 = _mm_unpacklo_epi8(_mm_setr_epi32(row1[ia1], row1[ib1], 0, 0), zero);
+
+		__m128i wx = _mm_setr_epi16(fa, fa, fa, fa, fb, fb, fb, fb);
+		__m128i wx0 = _mm_sub_epi16(full, wx);
+
+		__m128i top = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(left0, wx0), _mm_mullo_epi16(right0, wx)), 8);
+		__m128i bottom = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(left1, wx0), _mm_mullo_epi16(right1, wx)), 8);
+		__m128i result = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(top, wy0), _mm_mullo_epi16(bottom, wy)), 8);
+
+		result = _mm_packus_epi16(result, zero);
+
+		if (i + 1 < count)
+			_mm_storel_epi64((__m128i *)(dst + i), result);
+		else
+			dst[i] = _mm_cvtsi128_si32(result);
+
+		x += 2 * step;
+	}
+}
+
+#endif
+
+/* Worker pool; a job is split into bands of rows that threads grab until
+ * none are left. */
+
+typedef void (*band_func) (void *data, int rowStart, int rowEnd);
+
+static pthread_mutex_t	poolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	poolWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	poolDone = PTHREAD_COND_INITIALIZER;
+static int				poolThreadCount;
+static unsigned int		poolGeneration;
+static int				poolBusy;
+
+static band_func		jobFunc;
+static void				*jobData;
+static int				jobRows;
+static volatile int		jobNextRow;
+
+static void
+run_bands (void)
+{
+	int row;
+
+	while ((row = __sync_fetch_and_add(&jobNextRow, BAND_ROWS)) < jobRows)
+		jobFunc(jobData, row, row + BAND_ROWS < jobRows ? row + BAND_ROWS : jobRows);
+}
+
+static void *
+pool_thread (void *arg)
+{
+	unsigned int generation = 0;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&poolMutex);
+		while (poolGeneration == generation)
+			pthread_cond_wait(&poolWork, &poolMutex);
+		generation = poolGeneration;
+		pthread_mutex_unlock(&poolMutex);
+
+		run_bands();
+
+		pthread_mutex_lock(&poolMutex);
+		if (--poolBusy == 0)
+			pthread_cond_signal(&poolDone);
+		pthread_mutex_unlock(&poolMutex);
+	}
+
+	return NULL;
+}
+
+static void
+run_job (band_func func, void *data, int rows)
+{
+	if (rows <= 0)
+		return;
+
+	jobFunc = func;
+	jobData = data;
+	jobRows = rows;
+	jobNextRow = 0;
+
+	// Not worth waking anyone for a cursor
+	if (!poolThreadCount || rows <= BAND_ROWS)
+	{
+		run_bands();
+		return;
+	}
+
+	pthread_mutex_lock(&poolMutex);
+	poolBusy = poolThreadCount;
+	poolGeneration++;
+	pthread_cond_broadcast(&poolWork);
+	pthread_mutex_unlock(&poolMutex);
+
+	run_bands();
+
+	pthread_mutex_lock(&poolMutex);
+	while (poolBusy)
+		pthread_cond_wait(&poolDone, &poolMutex);
+	pthread_mutex_unlock(&poolMutex);
+}
+
+void
+cpu_composite_init (int threads)
+{
+	int i;
+
+	fill_row = fill_row_c;
+	blend_row = blend_row_c;
+	nearest_row = nearest_row_c;
+	bilinear_row = bilinear_row_c;
+
+#ifdef CPU_COMPOSITE_X86
+	__builtin_cpu_init();
+
+	if (__builtin_cpu_supports("avx2"))
+	{
+		fill_row = fill_row_avx2;
+		blend_row = blend_row_avx2;
+		nearest_row = nearest_row_avx2;
+		bilinear_row = bilinear_row_sse2;
+		kernelISA = "AVX2";
+	}
+	else if (__builtin_cpu_supports("sse2"))
+	{
+		fill_row = fill_row_sse2;
+		blend_row = blend_row_sse2;
+		nearest_row = nearest_row_sse2;
+		bilinear_row = bilinear_row_sse2;
+		kernelISA = "SSE2";
+	}
+#endif
+
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > MAX_THREADS)
+		threads = MAX_THREADS;
+
+	// The calling thread does its share too
+	for (i = 0; i < threads - 1; i++)
+	{
+		pthread_t thread;
+
+		if (pthread_create(&thread, NULL, pool_thread, NULL) != 0)
+			break;
+		pthread_detach(thread);
+		poolThreadCount++;
+	}
+}
+
+const char *
+cpu_composite_isa (void)
+{
+	return kernelISA;
+}
+
+/* Operations */
+
+typedef struct _fill_job {
+	cpu_surface	*dst;
+	int			x, y, width;
+	uint32_t	color;
+	unsigned int	alpha;
+} fill_job;
+
+typedef struct _draw_job {
+	cpu_surface			*dst;
+	const cpu_surface	*src;
+	int				x, y, width, height;
+	int				clipX, clipWidth, clipY;
+	unsigned int	alpha;
+	int				useSourceAlpha;
+	int				bilinear;
+	uint32_t		stepX, stepY;
+} draw_job;
+
+static __thread uint32_t	*rowBuffer;
+static __thread int			rowBufferSize;
+
+static uint32_t *
+get_row_buffer (int width)
+{
+	if (width > rowBufferSize)
+	{
+		free(rowBuffer);
+		rowBuffer = malloc(width * sizeof(uint32_t));
+		rowBufferSize = rowBuffer ? width : 0;
+	}
+
+	return rowBuffer;
+}
+
+static void
+fill_band (void *data, int rowStart, int rowEnd)
+{
+	fill_job *job = data;
+	uint32_t *solid = NULL;
+	int row;
+
+	if (job->alpha < 255)
+	{
+		solid = get_row_buffer(job->width);
+		if (!solid)
+			return;
+		fill_row(solid, job->width, job->color);
+	}
+
+	for (row = rowStart; row < rowEnd; row++)
+	{
+		uint32_t *dst = job->dst->pixels + (job->y + row) * job->dst->stride + job->x;
+
+		if (solid)
+			blend_row(dst, solid, job->width, job->alpha, 0);
+		else
+			fill_row(dst, job->width, job->color);
+	}
+}
+
+static void
+draw_band (void *data, int rowStart, int rowEnd)
+{
+	draw_job *job = data;
+	const cpu_surface *src = job->src;
+	int scaled = job->width != src->width || job->height != src->height;
+	int opaque = job->alpha == 255 && !job->useSourceAlpha;
+	uint32_t *scratch = NULL;
+	int row;
+
+	if (scaled)
+	{
+		scratch = get_row_buffer(job->clipWidth);
+		if (!scratch)
+			return;
+	}
+
+	for (row = rowStart; row < rowEnd; row++)
+	{
+		int dstY = job->clipY + row;
+		uint32_t *dst = job->dst->pixels + dstY * job->dst->stride + job->clipX;
+		const uint32_t *line;
+
+		if (scaled)
+		{
+			// Sample at pixel centers, like GL does
+			uint32_t x = job->stepX / 2 + (job->clipX - job->x) * job->stepX;
+			int64_t y = (int64_t)job->stepY / 2 + (int64_t)(dstY - job->y) * job->stepY - 32768;
+
+			if (job->bilinear)
+			{
+				int srcY, srcY1;
+
+				x = x >= 32768 ? x - 32768 : 0;
+				if (y < 0)
+					y = 0;
+				srcY = y >> 16;
+				if (srcY > src->height - 1)
+					srcY = src->height - 1;
+				srcY1 = srcY < src->height - 1 ? srcY + 1 : srcY;
+
+				bilinear_row(scratch, src->pixels + srcY * src->stride,
+							 src->pixels + srcY1 * src->stride,
+							 job->clipWidth, x, job->stepX, src->width - 1, (y >> 8) & 0xFF);
+			}
+			else
+			{
+				int srcY = (y + 32768) >> 16;
+
+				if (srcY > src->height - 1)
+					srcY = src->height - 1;
+
+				nearest_row(scratch, src->pixels + srcY * src->stride, job->clipWidth, x, job->stepX);
+			}
+
+			line = scratch;
+		}
+		else
+		{
+			line = src->pixels + (dstY - job->y) * src->stride + (job->clipX - job->x);
+		}
+
+		if (opaque)
+		{
+			int i;
+
+			for (i = 0; i < job->clipWidth; i++)
+				dst[i] = line[i] | 0xFF000000;
+		}
+		else
+		{
+			blend_row(dst, line, job->clipWidth, job->alpha, job->useSourceAlpha);
+		}
+	}
+}
+
+void
+cpu_fill_rect (cpu_surface *dst, int x, int y, int width, int height,
+			   uint32_t color, unsigned int alpha)
+{
+	fill_job job;
+
+	if (x < 0) { width += x; x = 0; }
+	if (y < 0) { height += y; y = 0; }
+	if (x + width > dst->width)
+		width = dst->width - x;
+	if (y + height > dst->height)
+		height = dst->height - y;
+
+	if (width <= 0 || height <= 0 || alpha == 0)
+		return;
+
+	job.dst = dst;
+	job.x = x;
+	job.y = y;
+	job.width = width;
+	job.color = color;
+	job.alpha = alpha;
+
+	run_job(fill_band, &job, height);
+}
+
+void
+cpu_draw_surface (cpu_surface *dst, const cpu_surface *src,
+				  int x, int y, int width, int height,
+				  unsigned int alpha, int useSourceAlpha, int bilinear)
+{
+	draw_job job;
+	int clipX2, clipY2;
+
+	if (width <= 0 || height <= 0 || !src->width || !src->height || alpha == 0)
+		return;
+
+	job.dst = dst;
+	job.src = src;
+	job.x = x;
+	job.y = y;
+	job.width = width;
+	job.height = height;
+	job.alpha = alpha > 255 ? 255 : alpha;
+	job.useSourceAlpha = useSourceAlpha;
+	job.bilinear = bilinear;
+	job.stepX = ((uint64_t)src->width << 16) / width;
+	job.stepY = ((uint64_t)src->height << 16) / height;
+
+	job.clipX = x < 0 ? 0 : x;
+	job.clipY = y < 0 ? 0 : y;
+	clipX2 = x + width > dst->width ? dst->width : x + width;
+	clipY2 = y + height > dst->height ? dst->height : y + height;
+	job.clipWidth = clipX2 - job.clipX;
+
+	if (job.clipWidth <= 0 || clipY2 <= job.clipY)
+		return;
+
+	run_job(draw_band, &job, clipY2 - job.clipY);
+}
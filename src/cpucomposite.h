@@ -0,0 +1,36 @@
+/*
+ * Software compositing kernels for the CPU backend: scaled blits, blending
+ * with opacity and solid fills on 32bpp XRGB/ARGB surfaces, split in row
+ * bands across a pool of worker threads.
+ */
+
+#ifndef CPUCOMPOSITE_H
+#define CPUCOMPOSITE_H
+
+#include <stdint.h>
+
+typedef struct _cpu_surface {
+	uint32_t	*pixels;
+	int			stride;		/* in pixels */
+	int			width;
+	int			height;
+} cpu_surface;
+
+/* threads <= 0 picks one per online CPU. */
+void cpu_composite_init (int threads);
+
+/* Name of the instruction set the kernels ended up using. */
+const char *cpu_composite_isa (void);
+
+/* Fills a rectangle, blending with alpha (0-255) if below 255. */
+void cpu_fill_rect (cpu_surface *dst, int x, int y, int width, int height,
+					uint32_t color, unsigned int alpha);
+
+/* Draws src scaled to the given rectangle of dst. Coverage is alpha (0-255),
+ * multiplied by the source alpha channel if useSourceAlpha is set; results
+ * are always opaque. */
+void cpu_draw_surface (cpu_surface *dst, const cpu_surface *src,
+					   int x, int y, int width, int height,
+					   unsigned int alpha, int useSourceAlpha, int bilinear);
+
+#endif
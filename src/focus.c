@@ -0,0 +1,92 @@
+/*
+ * Game window focus scoring. Only looks at what it's handed, so recorded
+ * map, damage and stacking sequences can be replayed against it.
+ */
+
+#include "focus.h"
+
+/* Mostly how steadily the window renders, then how much of the screen it
+ * covers, how high it's stacked, how long it's been mapped and whether it
+ * has the most recent damage. Windows that only drew a handful of frames,
+ * like splash screens and launchers, quickly fall behind one rendering
+ * continuously.
+ */
+float
+focus_score (const focus_candidate *candidate, unsigned int stackIndex,
+			 unsigned long maxDamageSequence, uint64_t now)
+{
+	float rate = 0.0f;
+	float area, age;
+
+	if (candidate->lastDamageTime && candidate->frameInterval > 0.0f)
+	{
+		float interval = candidate->frameInterval;
+		float sinceDamage = now > candidate->lastDamageTime ?
+			(now - candidate->lastDamageTime) / 1000.0f : 0.0f;
+
+		// A window that stopped drawing decays instead of keeping its old rate
+		if (sinceDamage > interval)
+			interval = sinceDamage;
+
+		rate = 1000.0f / interval / FOCUS_FULL_RATE;
+		if (rate > 1.0f)
+			rate = 1.0f;
+	}
+
+	area = candidate->area;
+	if (area > 1.0f)
+		area = 1.0f;
+
+	age = now > candidate->mapTime ?
+		(now - candidate->mapTime) / (FOCUS_SETTLE_TIME * 1000.0f) : 0.0f;
+	if (age > 1.0f)
+		age = 1.0f;
+
+	return FOCUS_WEIGHT_RATE * rate +
+		FOCUS_WEIGHT_AREA * area +
+		FOCUS_WEIGHT_STACKING / (1.0f + stackIndex) +
+		FOCUS_WEIGHT_AGE * age +
+		(candidate->damageSequence && candidate->damageSequence == maxDamageSequence ?
+		 FOCUS_WEIGHT_RECENT : 0.0f);
+}
+
+int
+focus_pick (focus_candidate *candidates, int count, int current,
+			uint64_t now, uint64_t focusStartTime)
+{
+	unsigned long maxDamageSequence = 0;
+	int best[2] = { -1, -1 };
+	int focus;
+	int i;
+
+	for (i = 0; i < count; i++)
+	{
+		if (candidates[i].damageSequence > maxDamageSequence)
+			maxDamageSequence = candidates[i].damageSequence;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		int overrideRedirect = !!candidates[i].overrideRedirect;
+
+		candidates[i].score = focus_score(&candidates[i], i, maxDamageSequence, now);
+
+		if (best[overrideRedirect] < 0 ||
+			candidates[i].score > candidates[best[overrideRedirect]].score)
+			best[overrideRedirect] = i;
+	}
+
+	// Override redirect windows are allowed, but between the two a regular
+	// window always wins
+	focus = best[0] >= 0 ? best[0] : best[1];
+
+	// Hold on to the focused game unless something else clearly took over;
+	// moving away from an override redirect window is never held back
+	if (focus >= 0 && current >= 0 && current < count && current != focus &&
+		!candidates[current].overrideRedirect == !candidates[focus].overrideRedirect &&
+		(candidates[focus].score < candidates[current].score + FOCUS_SCORE_MARGIN ||
+		 now - focusStartTime < FOCUS_MIN_DWELL * 1000))
+		focus = current;
+
+	return focus;
+}
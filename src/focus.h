@@ -0,0 +1,45 @@
+/*
+ * Game window focus scoring. A candidate has to beat the focused window by
+ * FOCUS_SCORE_MARGIN, and the focused window has to have been focused for
+ * FOCUS_MIN_DWELL milliseconds, before focus moves between two games.
+ */
+
+#ifndef FOCUS_H
+#define FOCUS_H
+
+#include <stdint.h>
+
+#define FOCUS_WEIGHT_RATE 0.45f
+#define FOCUS_WEIGHT_AREA 0.25f
+#define FOCUS_WEIGHT_STACKING 0.1f
+#define FOCUS_WEIGHT_AGE 0.1f
+#define FOCUS_WEIGHT_RECENT 0.1f
+#define FOCUS_FULL_RATE 30.0f
+#define FOCUS_SETTLE_TIME 2000
+#define FOCUS_SCORE_MARGIN 0.2f
+#define FOCUS_MIN_DWELL 1000
+
+/* What's known about a mapped game window; all times are in usec. */
+typedef struct _focus_candidate {
+	float			frameInterval;		/* average client frame interval in ms, 0 if unknown */
+	uint64_t		lastDamageTime;		/* 0 if never damaged */
+	uint64_t		mapTime;
+	float			area;				/* fraction of the screen covered */
+	unsigned long	damageSequence;		/* 0 if never damaged */
+	int				overrideRedirect;	/* and not told to ignore that */
+	float			score;				/* set by focus_pick */
+} focus_candidate;
+
+/* How much a window looks like the one the user is playing, from 0 to 1.
+ * stackIndex is its position among the candidates, topmost first. */
+float focus_score (const focus_candidate *candidate, unsigned int stackIndex,
+				   unsigned long maxDamageSequence, uint64_t now);
+
+/* Scores count candidates given in stacking order, topmost first, and
+ * returns the index of the one to focus, or -1 if count is 0. current is
+ * the index of the focused window, or -1 if it isn't a candidate, and
+ * focusStartTime when it got focus. */
+int focus_pick (focus_candidate *candidates, int count, int current,
+				uint64_t now, uint64_t focusStartTime);
+
+#endif
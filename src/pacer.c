@@ -0,0 +1,81 @@
+/*
+ * Frame pacing. Pure functions of the measured client frame interval and
+ * vblank times handed in, so they can be driven by a fake clock.
+ */
+
+#include <math.h>
+
+#include "pacer.h"
+
+void
+pacer_set_cadence (frame_pacer *pacer, float frameInterval, float vblankInterval)
+{
+	float ratio, nearest;
+
+	if (frameInterval <= 0.0f || vblankInterval <= 0.0f)
+	{
+		pacer->ratio = 0.0f;
+		return;
+	}
+
+	ratio = frameInterval / vblankInterval;
+	nearest = roundf(ratio);
+
+	// 30 FPS measured at 33.1ms is still 30 FPS
+	if (fabsf(ratio - nearest) < PACING_RATIO_SNAP * nearest)
+		ratio = nearest;
+
+	// Only follow real cadence changes; re-phasing the pattern on every bit
+	// of measurement noise would bring the judder right back
+	if (fabsf(ratio - pacer->ratio) > PACING_RATIO_SNAP)
+	{
+		pacer->ratio = ratio;
+		pacer->accumulator = 0.0f;
+	}
+}
+
+int
+pacer_active (const frame_pacer *pacer)
+{
+	return pacer->ratio >= PACING_MIN_RATIO;
+}
+
+uint64_t
+pacer_schedule_frame (frame_pacer *pacer, uint64_t nextVblank, uint64_t vblankInterval)
+{
+	uint64_t target;
+	int vblanks;
+
+	// 40 FPS on a 16.667ms refresh is 1.49997 vblanks; round up what is
+	// within float noise of the next vblank, or every other 1/2 pattern
+	// turns into a 1/1 followed by a late frame
+	pacer->accumulator += pacer->ratio;
+	vblanks = (int)(pacer->accumulator + 0.01f);
+	pacer->accumulator -= vblanks;
+
+	target = pacer->lastVblank + vblanks * vblankInterval;
+
+	// Too late for its slot, or the first frame: show it as soon as possible
+	// and start the pattern over from there
+	if (!pacer->lastVblank || target < nextVblank)
+	{
+		target = nextVblank;
+		pacer->accumulator = 0.0f;
+	}
+
+	pacer->targetVblank = target;
+
+	return target;
+}
+
+void
+pacer_frame_presented (frame_pacer *pacer, int paced)
+{
+	// Anything shown outside of the schedule breaks the pattern
+	if (paced)
+		pacer->lastVblank = pacer->targetVblank;
+	else if (pacer->targetVblank)
+		pacer->lastVblank = 0;
+
+	pacer->targetVblank = 0;
+}
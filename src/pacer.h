@@ -0,0 +1,37 @@
+/*
+ * Frame pacing for games rendering below the refresh rate: every client
+ * frame gets assigned a vblank so that frames stay on screen for an even,
+ * or evenly alternating, number of refresh intervals.
+ */
+
+#ifndef PACER_H
+#define PACER_H
+
+#include <stdint.h>
+
+#define PACING_MIN_RATIO 1.05f
+#define PACING_RATIO_SNAP 0.05f
+
+typedef struct _frame_pacer {
+	float		ratio;			/* client frame interval, in vblanks */
+	float		accumulator;	/* fractional vblanks carried over */
+	uint64_t	lastVblank;		/* vblank the previous frame went out at */
+	uint64_t	targetVblank;	/* vblank the pending frame is held for */
+} frame_pacer;
+
+/* Follows the client frame interval, both in milliseconds; measurement
+ * noise doesn't change the cadence. */
+void pacer_set_cadence (frame_pacer *pacer, float frameInterval, float vblankInterval);
+
+/* Whether the client is slow enough for pacing to make a difference. */
+int pacer_active (const frame_pacer *pacer);
+
+/* Picks the vblank a new client frame should be shown at. nextVblank is the
+ * earliest vblank the frame can still make; all times are in usec. */
+uint64_t pacer_schedule_frame (frame_pacer *pacer, uint64_t nextVblank, uint64_t vblankInterval);
+
+/* Called once per composited frame; paced is set if it went out at the
+ * vblank pacer_schedule_frame picked. */
+void pacer_frame_presented (frame_pacer *pacer, int paced);
+
+#endif
@@ -0,0 +1,373 @@
+/*
+ * Starts the compositor, waits until it reports being ready, then starts the
+ * session clients. The compositor is restarted right away if it dies; the
+ * session ends when the client does.
+ *
+ * usage: session_supervisor [options] compositor [args...] -- client [args...]
+ *
+ * The compositor gets "-R fd" appended to its arguments and is expected to
+ * write READY=1 to that fd once it is compositing.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/poll.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define			DEFAULT_READY_TIMEOUT 10000
+// Restarting faster than this means we're in a crash loop; slow down
+#define			RESTART_MIN_INTERVAL 1000
+// How long the session gets to exit on SIGTERM before it's killed
+#define			SHUTDOWN_TIMEOUT 5000
+#define			SHUTDOWN_POLL_INTERVAL 10
+
+static char		*programName;
+
+static char		**compositorArgs;
+static char		**clientArgs;
+
+static pid_t	compositorPid = -1;
+static pid_t	clientPid = -1;
+
+static int		readyTimeout = DEFAULT_READY_TIMEOUT;
+static int		maxRestarts = -1;
+
+static unsigned int	restartCount;
+static uint64_t	lastStartTime;
+static uint64_t	lastDeathTime;
+
+static volatile sig_atomic_t	terminating;
+
+static uint64_t
+get_time_in_milliseconds (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+handle_signal (int signal)
+{
+	terminating = signal;
+}
+
+static pid_t
+spawn (char **args, int readyFd)
+{
+	pid_t pid = fork();
+
+	if (pid < 0)
+	{
+		fprintf (stderr, "%s: fork failed: %s\n", programName, strerror(errno));
+		return -1;
+	}
+
+	if (pid == 0)
+	{
+		sigset_t mask;
+
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+
+		// The ready pipe is close-on-exec; only the compositor's end survives
+		if (readyFd >= 0)
+			fcntl(readyFd, F_SETFD, 0);
+
+		execvp(args[0], args);
+		fprintf (stderr, "%s: couldn't run %s: %s\n", programName, args[0], strerror(errno));
+		_exit (127);
+	}
+
+	return pid;
+}
+
+/* Starts the compositor and waits for it to report readiness, its death or
+ * the timeout. Returns non-zero if it reported being ready.
+ */
+static int
+start_compositor (void)
+{
+	int compositorArgCount = 0;
+	char fdArgument[16];
+	char **args;
+	int fds[2];
+	int ready = 0;
+	uint64_t startTime;
+
+	while (compositorArgs[compositorArgCount])
+		compositorArgCount++;
+
+	if (pipe2(fds, O_CLOEXEC) < 0)
+	{
+		fprintf (stderr, "%s: pipe failed: %s\n", programName, strerror(errno));
+		exit (1);
+	}
+
+	args = calloc(compositorArgCount + 3, sizeof(char *));
+	if (!args)
+		exit (1);
+
+	memcpy(args, compositorArgs, compositorArgCount * sizeof(char *));
+	snprintf(fdArgument, sizeof(fdArgument), "%d", fds[1]);
+	args[compositorArgCount] = "-R";
+	args[compositorArgCount + 1] = fdArgument;
+
+	startTime = get_time_in_milliseconds();
+	lastStartTime = startTime;
+	compositorPid = spawn(args, fds[1]);
+
+	free(args);
+	close(fds[1]);
+
+	while (compositorPid > 0 && !terminating)
+	{
+		struct pollfd pfd = { fds[0], POLLIN, 0 };
+		int elapsed = get_time_in_milliseconds() - startTime;
+		char buffer[64];
+		ssize_t length;
+
+		if (elapsed >= readyTimeout)
+		{
+			fprintf (stderr, "%s: compositor not ready after %dms, carrying on\n",
+					 programName, readyTimeout);
+			break;
+		}
+
+		if (poll(&pfd, 1, readyTimeout - elapsed) <= 0)
+			continue;
+
+		length = read(fds[0], buffer, sizeof(buffer) - 1);
+
+		if (length < 0 && errno == EINTR)
+			continue;
+
+		// The write end only closes early if the compositor went away
+		if (length <= 0)
+			break;
+
+		buffer[length] = '\0';
+		if (strstr(buffer, "READY=1"))
+		{
+			ready = 1;
+			break;
+		}
+	}
+
+	close(fds[0]);
+
+	if (ready)
+	{
+		// Counted from the old one going away, as that's how long the
+		// session went without a compositor
+		if (restartCount)
+			fprintf (stderr, "%s: compositor restarted and ready %llums after it went away (restart %u)\n",
+					 programName, (unsigned long long)(get_time_in_milliseconds() - lastDeathTime),
+					 restartCount);
+		else
+			fprintf (stderr, "%s: compositor ready in %llums\n", programName,
+					 (unsigned long long)(get_time_in_milliseconds() - startTime));
+	}
+
+	return ready;
+}
+
+/* Starts the compositor again, pacing attempts so that neither a crash loop
+ * nor fork failing spins. Gives up after the configured number of restarts.
+ */
+static void
+restart_compositor (void)
+{
+	while (compositorPid < 0 && !terminating)
+	{
+		uint64_t sinceStart;
+
+		if (maxRestarts >= 0 && restartCount >= maxRestarts)
+		{
+			fprintf (stderr, "%s: not restarting the compositor again\n", programName);
+			return;
+		}
+
+		sinceStart = get_time_in_milliseconds() - lastStartTime;
+
+		if (sinceStart < RESTART_MIN_INTERVAL)
+			usleep((RESTART_MIN_INTERVAL - sinceStart) * 1000);
+
+		restartCount++;
+		start_compositor();
+	}
+}
+
+static void
+shutdown_session (void)
+{
+	uint64_t deadline = get_time_in_milliseconds() + SHUTDOWN_TIMEOUT;
+
+	if (clientPid > 0)
+		kill(clientPid, SIGTERM);
+	if (compositorPid > 0)
+		kill(compositorPid, SIGTERM);
+
+	for (;;)
+	{
+		pid_t pid = waitpid(-1, NULL, WNOHANG);
+
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pid > 0)
+		{
+			if (pid == clientPid)
+				clientPid = -1;
+			if (pid == compositorPid)
+				compositorPid = -1;
+			continue;
+		}
+
+		if (get_time_in_milliseconds() >= deadline)
+		{
+			fprintf (stderr, "%s: session still running after %dms, killing it\n",
+					 programName, SHUTDOWN_TIMEOUT);
+
+			if (clientPid > 0)
+				kill(clientPid, SIGKILL);
+			if (compositorPid > 0)
+				kill(compositorPid, SIGKILL);
+
+			while (waitpid(-1, NULL, 0) > 0 || errno == EINTR)
+				;
+			break;
+		}
+
+		usleep(SHUTDOWN_POLL_INTERVAL * 1000);
+	}
+}
+
+static void
+usage (void)
+{
+	fprintf (stderr, "usage: %s [options] compositor [args...] -- client [args...]\n", programName);
+	fprintf (stderr, "Options\n");
+	fprintf (stderr, "   -t timeout\n      Milliseconds to wait for the compositor to be ready. (default %d)\n",
+			 DEFAULT_READY_TIMEOUT);
+	fprintf (stderr, "   -r restarts\n      Give up restarting the compositor after this many times. (default unlimited)\n");
+	exit (1);
+}
+
+int
+main (int argc, char **argv)
+{
+	struct sigaction action;
+	int status = 0;
+	int o, i;
+
+	programName = argv[0];
+
+	while ((o = getopt (argc, argv, "+t:r:")) != -1)
+	{
+		switch (o) {
+			case 't':
+				readyTimeout = atoi(optarg);
+				break;
+			case 'r':
+				maxRestarts = atoi(optarg);
+				break;
+			default:
+				usage ();
+				break;
+		}
+	}
+
+	compositorArgs = &argv[optind];
+
+	for (i = optind; i < argc; i++)
+	{
+		if (!strcmp(argv[i], "--"))
+		{
+			argv[i] = NULL;
+			clientArgs = &argv[i + 1];
+			break;
+		}
+	}
+
+	if (!compositorArgs[0] || !clientArgs || !clientArgs[0])
+		usage ();
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_signal;
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGHUP, &action, NULL);
+
+	start_compositor();
+
+	if (compositorPid < 0)
+	{
+		lastDeathTime = get_time_in_milliseconds();
+		restart_compositor();
+	}
+
+	if (!terminating)
+		clientPid = spawn(clientArgs, -1);
+
+	if (clientPid < 0)
+	{
+		shutdown_session();
+		return 1;
+	}
+
+	for (;;)
+	{
+		pid_t pid = waitpid(-1, &status, 0);
+
+		if (terminating)
+			break;
+
+		if (pid < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pid == clientPid)
+		{
+			clientPid = -1;
+			break;
+		}
+
+		if (pid != compositorPid)
+			continue;
+
+		compositorPid = -1;
+		lastDeathTime = get_time_in_milliseconds();
+
+		if (WIFSIGNALED(status))
+			fprintf (stderr, "%s: compositor killed by signal %d\n", programName, WTERMSIG(status));
+		else
+			fprintf (stderr, "%s: compositor exited with status %d\n", programName, WEXITSTATUS(status));
+
+		restart_compositor();
+	}
+
+	shutdown_session();
+
+	if (!terminating && WIFEXITED(status))
+		return WEXITSTATUS(status);
+
+	return 0;
+}
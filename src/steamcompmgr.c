@@ -31,6 +31,8 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <math.h>
 #include <sys/poll.h>
@@ -38,13 +40,25 @@
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
 #include <X11/Xlib.h>
+#include <X11/Xlib-xcb.h>
 #include <X11/Xutil.h>
 #include <X11/Xatom.h>
 #include <X11/extensions/Xcomposite.h>
 #include <X11/extensions/Xdamage.h>
 #include <X11/extensions/Xrender.h>
 #include <X11/extensions/shape.h>
+#include <X11/extensions/sync.h>
+#include <X11/extensions/Xpresent.h>
+#include <X11/extensions/XShm.h>
 #include <X11/extensions/xf86vmode.h>
 
 #define GL_GLEXT_PROTOTYPES
@@ -54,7 +68,13 @@
 #include "glext.h"
 #include "GL/glxext.h"
 
+#include "cpucomposite.h"
+#include "pacer.h"
+#include "focus.h"
+#include "trace.h"
+
 PFNGLXSWAPINTERVALEXTPROC				__pointer_to_glXSwapIntervalEXT;
+PFNGLXGETSYNCVALUESOMLPROC				__pointer_to_glXGetSyncValuesOML;
 
 void (*__pointer_to_glXBindTexImageEXT) (Display     *display, 
 										 GLXDrawable drawable, 
@@ -74,47 +94,150 @@ PFNGLSTENCILSTROKEPATHINSTANCEDNVPROC 	__pointer_to_glStencilStrokePathInstanced
 PFNGLCOVERFILLPATHINSTANCEDNVPROC 		__pointer_to_glCoverFillPathInstancedNV;
 PFNGLCOVERSTROKEPATHINSTANCEDNVPROC 	__pointer_to_glCoverStrokePathInstancedNV;
 
+PFNGLGENQUERIESPROC						__pointer_to_glGenQueries;
+PFNGLBEGINQUERYPROC						__pointer_to_glBeginQuery;
+PFNGLENDQUERYPROC						__pointer_to_glEndQuery;
+PFNGLGETQUERYOBJECTUIVPROC				__pointer_to_glGetQueryObjectuiv;
+PFNGLGETQUERYOBJECTUI64VPROC			__pointer_to_glGetQueryObjectui64v;
+
+PFNGLIMPORTSYNCEXTPROC					__pointer_to_glImportSyncEXT;
+PFNGLWAITSYNCPROC						__pointer_to_glWaitSync;
+PFNGLCLIENTWAITSYNCPROC					__pointer_to_glClientWaitSync;
+PFNGLDELETESYNCPROC						__pointer_to_glDeleteSync;
+
+PFNGLGENFRAMEBUFFERSPROC				__pointer_to_glGenFramebuffers;
+PFNGLBINDFRAMEBUFFERPROC				__pointer_to_glBindFramebuffer;
+PFNGLFRAMEBUFFERTEXTURE2DPROC			__pointer_to_glFramebufferTexture2D;
+PFNGLCHECKFRAMEBUFFERSTATUSPROC			__pointer_to_glCheckFramebufferStatus;
+PFNGLBLITFRAMEBUFFERPROC				__pointer_to_glBlitFramebuffer;
+
 typedef struct _ignore {
 	struct _ignore	*next;
 	unsigned long	sequence;
 } ignore;
 
+/* The subset of XWindowAttributes the compositor keeps track of. */
+typedef struct _win_attributes {
+	int			x, y;
+	int			width, height;
+	int			border_width;
+	int			depth;
+	int			class;
+	int			map_state;
+	Bool		override_redirect;
+} win_attributes;
+
+/* Per-window state that's only read for some windows or on some events:
+ * frame statistics, Present feedback, size hints and the opaque region of
+ * translucent windows.
+ */
+typedef struct _win_cold {
+	/* client frame statistics */
+	float		frameIntervalVariance;
+	unsigned int	clientFrameCount;
+	unsigned int	droppedFrames;
+	unsigned int	duplicatedFrames;
+	
+	/* Present extension feedback for clients using PresentPixmap */
+	XID			presentEventId;
+	uint32_t	presentSerial;
+	Bool		presentPending;
+	unsigned int	clientPresentCount;
+	uint32_t	feedbackSwapSerial;
+	uint32_t	feedbackClientSerial;
+	
+	Bool sizeHintsSpecified;
+	unsigned int requestedWidth;
+	unsigned int requestedHeight;
+	Bool nudged;
+	
+	int mouseMoved;
+	
+	VisualID visualid;
+	
+	/* _NET_WM_WINDOW_TYPE, WIN_TYPE_UNKNOWN until it's needed */
+	Atom		windowType;
+	
+	/* _NET_WM_OPAQUE_REGION, for windows painted with their alpha */
+	XRectangle	*opaqueRects;
+	int			opaqueRectCount;
+} win_cold;
+
 typedef struct _win {
-	struct _win		*next;
+	struct _win		*next;		/* next window down the stacking order */
+	struct _win		*prev;		/* next window up */
+	struct _win		*hashNext;
 	Window		id;
 	Pixmap		pixmap;
 	GLXPixmap	glxPixmap;
 	GLXFBConfig fbConfig;
 	GLuint		texName;
-	XWindowAttributes	a;
+	XSyncFence	fence;
+	GLsync		glFence;
+	Bool		fenceTriggered;
+	Bool		fenceDirty;
+	
+	/* texture residency */
+	unsigned long	textureSize;
+	unsigned int	lastPaintTime;
+	Bool		evicted;
+	
+	/* CPU backend copy of the contents */
+	uint32_t	*cpuPixels;
+	int			cpuWidth, cpuHeight;
+	
+	/* XRender backend picture of the pixmap */
+	Picture		picture;
+	
+	/* damage not read back or painted yet, on backends that need to know */
+	int			damageBoxX1, damageBoxY1, damageBoxX2, damageBoxY2;
+	
+	/* damage events since the last pass of the main loop, and whether they
+	 * are being coalesced because there were too many */
+	unsigned int	damageEvents;
+	Bool		damageFlooded;
+	Bool		damageSubtractPending;
+	uint64_t	damageFloodTime;
+	
+	win_attributes	a;
 	int			mode;
 	int			damaged;
 	Damage		damage;
 	unsigned int	opacity;
 	unsigned long	map_sequence;
 	unsigned long	damage_sequence;
+	uint64_t	lastDamageTime;
+	uint64_t	mapTime;
+	float		focusScore;
+	
+	/* client frame pacing, derived from damage arrival times */
+	float		frameIntervalAverage;
+	unsigned int	framesSincePaint;
+	
+	unsigned int	presentationMode;
 	
 	Bool isSteam;
 	unsigned long long int gameID;
 	Bool isOverlay;
 	Bool isFullscreen;
 	Bool isHidden;
-	Bool sizeHintsSpecified;
-	unsigned int requestedWidth;
-	unsigned int requestedHeight;
-	Bool nudged;
 	Bool ignoreOverrideRedirect;
 	Bool validContents;
 	
-	Bool mouseMoved;
+	/* never shown as it is, so it has no damage object or texture */
+	Bool passive;
+	
+	/* NULL on snapshots, see snapshot_win */
+	win_cold	*cold;
 } win;
 
+#include "winlist.h"
+
 typedef struct _conv {
 	int	    size;
 	double  *data;
 } conv;
 
-static win		*list;
 static int		scr;
 static Window		root;
 static Picture		rootPicture;
@@ -160,6 +283,8 @@ Bool 			cursorImageDirty = True;
 int 			cursorHotX, cursorHotY;
 int				cursorWidth, cursorHeight;
 GLuint			cursorTextureName;
+float			fakeCursorX, fakeCursorY;
+float			fakeCursorWidth, fakeCursorHeight;
 
 Bool			cursorVisible = True;
 Bool			hideCursorForScale;
@@ -172,6 +297,8 @@ unsigned long	damageSequence = 0;
 
 #define			CURSOR_HIDE_TIME 10000
 
+unsigned int	cursorHideTime = CURSOR_HIDE_TIME;
+
 Bool			gotXError = False;
 
 win				fadeOutWindow;
@@ -180,6 +307,36 @@ unsigned int	fadeOutStartTime;
 
 #define			FADE_OUT_DURATION 200
 
+unsigned int	fadeOutDuration = FADE_OUT_DURATION;
+GLint			scaleFilter = GL_LINEAR;
+
+// Synchronous requests we know about, for the stats
+unsigned long	xRoundTrips;
+
+// Windows sending more damage events than this in one pass of the main loop
+// only get their damage subtracted once per pass, for at least
+// DAMAGE_FLOOD_HOLD milliseconds
+#define			DAMAGE_FLOOD_EVENTS 32
+#define			DAMAGE_FLOOD_HOLD 2000
+
+unsigned int	damageEventCount;
+unsigned int	damageEventsPerPass;
+unsigned int	maxDamageEventsPerPass;
+unsigned int	damageFloodCount;
+
+// Event processing stops this long before the next paint is due, leaving
+// the rest of the queue for after it; it always gets at least
+// EVENT_MIN_BUDGET to make progress. Both in microseconds.
+#define			EVENT_PAINT_MARGIN 4000
+#define			EVENT_MIN_BUDGET 1000
+
+unsigned long	deferredEventCount;
+unsigned long	coalescedEventCount;
+uint64_t		maxEventDrainTime;
+
+// Windows found to never need compositing, like menus and tooltips
+unsigned long	passiveWinCount;
+
 /* find these once and be done with it */
 static Atom		steamAtom;
 static Atom		gameAtom;
@@ -197,10 +354,22 @@ static Atom		winUtilAtom;
 static Atom		winSplashAtom;
 static Atom		winDialogAtom;
 static Atom		winNormalAtom;
+static Atom		winDropdownMenuAtom;
+static Atom		winPopupMenuAtom;
+static Atom		winTooltipAtom;
+static Atom		winNotificationAtom;
+static Atom		winComboAtom;
+static Atom		winDNDAtom;
 static Atom		sizeHintsAtom;
 static Atom		fullscreenAtom;
 static Atom		WMStateAtom;
 static Atom		WMStateHiddenAtom;
+static Atom		frameStatsAtom;
+static Atom		presentationModeAtom;
+static Atom		presentFeedbackAtom;
+static Atom		stateCheckpointAtom;
+static Atom		scaledCursorAtom;
+static Atom		opaqueRegionAtom;
 
 GLXContext glContext;
 
@@ -212,6 +381,82 @@ GLXContext glContext;
 #define GAMES_RUNNING_PROP 	"STEAM_GAMES_RUNNING"
 #define SCREEN_SCALE_PROP	"STEAM_SCREEN_SCALE"
 #define SCREEN_MAGNIFICATION_PROP	"STEAM_SCREEN_MAGNIFICATION"
+#define FRAME_STATS_PROP	"STEAM_GAME_FRAME_STATS"
+#define PRESENTATION_MODE_PROP	"STEAM_PRESENTATION_MODE"
+#define PRESENT_FEEDBACK_PROP	"STEAM_PRESENT_FEEDBACK"
+#define STATE_CHECKPOINT_PROP	"STEAM_COMPOSITOR_STATE"
+#define SCALED_CURSOR_NAME		"steamcompmgr-scaled-cursor"
+
+/* interned in one request at startup */
+static const struct {
+	Atom		*atom;
+	char		*name;
+} atomTable[] = {
+	{ &steamAtom, STEAM_PROP },
+	{ &gameAtom, GAME_PROP },
+	{ &overlayAtom, OVERLAY_PROP },
+	{ &opacityAtom, OPACITY_PROP },
+	{ &gamesRunningAtom, GAMES_RUNNING_PROP },
+	{ &screenScaleAtom, SCREEN_SCALE_PROP },
+	{ &screenZoomAtom, SCREEN_MAGNIFICATION_PROP },
+	{ &winTypeAtom, "_NET_WM_WINDOW_TYPE" },
+	{ &winDesktopAtom, "_NET_WM_WINDOW_TYPE_DESKTOP" },
+	{ &winDockAtom, "_NET_WM_WINDOW_TYPE_DOCK" },
+	{ &winToolbarAtom, "_NET_WM_WINDOW_TYPE_TOOLBAR" },
+	{ &winMenuAtom, "_NET_WM_WINDOW_TYPE_MENU" },
+	{ &winUtilAtom, "_NET_WM_WINDOW_TYPE_UTILITY" },
+	{ &winSplashAtom, "_NET_WM_WINDOW_TYPE_SPLASH" },
+	{ &winDialogAtom, "_NET_WM_WINDOW_TYPE_DIALOG" },
+	{ &winNormalAtom, "_NET_WM_WINDOW_TYPE_NORMAL" },
+	{ &winDropdownMenuAtom, "_NET_WM_WINDOW_TYPE_DROPDOWN_MENU" },
+	{ &winPopupMenuAtom, "_NET_WM_WINDOW_TYPE_POPUP_MENU" },
+	{ &winTooltipAtom, "_NET_WM_WINDOW_TYPE_TOOLTIP" },
+	{ &winNotificationAtom, "_NET_WM_WINDOW_TYPE_NOTIFICATION" },
+	{ &winComboAtom, "_NET_WM_WINDOW_TYPE_COMBO" },
+	{ &winDNDAtom, "_NET_WM_WINDOW_TYPE_DND" },
+	{ &sizeHintsAtom, "WM_NORMAL_HINTS" },
+	{ &fullscreenAtom, "_NET_WM_STATE_FULLSCREEN" },
+	{ &WMStateAtom, "_NET_WM_STATE" },
+	{ &WMStateHiddenAtom, "_NET_WM_STATE_HIDDEN" },
+	{ &frameStatsAtom, FRAME_STATS_PROP },
+	{ &presentationModeAtom, PRESENTATION_MODE_PROP },
+	{ &presentFeedbackAtom, PRESENT_FEEDBACK_PROP },
+	{ &stateCheckpointAtom, STATE_CHECKPOINT_PROP },
+	{ &scaledCursorAtom, SCALED_CURSOR_NAME },
+	{ &opaqueRegionAtom, "_NET_WM_OPAQUE_REGION" },
+};
+
+#define ATOM_COUNT (sizeof(atomTable) / sizeof(atomTable[0]))
+
+// State a restarted compositor can't derive from the windows themselves,
+// kept on the root window. Layout, as CARDINALs:
+//   version, focus window, window count,
+//   then for each mapped window: id, damage order, STATE_FLAG_* flags
+#define			STATE_CHECKPOINT_VERSION 1
+#define			STATE_CHECKPOINT_HEADER 3
+#define			STATE_CHECKPOINT_MAX_WINDOWS 256
+#define			STATE_CHECKPOINT_PERIOD 500
+
+#define			STATE_FLAG_NUDGED (1 << 0)
+#define			STATE_FLAG_IGNORE_OVERRIDE_REDIRECT (1 << 1)
+#define			STATE_FLAG_VALID_CONTENTS (1 << 2)
+#define			STATE_FLAG_HIDDEN (1 << 3)
+
+long			stateCheckpoint[STATE_CHECKPOINT_HEADER + 3 * STATE_CHECKPOINT_MAX_WINDOWS];
+unsigned int	stateCheckpointLength;
+unsigned int	lastStateCheckpointTime;
+
+// Startup phases, reported once the first frame is out
+#define			STARTUP_PHASE_MAX 12
+
+typedef struct _startup_phase {
+	const char	*name;
+	uint64_t	time;
+} startup_phase;
+
+uint64_t		startupTime;
+startup_phase	startupPhases[STARTUP_PHASE_MAX];
+unsigned int	startupPhaseCount;
 
 #define TRANSLUCENT	0x00000000
 #define OPAQUE		0xffffffff
@@ -227,9 +472,242 @@ unsigned int	frameCounter;
 unsigned int	lastSampledFrameTime;
 float			currentFrameRate;
 
+// Client frame statistics; intervals above the idle threshold are treated
+// as the client pausing rather than as a very slow frame.
+#define			FRAME_STATS_SMOOTHING 0.1f
+#define			FRAME_STATS_IDLE_THRESHOLD 500.0f
+#define			FRAME_STATS_UPDATE_PERIOD 1000
+
+unsigned int	lastFrameStatsUpdateTime;
+Window			frameStatsWindow;
+
+// How frames of the focused game reach the screen. The mode comes from
+// STEAM_PRESENTATION_MODE on the game window, or on the root window if the
+// game doesn't have one; Steam itself is always presented with vsync.
+enum {
+	PRESENTATION_MODE_FIFO,
+	PRESENTATION_MODE_MAILBOX,
+	PRESENTATION_MODE_IMMEDIATE,
+	PRESENTATION_MODE_COUNT
+};
+
+#define			PRESENTATION_MODE_UNSET 0xFFFFFFFF
+
+static const char *presentationModeNames[PRESENTATION_MODE_COUNT] = {
+	"fifo", "mailbox", "immediate"
+};
+
+unsigned int	rootPresentationMode = PRESENTATION_MODE_FIFO;
+unsigned int	currentPresentationMode = PRESENTATION_MODE_FIFO;
+Bool			hasSwapControlTear;
+
+// In mailbox mode, composite this long before the predicted vblank
+#define			MAILBOX_PAINT_MARGIN 3000
+
+uint64_t		lastVblankTime;
+uint64_t		scheduledPaintTime;
+
+// Explicit synchronization of texture-from-pixmap reads against client
+// rendering, through X sync fences imported into GL
+#define			FENCE_RESET_TIMEOUT 100000000
+
+static int		xsync_event, xsync_error;
+Bool			hasXFences;
+unsigned int	fencesTriggered;
+unsigned int	fenceWaitCount;
+unsigned int	fenceTimeoutCount;
+uint64_t		fenceWaitTotalTime;
+uint64_t		fenceWaitMaxTime;
+
+// Textures of windows we haven't painted in that long are given back
+#define			TEXTURE_EVICTION_TIMEOUT 5000
+
+unsigned long	textureBudget;
+unsigned long	residentTextureMemory;
+unsigned int	textureEvictionCount;
+unsigned int	textureRestoreCount;
+uint64_t		textureRestoreMaxTime;
+
+// Windows likely to be shown next get bound ahead of time, so the switch
+// itself doesn't pay for it
+#define			PREWARM_MAX 3
+
+Window			prewarmWindows[PREWARM_MAX];
+unsigned int	prewarmCount;
+
+// Time from a focus switch or the overlay appearing to its first frame
+uint64_t		switchStartTime;
+Window			switchWindow;
+Bool			switchWindowPainted;
+Bool			switchWasWarm;
+unsigned int	switchCount;
+unsigned int	switchWarmCount;
+float			lastSwitchLatency;
+float			maxSwitchLatency;
+
+// Game window focus scoring, see focus.c; scores only move with sustained
+// damage, so they're not worth recomputing more often than this
+#define			FOCUS_RESCORE_PERIOD 250
+
+focus_candidate	*focusCandidates;
+win				**focusCandidateWins;
+int				focusCandidateCapacity;
+uint64_t		focusStartTime;			/* usec */
+uint64_t		lastFocusScoreTime;
+Window			lastDamageLeader;
+unsigned int	focusSwitchesAvoided;
+
+// Present extension: timestamps of our own output and completion of
+// client frames on redirected windows
+static int		present_opcode, present_event, present_error;
+Bool			hasPresent;
+uint32_t		presentSwapSerial;
+uint64_t		lastSwapSubmitTime;
+uint64_t		lastVblankMsc;
+float			swapToScanoutLatency;
+
+// Frame pacing for games rendering below the refresh rate, see pacer.c;
+// paced frames are composited this long ahead of their vblank
+#define			PACING_PAINT_MARGIN 3000
+
+static Bool		framePacing = False;
+frame_pacer		gamePacer;
+
+// Frame-time graph state for the debug HUD; all times are in milliseconds
+#define			FRAME_HISTORY_LENGTH 300
+
+float			frameTimeHistory[FRAME_HISTORY_LENGTH];
+float			gameFrameTimeHistory[FRAME_HISTORY_LENGTH];
+unsigned int	frameTimeHistoryHead;
+unsigned int	gameFrameTimeHistoryHead;
+uint64_t		lastFrameTime;
+float			refreshInterval = 1000.0f / 60.0f;
+
+// Per-layer GPU cost, measured with timer queries double-buffered across
+// frames so reading results back never stalls on the current frame
+enum {
+	LAYER_GAME,
+	LAYER_OVERLAY,
+	LAYER_NOTIFICATION,
+	LAYER_CURSOR,
+	LAYER_COUNT
+};
+
+static const char *layerNames[LAYER_COUNT] = {
+	"game", "overlay", "notification", "cursor"
+};
+
+Bool			hasTimerQueries;
+GLuint			layerTimerQueries[2][LAYER_COUNT];
+Bool			layerTimerQueryPending[2][LAYER_COUNT];
+unsigned int	layerTimerQuerySet;
+float			layerGPUTime[LAYER_COUNT];
+
+Bool			hasPathRendering;
+Bool			textRenderingInitialized;
+
+// Compositing backend. The CPU one reads window contents back through
+// MIT-SHM and scales and blends them with SIMD kernels, for GPUs or
+// drivers that can't do texture-from-pixmap well. The XRender one leaves
+// it all to the X server; it's what we fall back to if GL turns out to be
+// missing texture-from-pixmap or software-only.
+enum {
+	BACKEND_GL,
+	BACKEND_CPU,
+	BACKEND_RENDER,
+	BACKEND_COUNT
+};
+
+static const char *backendNames[BACKEND_COUNT] = {
+	"gl", "cpu", "render"
+};
+
+unsigned int	compositeBackend = BACKEND_GL;
+Bool			backendRequested;
+
+XShmSegmentInfo	cpuBackBufferShm;
+XImage			*cpuBackBufferImage;
+cpu_surface		cpuBackBuffer;
+GC				cpuPresentGC;
+XShmSegmentInfo	cpuFetchShm;
+unsigned long	cpuFetchSize;
+unsigned long	cpuFetchedBytes;
+uint32_t		*cursorPixels;
+
+// XRender backend: frames are put together in rootBuffer, and only what
+// changed since the last one is repainted and copied to the screen
+typedef struct _render_frame_state {
+	Window		window[3];		/* focus, overlay, notification */
+	unsigned int	opacity[3];
+	int			originX[3], originY[3];
+	int			width[3], height[3];
+	int			filter;
+} render_frame_state;
+
+Pixmap			rootBufferPixmap;
+Picture			cursorPicture;
+XRectangle		lastRenderCursorRect;
+render_frame_state	lastRenderFrame;
+Bool			renderFullRepaint = True;
+float			renderRepaintFraction;
+
+// Cursor plane: the last frame as it was before the software cursor went
+// on top, kept in sceneFramebuffer on GL and as the pixels under the cursor
+// on the CPU backend, so frames where only the cursor moved just put it
+// back and draw the cursor again
+Bool			cursorDamaged;
+Bool			sceneValid;
+Window			sceneWindow;
+Bool			hasSceneFramebuffer;
+GLuint			sceneFramebuffer;
+GLuint			sceneTexture;
+int				sceneWidth, sceneHeight;
+uint32_t		*cursorSaveUnder;
+unsigned long	cursorSaveUnderSize;
+XRectangle		cursorSaveUnderRect;
+unsigned long	cursorOnlyFrames;
+
+// Server cursor: a letterboxed game's cursor is shown by the X server, at
+// input rate, rather than composited. serverCursorSource is the game's own
+// image, kept since the server only hands back ours once it's defined.
+Bool			serverCursor;
+Window			serverCursorWindow;
+Cursor			serverCursorImage;
+unsigned int	*serverCursorSource;
+int				serverCursorSourceWidth, serverCursorSourceHeight;
+int				serverCursorSourceHotX, serverCursorSourceHotY;
+unsigned int	maxCursorWidth, maxCursorHeight;
+
+// Time from starting a frame to handing it off for presentation, including
+// reading back window contents on the CPU backend. On the GL backend this
+// is only the submission; see the per-layer GPU timings for the rest.
+float			compositeTime;
+float			maxCompositeTime;
+
+// What paint_all draws in a frame, bottom to top. Layers under opaque ones
+// are culled: not bound, synced or drawn. If what's opaque covers the whole
+// screen, there's no clear either.
+#define			PAINT_LAYER_MAX 4
+#define			OPAQUE_REGION_MAX_RECTS 64
+
+typedef struct _paint_layer {
+	win			*w;
+	Bool		blend;
+	Bool		notification;
+	int			timing;			/* LAYER_* it's accounted to */
+	Bool		culled;
+} paint_layer;
+
+unsigned int	culledLayers;		/* last frame */
+unsigned long	culledPixels;		/* last frame */
+unsigned long	culledLayerCount;
+unsigned long	skippedClearCount;
+
 static void
 init_text_rendering(void)
 {
+	textRenderingInitialized = True;
+	
 	textPathObjects = __pointer_to_glGenPathsNV(256);
 	
 	__pointer_to_glPathGlyphRangeNV(textPathObjects,
@@ -259,8 +737,10 @@ win_extents (Display *dpy, win *w);
 
 static Bool		doRender = True;
 static Bool		drawDebugInfo = False;
+static Bool		drawFrameGraph = False;
 static Bool		debugEvents = False;
 static Bool		allowUnredirection = False;
+static char		*tracePath = NULL;
 
 const int tfpAttribs[] = {
 	GLX_TEXTURE_TARGET_EXT, GLX_TEXTURE_2D_EXT,
@@ -283,1431 +763,4541 @@ get_time_in_milliseconds (void)
 	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
+static uint64_t
+get_time_in_microseconds (void)
+{
+	struct timespec ts;
+	
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 static void
-discard_ignore (Display *dpy, unsigned long sequence)
+mark_startup_phase (const char *name)
 {
-	while (ignore_head)
+	if (!startupTime || startupPhaseCount == STARTUP_PHASE_MAX)
+		return;
+	
+	startupPhases[startupPhaseCount].name = name;
+	startupPhases[startupPhaseCount].time = get_time_in_microseconds();
+	startupPhaseCount++;
+}
+
+static void
+report_startup (void)
+{
+	uint64_t previous = startupTime;
+	unsigned int i;
+	
+	fprintf (stderr, "Startup:");
+	for (i = 0; i < startupPhaseCount; i++)
 	{
-		if ((long) (sequence - ignore_head->sequence) > 0)
-		{
-			ignore  *next = ignore_head->next;
-			free (ignore_head);
-			ignore_head = next;
-			if (!ignore_head)
-				ignore_tail = &ignore_head;
-		}
-		else
-			break;
+		fprintf (stderr, " %s %.1fms", startupPhases[i].name,
+				 (startupPhases[i].time - previous) / 1000.0f);
+		previous = startupPhases[i].time;
 	}
+	fprintf (stderr, ", %.1fms total\n", (previous - startupTime) / 1000.0f);
+	
+	startupTime = 0;
 }
 
+// Blocking X and GLX calls, timed per call site with XPROF; every round
+// trip to the server goes through one, so xRoundTrips is counted there.
+// Totals are also kept per frame and per type of the event being handled
+// when the call was made, next to the number of requests issued, blocking
+// or not, going by NextRequest().
+typedef enum {
+	XPROF_FIND_WIN_QUERY_TREE,
+	XPROF_SHM_SEGMENT_SYNC,
+	XPROF_FETCH_SHM_GET_IMAGE,
+	XPROF_FENCE_CLIENT_WAIT_SYNC,
+	XPROF_FAKE_CURSOR_QUERY_POINTER,
+	XPROF_FAKE_CURSOR_IMAGE,
+	XPROF_VBLANK_SYNC_VALUES,
+	XPROF_CURSOR_FRAME_SYNC,
+	XPROF_CURSOR_FRAME_SWAP_BUFFERS,
+	XPROF_PAINT_SYNC,
+	XPROF_PAINT_SWAP_BUFFERS,
+	XPROF_SERVER_CURSOR_BEST_SIZE,
+	XPROF_SERVER_CURSOR_IMAGE,
+	XPROF_BARRIERS_QUERY_POINTER,
+	XPROF_FOCUS_QUERY_TREE,
+	XPROF_GET_PROP,
+	XPROF_OPAQUE_REGION,
+	XPROF_SIZE_HINTS,
+	XPROF_SIZE_HINTS_QUERY_TREE,
+	XPROF_SIZE_HINTS_GET_ATTRIBUTES,
+	XPROF_WIN_TYPE,
+	XPROF_ADD_WIN_GET_ATTRIBUTES,
+	XPROF_PREFETCH_WINDOWS,
+	XPROF_CHECKPOINT_GET_PROPERTY,
+	XPROF_INTERN_ATOMS,
+	XPROF_MAIN_QUERY_POINTER,
+	XPROF_SITE_COUNT
+} xprof_site;
+
+/* caller and call, and the round trips the call costs */
+static const struct {
+	const char		*name;
+	unsigned int	roundTrips;
+} xprofSiteTable[XPROF_SITE_COUNT] = {
+	{ "find_win/XQueryTree", 1 },
+	{ "create_shm_segment/XSync", 1 },
+	{ "fetch_win_contents/XShmGetImage", 1 },
+	{ "sync_win_resources/glClientWaitSync", 0 },
+	{ "update_fake_cursor/XQueryPointer", 1 },
+	{ "update_fake_cursor/XFixesGetCursorImage", 1 },
+	{ "get_next_vblank_time/glXGetSyncValuesOML", 1 },
+	{ "paint_cursor_frame/XSync", 1 },
+	{ "paint_cursor_frame/glXSwapBuffers", 0 },
+	{ "paint_all/XSync", 1 },
+	{ "paint_all/glXSwapBuffers", 0 },
+	{ "create_server_cursor/XQueryBestCursor", 1 },
+	{ "update_server_cursor/XFixesGetCursorImage", 1 },
+	{ "setup_pointer_barriers/XQueryPointer", 1 },
+	{ "determine_and_apply_focus/XQueryTree", 1 },
+	{ "get_prop/XGetWindowProperty", 1 },
+	{ "get_opaque_region/XGetWindowProperty", 1 },
+	{ "get_size_hints/XGetWMNormalHints", 1 },
+	{ "get_size_hints/XQueryTree", 1 },
+	// Plus a GetGeometry
+	{ "get_size_hints/XGetWindowAttributes", 2 },
+	{ "get_win_type/XGetWindowProperty", 1 },
+	{ "add_win/XGetWindowAttributes", 2 },
+	{ "prefetch_windows/xcb replies", 1 },
+	{ "restore_state_checkpoint/XGetWindowProperty", 1 },
+	{ "main/XInternAtoms", 1 },
+	{ "main/XQueryPointer", 1 },
+};
+
+typedef struct _xprof_stats {
+	unsigned long	calls;
+	uint64_t		time;			/* all in microseconds */
+	uint64_t		maxTime;
+	unsigned int	frameCalls;
+	uint64_t		frameTime;
+	unsigned int	lastFrameCalls;
+	uint64_t		lastFrameTime;
+} xprof_stats;
+
+// Core events by type, then damage, then any other extension event
+#define			XPROF_EVENT_DAMAGE LASTEvent
+#define			XPROF_EVENT_OTHER (LASTEvent + 1)
+#define			XPROF_EVENT_SLOTS (LASTEvent + 2)
+
+typedef struct _xprof_event_stats {
+	unsigned long	count;
+	unsigned long	requests;
+	unsigned long	calls;
+	uint64_t		time;
+	uint64_t		maxTime;
+} xprof_event_stats;
+
+xprof_stats			xprofSites[XPROF_SITE_COUNT];
+xprof_stats			xprofTotal;
+xprof_event_stats	xprofEvents[XPROF_EVENT_SLOTS];
+uint64_t			xprofMaxFrameTime;
+unsigned long		xprofFrameStartRequest;
+unsigned long		xprofLastFrameRequests;
+unsigned long		xprofMaxFrameRequests;
+static volatile sig_atomic_t	xprofDumpRequested;
+
+#define XPROF(site, call) \
+	do { \
+		uint64_t xprofStart = get_time_in_microseconds(); \
+		call; \
+		xprof_record(site, xprofStart); \
+	} while (0)
+
 static void
-set_ignore (Display *dpy, unsigned long sequence)
+xprof_add (xprof_stats *stats, uint64_t time)
 {
-	ignore  *i = malloc (sizeof (ignore));
-	if (!i)
-		return;
-	i->sequence = sequence;
-	i->next = NULL;
-	*ignore_tail = i;
-	ignore_tail = &i->next;
+	stats->calls++;
+	stats->time += time;
+	if (time > stats->maxTime)
+		stats->maxTime = time;
+	stats->frameCalls++;
+	stats->frameTime += time;
 }
 
-static int
-should_ignore (Display *dpy, unsigned long sequence)
+static void
+xprof_record (xprof_site site, uint64_t startTime)
 {
-	discard_ignore (dpy, sequence);
-	return ignore_head && ignore_head->sequence == sequence;
+	uint64_t time = get_time_in_microseconds() - startTime;
+	
+	xprof_add(&xprofSites[site], time);
+	xprof_add(&xprofTotal, time);
+	xRoundTrips += xprofSiteTable[site].roundTrips;
+	
+	if (debugEvents)
+		printf ("  %s blocked %lluus\n", xprofSiteTable[site].name, (unsigned long long)time);
 }
 
-static win *
-find_win (Display *dpy, Window id)
+static void
+xprof_end_frame (Display *dpy)
 {
-	win	*w;
+	unsigned long request = NextRequest (dpy);
+	int i;
 	
-	if (id == None)
+	if (xprofFrameStartRequest)
 	{
-		return NULL;
+		xprofLastFrameRequests = request - xprofFrameStartRequest;
+		if (xprofLastFrameRequests > xprofMaxFrameRequests)
+			xprofMaxFrameRequests = xprofLastFrameRequests;
 	}
+	xprofFrameStartRequest = request;
 	
-	for (w = list; w; w = w->next)
+	for (i = 0; i < XPROF_SITE_COUNT; i++)
 	{
-		if (w->id == id)
-		{
-			return w;
-		}
+		xprofSites[i].lastFrameCalls = xprofSites[i].frameCalls;
+		xprofSites[i].lastFrameTime = xprofSites[i].frameTime;
+		xprofSites[i].frameCalls = 0;
+		xprofSites[i].frameTime = 0;
 	}
-	// Didn't find, must be a children somewhere; try again with parent.
-	Window root = None;
-	Window parent = None;
-	Window *children = NULL;
-	unsigned int childrenCount;
-	set_ignore (dpy, NextRequest (dpy));
-	XQueryTree(dpy, id, &root, &parent, &children, &childrenCount);
-	if (children)
-		XFree(children);
 	
-	if (root == parent || parent == None)
-	{
-		return NULL;
-	}
+	if (xprofTotal.frameTime > xprofMaxFrameTime)
+		xprofMaxFrameTime = xprofTotal.frameTime;
 	
-	return find_win(dpy, parent);
+	xprofTotal.lastFrameCalls = xprofTotal.frameCalls;
+	xprofTotal.lastFrameTime = xprofTotal.frameTime;
+	xprofTotal.frameCalls = 0;
+	xprofTotal.frameTime = 0;
 }
 
 static void
-set_win_hidden (Display *dpy, win *w, Bool hidden)
+xprof_dump (FILE *file)
 {
-	if (!w || w->id == None)
-	{
-		return;
-	}
-	
-	if (w->isHidden == hidden)
-	{
-		return;
-	}
+	int i;
 	
+	fprintf (file, "Blocking calls: %lu, %.2fms total, %.2fms worst frame\n",
+			 xprofTotal.calls, xprofTotal.time / 1000.0f, xprofMaxFrameTime / 1000.0f);
+	fprintf (file, "Requests: %lu last frame, %lu worst frame\n",
+			 xprofLastFrameRequests, xprofMaxFrameRequests);
 	
-	if (hidden == True)
+	for (i = 0; i < XPROF_SITE_COUNT; i++)
 	{
-		XChangeProperty(dpy, w->id, WMStateAtom, XA_ATOM, 32,
-						PropModeReplace, (unsigned char *)&WMStateHiddenAtom, 1);
+		if (!xprofSites[i].calls)
+			continue;
+		
+		fprintf (file, "  %-44s %8lu calls %10.2fms total %8.3fms avg %8.3fms max\n",
+				 xprofSiteTable[i].name, xprofSites[i].calls, xprofSites[i].time / 1000.0f,
+				 xprofSites[i].time / 1000.0f / xprofSites[i].calls,
+				 xprofSites[i].maxTime / 1000.0f);
 	}
-	else
+	
+	for (i = 0; i < XPROF_EVENT_SLOTS; i++)
 	{
-		XChangeProperty(dpy, w->id, WMStateAtom, XA_ATOM, 32,
-						PropModeReplace, (unsigned char *)NULL, 0);
+		if (!xprofEvents[i].calls && !xprofEvents[i].requests)
+			continue;
+		
+		if (i == XPROF_EVENT_DAMAGE)
+			fprintf (file, "  event damage    ");
+		else if (i == XPROF_EVENT_OTHER)
+			fprintf (file, "  event extension ");
+		else
+			fprintf (file, "  event %-9d ", i);
+		
+		fprintf (file, " %8lu events %8lu requests %8lu calls %10.2fms total %8.3fms max\n",
+				 xprofEvents[i].count, xprofEvents[i].requests, xprofEvents[i].calls,
+				 xprofEvents[i].time / 1000.0f, xprofEvents[i].maxTime / 1000.0f);
 	}
 	
-	w->isHidden = hidden;
+	fflush (file);
 }
 
-static XserverRegion
-win_extents (Display *dpy, win *w)
+static void
+handle_sigusr1 (int signal)
 {
-	XRectangle	    r;
+	xprofDumpRequested = True;
+}
+
+static void
+push_frame_time (float *history, unsigned int *head, float value)
+{
+	history[*head] = value;
+	*head = (*head + 1) % FRAME_HISTORY_LENGTH;
+}
+
+static Bool
+layer_timing_enabled (void)
+{
+	return hasTimerQueries && (drawDebugInfo || drawFrameGraph);
+}
+
+static void
+begin_layer_timing (int layer)
+{
+	TRACE_BEGIN(layerNames[layer], 0);
 	
-	r.x = w->a.x;
-	r.y = w->a.y;
-	r.width = w->a.width + w->a.border_width * 2;
-	r.height = w->a.height + w->a.border_width * 2;
+	if (!layer_timing_enabled())
+		return;
 	
-	return XFixesCreateRegion (dpy, &r, 1);
+	__pointer_to_glBeginQuery(GL_TIME_ELAPSED, layerTimerQueries[layerTimerQuerySet][layer]);
 }
 
-GLXFBConfig win_fbconfig(Display *display, Window id)
+static void
+end_layer_timing (int layer)
 {
-	XWindowAttributes attrib;
-	VisualID visualid;
-	GLXFBConfig *fbconfigs;
-	int nfbconfigs, i, value;
-	XVisualInfo *visinfo;
+	TRACE_END(layerNames[layer]);
 	
-	attrib.visual = 0x0;
-	XGetWindowAttributes (display, id, &attrib);
+	if (!layer_timing_enabled())
+		return;
 	
-	if (!attrib.visual)
-		return None;
+	__pointer_to_glEndQuery(GL_TIME_ELAPSED);
+	layerTimerQueryPending[layerTimerQuerySet][layer] = True;
+}
+
+static void
+collect_layer_timings (void)
+{
+	int i;
+	
+	if (!layer_timing_enabled())
+		return;
 	
-	visualid = XVisualIDFromVisual (attrib.visual);
+	// Swap to the other set of queries; whatever it holds was issued two
+	// frames ago and is most likely available by now.
+	layerTimerQuerySet ^= 1;
 	
-	fbconfigs = glXGetFBConfigs (display, scr, &nfbconfigs);
-	for (i = 0; i < nfbconfigs; i++)
+	for (i = 0; i < LAYER_COUNT; i++)
 	{
-		visinfo = glXGetVisualFromFBConfig (display, fbconfigs[i]);
-		if (!visinfo || visinfo->visualid != visualid)
-			continue;
+		GLuint available = 0;
+		GLuint64 elapsed = 0;
 		
-		glXGetFBConfigAttrib (display, fbconfigs[i], GLX_DRAWABLE_TYPE, &value);
-		if (!(value & GLX_PIXMAP_BIT))
+		if (!layerTimerQueryPending[layerTimerQuerySet][i])
+		{
+			layerGPUTime[i] = 0.0f;
 			continue;
+		}
 		
-		glXGetFBConfigAttrib (display, fbconfigs[i],
-							  GLX_BIND_TO_TEXTURE_TARGETS_EXT,
-						&value);
-		if (!(value & GLX_TEXTURE_2D_BIT_EXT))
+		__pointer_to_glGetQueryObjectuiv(layerTimerQueries[layerTimerQuerySet][i],
+										 GL_QUERY_RESULT_AVAILABLE, &available);
+		
+		// Never block on the GPU for debug data; keep the previous value.
+		if (!available)
 			continue;
 		
-		glXGetFBConfigAttrib (display, fbconfigs[i],
-							  GLX_BIND_TO_TEXTURE_RGBA_EXT,
-						&value);
-		if (value == False)
-		{
-			glXGetFBConfigAttrib (display, fbconfigs[i],
-								  GLX_BIND_TO_TEXTURE_RGB_EXT,
-						 &value);
-			if (value == False)
-				continue;
-		}
+		__pointer_to_glGetQueryObjectui64v(layerTimerQueries[layerTimerQuerySet][i],
+										   GL_QUERY_RESULT, &elapsed);
 		
-		glXGetFBConfigAttrib(display, fbconfigs[i],
-							 GLX_SAMPLE_BUFFERS,
-					   &value);
-		if (value)
-			continue;
+		layerGPUTime[i] = elapsed / 1000000.0f;
+		layerTimerQueryPending[layerTimerQuerySet][i] = False;
+	}
+}
+
+static void
+record_client_frame (win *w)
+{
+	uint64_t now = get_time_in_microseconds();
+	
+	w->cold->clientFrameCount++;
+	w->framesSincePaint++;
+	
+	if (w->lastDamageTime)
+	{
+		float interval = (now - w->lastDamageTime) / 1000.0f;
 		
-		// 		glXGetFBConfigAttrib (display, fbconfigs[i],
-		// 							  GLX_Y_INVERTED_EXT,
-		// 						&value);
-		// 		if (value == True)
-		// 		{
-		// 			top = 0.0f;
-		// 			bottom = 1.0f;
-		// 		}
-		// 		else
-		// 		{
-		// 			top = 1.0f;
-		// 			bottom = 0.0f;
-		// 		}
+		if (drawFrameGraph && gameFocused && w->id == currentFocusWindow)
+			push_frame_time(gameFrameTimeHistory, &gameFrameTimeHistoryHead, interval);
 		
-		break;
-	}
-	
-	if (i == nfbconfigs)
-	{
-		fprintf (stderr, "Could not get fbconfig from window\n");
-		return None;
+		if (interval < FRAME_STATS_IDLE_THRESHOLD)
+		{
+			if (w->frameIntervalAverage == 0.0f)
+			{
+				w->frameIntervalAverage = interval;
+			}
+			else
+			{
+				// Exponentially weighted mean and variance
+				float delta = interval - w->frameIntervalAverage;
+				
+				w->frameIntervalAverage += FRAME_STATS_SMOOTHING * delta;
+				w->cold->frameIntervalVariance = (1.0f - FRAME_STATS_SMOOTHING) *
+					(w->cold->frameIntervalVariance + FRAME_STATS_SMOOTHING * delta * delta);
+			}
+		}
 	}
 	
-	return fbconfigs[i];
+	w->lastDamageTime = now;
 }
 
 static void
-teardown_win_resources (Display *dpy, win *w)
+record_win_presented (win *w)
 {
 	if (!w)
 		return;
 	
-	if (w->pixmap)
-	{
-		glBindTexture (GL_TEXTURE_2D, w->texName);
-		__pointer_to_glXReleaseTexImageEXT (dpy, w->glxPixmap, GLX_FRONT_LEFT_EXT);
-		glBindTexture (GL_TEXTURE_2D, 0);
-		w->texName = 0;
-		glXDestroyPixmap(dpy, w->glxPixmap);
-		w->glxPixmap = None;
-		
-		XFreePixmap(dpy, w->pixmap);
-		w->pixmap = None;
-	}
+	// More than one client frame since we last showed this window means some
+	// never made it to the screen; none means we showed the same one again.
+	if (w->framesSincePaint == 0)
+		w->cold->duplicatedFrames++;
+	else
+		w->cold->droppedFrames += w->framesSincePaint - 1;
 	
-	w->damaged = 0;
-	w->validContents = False;
+	w->framesSincePaint = 0;
 }
 
 static void
-ensure_win_resources (Display *dpy, win *w)
+reset_frame_stats (win *w)
 {
-	if (!w || !w->fbConfig)
-		return;
-	
-	if (!w->pixmap)
-	{
-		w->pixmap = XCompositeNameWindowPixmap (dpy, w->id);
-		w->glxPixmap = glXCreatePixmap (dpy, w->fbConfig, w->pixmap, w->isOverlay ? tfpAttribsRGBA : tfpAttribs);
-		
-		glBindTexture (GL_TEXTURE_2D, w->texName);
-		__pointer_to_glXBindTexImageEXT (dpy, w->glxPixmap, GLX_FRONT_LEFT_EXT, NULL);
-		
-		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-		
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-	}
+	w->lastDamageTime = 0;
+	w->frameIntervalAverage = 0.0f;
+	w->cold->frameIntervalVariance = 0.0f;
+	w->cold->clientFrameCount = 0;
+	w->framesSincePaint = 0;
+	w->cold->droppedFrames = 0;
+	w->cold->duplicatedFrames = 0;
 }
 
 static void
-apply_cursor_state (Display *dpy)
+discard_ignore (Display *dpy, unsigned long sequence)
 {
-	Bool newCursorVisibility = True;
-	
-	if (hideCursorForScale || hideCursorForMovement)
-		newCursorVisibility = False;
-	
-	if (newCursorVisibility != cursorVisible)
+	while (ignore_head)
 	{
-		cursorVisible = newCursorVisibility;
-		
-		if (cursorVisible)
-			XFixesShowCursor(dpy, DefaultRootWindow(dpy));
+		if ((long) (sequence - ignore_head->sequence) > 0)
+		{
+			ignore  *next = ignore_head->next;
+			free (ignore_head);
+			ignore_head = next;
+			if (!ignore_head)
+				ignore_tail = &ignore_head;
+		}
 		else
-			XFixesHideCursor(dpy, DefaultRootWindow(dpy));
+			break;
 	}
 }
 
 static void
-handle_mouse_movement(Display *dpy, int posX, int posY)
+set_ignore (Display *dpy, unsigned long sequence)
 {
-	// Some stuff likes to warp in-place
-	if (cursorX == posX && cursorY == posY)
+	ignore  *i = malloc (sizeof (ignore));
+	if (!i)
 		return;
+	i->sequence = sequence;
+	i->next = NULL;
+	*ignore_tail = i;
+	ignore_tail = &i->next;
+}
+
+static int
+should_ignore (Display *dpy, unsigned long sequence)
+{
+	discard_ignore (dpy, sequence);
+	return ignore_head && ignore_head->sequence == sequence;
+}
+
+// Window records come from slabs, with the win_cold halves in a parallel
+// array, and go back on a free list when the window is destroyed
+#define			WIN_SLAB_SIZE 64
+
+typedef struct _win_slab {
+	struct _win_slab	*next;
+	win			windows[WIN_SLAB_SIZE];
+	win_cold	cold[WIN_SLAB_SIZE];
+} win_slab;
+
+static win_slab	*winSlabs;
+static win		*freeWins;
+
+static win *
+alloc_win (void)
+{
+	win *w;
 	
-	cursorX = posX;
-	cursorY = posY;
-	
-	win *w = find_win(dpy, currentFocusWindow);
-	
-	if (w && focusedWindowNeedsScale && gameFocused)
+	if (!freeWins)
 	{
-		w->damaged = 1;
+		win_slab *slab = calloc(1, sizeof(win_slab));
+		int i;
+		
+		if (!slab)
+			return NULL;
+		
+		slab->next = winSlabs;
+		winSlabs = slab;
+		
+		// Hand them out in address order
+		for (i = WIN_SLAB_SIZE - 1; i >= 0; i--)
+		{
+			slab->windows[i].cold = &slab->cold[i];
+			slab->windows[i].next = freeWins;
+			freeWins = &slab->windows[i];
+		}
 	}
 	
-	// Ignore the first events as it's likely to be non-user-initiated warps
-	// Account for one warp from us, one warp from the app and one warp from
-	// the toolkit.
-	if (w && (w->mouseMoved++ < 3))
-		return;
+	w = freeWins;
+	freeWins = w->next;
 	
-	lastCursorMovedTime = get_time_in_milliseconds();
+	w->next = w->prev = w->hashNext = NULL;
+	memset(w->cold, 0, sizeof(win_cold));
 	
-	hideCursorForMovement = False;
-	apply_cursor_state(dpy);
+	return w;
 }
 
 static void
-paint_fake_cursor (Display *dpy, win *w)
+free_win (win *w)
 {
-	float scaledCursorX, scaledCursorY;
-	
-	Window window_returned, child;
-	int root_x, root_y;
-	int win_x, win_y;
-	unsigned int mask_return;
+	free(w->cold->opaqueRects);
 	
-	XQueryPointer(dpy, DefaultRootWindow(dpy), &window_returned,
-				  &child, &root_x, &root_y, &win_x, &win_y,
-			   &mask_return);
-	
-	handle_mouse_movement( dpy, root_x, root_y );
+	w->next = freeWins;
+	freeWins = w;
+}
+
+/* Copies what's needed to keep painting a window after it's gone, such as
+ * for the focus fade; the copy isn't linked anywhere and has no cold state.
+ */
+static void
+snapshot_win (win *dst, const win *src)
+{
+	*dst = *src;
+	dst->next = dst->prev = dst->hashNext = NULL;
+	dst->cold = NULL;
+}
+
+static void
+set_win_attributes (win *w, const XWindowAttributes *attribs)
+{
+	w->a.x = attribs->x;
+	w->a.y = attribs->y;
+	w->a.width = attribs->width;
+	w->a.height = attribs->height;
+	w->a.border_width = attribs->border_width;
+	w->a.depth = attribs->depth;
+	w->a.class = attribs->class;
+	w->a.map_state = attribs->map_state;
+	w->a.override_redirect = attribs->override_redirect;
+}
+
+static win *
+find_win (Display *dpy, Window id)
+{
+	win	*w;
 	
-	// Also need new texture
-	if (cursorImageDirty)
+	if (id == None)
 	{
-		XFixesCursorImage* im = XFixesGetCursorImage(dpy);
-		
-		if (!im)
-			return;
-		
-		cursorHotX = im->xhot;
-		cursorHotY = im->yhot;
-		
-		cursorWidth = im->width;
-		cursorHeight = im->height;
-		
-		unsigned int cursorDataBuffer[cursorWidth * cursorHeight];
-		for (int i = 0; i < cursorWidth * cursorHeight; i++)
-			cursorDataBuffer[i] = im->pixels[i];
-		
-		glBindTexture(GL_TEXTURE_2D, cursorTextureName);
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cursorWidth, cursorHeight, 0, GL_BGRA, GL_UNSIGNED_BYTE, cursorDataBuffer);
-		
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-		
-		XFree(im);
-		
-		cursorImageDirty = False;
+		return NULL;
 	}
 	
-	// Actual point on scaled screen where the cursor hotspot should be
-	scaledCursorX = (win_x - w->a.x) * cursorScaleRatio * globalScaleRatio + cursorOffsetX;
-	scaledCursorY = (win_y - w->a.y) * cursorScaleRatio * globalScaleRatio + cursorOffsetY;
-	
-	if ( zoomScaleRatio != 1.0 )
+	w = lookup_win(id);
+	if (w)
 	{
-		scaledCursorX += ((w->a.width / 2) - win_x) * cursorScaleRatio * globalScaleRatio;
-		scaledCursorY += ((w->a.height / 2) - win_y) * cursorScaleRatio * globalScaleRatio;
+		return w;
 	}
+	// Didn't find, must be a children somewhere; try again with parent.
+	Window root = None;
+	Window parent = None;
+	Window *children = NULL;
+	unsigned int childrenCount;
+	set_ignore (dpy, NextRequest (dpy));
+	XPROF(XPROF_FIND_WIN_QUERY_TREE, XQueryTree(dpy, id, &root, &parent, &children, &childrenCount));
+	if (children)
+		XFree(children);
 	
-	glEnable(GL_BLEND);
-	glBindTexture(GL_TEXTURE_2D, cursorTextureName);
-	glEnable(GL_TEXTURE_2D);
-	
-	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	
-	win *mainOverlayWindow = find_win(dpy, currentOverlayWindow);
-	
-	float displayCursorScaleRatio = 1.0f;
-	
-	// Ensure the cursor looks the same size as in Steam or the overlay
-	if (mainOverlayWindow)
+	if (root == parent || parent == None)
 	{
-		// The first scale we need to apply is the Steam/overlay scale, if it exists
-		float steamScaleX = (float)root_width / mainOverlayWindow->a.width;
-		float steamScaleY = (float)root_height / mainOverlayWindow->a.height;
-		
-		float steamRatio = (steamScaleX < steamScaleY) ? steamScaleX : steamScaleY;
-		
-		displayCursorScaleRatio *= steamRatio;
-		
-		// Then any global scale, since it would also apply to the Steam window and its SW cursor
-		displayCursorScaleRatio *= globalScaleRatio;
+		return NULL;
 	}
 	
-	// Apply the cursor offset inside the texture using the display scale
-	scaledCursorX = scaledCursorX - (cursorHotX * displayCursorScaleRatio);
-	scaledCursorY = scaledCursorY - (cursorHotY * displayCursorScaleRatio);
-	
-	float displayCursorWidth = cursorWidth * displayCursorScaleRatio;
-	float displayCursorHeight = cursorHeight * displayCursorScaleRatio;
-	
-	glColor3f(1.0f, 1.0f, 1.0f);
-	
-	glBegin (GL_QUADS);
-	glTexCoord2d (0.0f, 0.0f);
-	glVertex2d (scaledCursorX, scaledCursorY);
-	glTexCoord2d (1.0f, 0.0f);
-	glVertex2d (scaledCursorX + displayCursorWidth, scaledCursorY);
-	glTexCoord2d (1.0f, 1.0f);
-	glVertex2d (scaledCursorX + displayCursorWidth, scaledCursorY + displayCursorHeight);
-	glTexCoord2d (0.0f, 1.0f);
-	glVertex2d (scaledCursorX, scaledCursorY + displayCursorHeight);
-	glEnd ();
+	return find_win(dpy, parent);
 }
 
 static void
-paint_window (Display *dpy, win *w, Bool doBlend, Bool notificationMode)
+set_win_hidden (Display *dpy, win *w, Bool hidden)
 {
-	int sourceWidth, sourceHeight;
-	int drawXOffset = 0, drawYOffset = 0;
-	Bool isScaling = False;
-	float currentScaleRatio = 1.0;
-	
-	if (!w)
+	if (!w || w->id == None)
+	{
 		return;
+	}
 	
-	if (w->isOverlay && !w->validContents)
+	if (w->isHidden == hidden)
+	{
 		return;
+	}
 	
-	win *mainOverlayWindow = find_win(dpy, currentOverlayWindow);
-	
-	if (notificationMode && !mainOverlayWindow)
-		return;
 	
-	if (notificationMode)
+	if (hidden == True)
 	{
-		sourceWidth = mainOverlayWindow->a.width;
-		sourceHeight = mainOverlayWindow->a.height;
+		XChangeProperty(dpy, w->id, WMStateAtom, XA_ATOM, 32,
+						PropModeReplace, (unsigned char *)&WMStateHiddenAtom, 1);
 	}
 	else
 	{
-		sourceWidth = w->a.width;
-		sourceHeight = w->a.height;
+		XChangeProperty(dpy, w->id, WMStateAtom, XA_ATOM, 32,
+						PropModeReplace, (unsigned char *)NULL, 0);
 	}
 	
-	glBindTexture (GL_TEXTURE_2D, w->texName);
-	glEnable(GL_TEXTURE_2D);
+	w->isHidden = hidden;
+}
+
+static XserverRegion
+win_extents (Display *dpy, win *w)
+{
+	XRectangle	    r;
 	
-	if (sourceWidth != root_width || sourceHeight != root_height || globalScaleRatio != 1.0f)
-	{
-		float XRatio = (float)root_width / sourceWidth;
-		float YRatio = (float)root_height / sourceHeight;
-		
-		currentScaleRatio = (XRatio < YRatio) ? XRatio : YRatio;
-		currentScaleRatio *= globalScaleRatio;
-		
-		drawXOffset = (root_width - sourceWidth * currentScaleRatio) / 2.0f;
-		drawYOffset = (root_height - sourceHeight * currentScaleRatio) / 2.0f;
-		
-		if ( zoomScaleRatio != 1.0 )
-		{
-			drawXOffset += ((sourceWidth / 2) - cursorX) * currentScaleRatio;
-			drawYOffset += ((sourceHeight / 2) - cursorY) * currentScaleRatio;
-		}
-		
-		isScaling = True;
+	r.x = w->a.x;
+	r.y = w->a.y;
+	r.width = w->a.width + w->a.border_width * 2;
+	r.height = w->a.height + w->a.border_width * 2;
+	
+	return XFixesCreateRegion (dpy, &r, 1);
+}
+
+// Windows share a handful of visuals; don't walk every fbconfig for each
+#define			FBCONFIG_CACHE_SIZE 16
+
+typedef struct _fbconfig_cache_entry {
+	VisualID	visualid;
+	GLXFBConfig	fbConfig;
+} fbconfig_cache_entry;
+
+fbconfig_cache_entry	fbConfigCache[FBCONFIG_CACHE_SIZE];
+unsigned int			fbConfigCacheCount;
+
+GLXFBConfig win_fbconfig(Display *display, VisualID visualid)
+{
+	static GLXFBConfig *fbconfigs;
+	static int nfbconfigs;
+	int i, value;
+	XVisualInfo *visinfo;
+	
+	if (!visualid)
+		return None;
+	
+	for (i = 0; i < fbConfigCacheCount; i++)
+	{
+		if (fbConfigCache[i].visualid == visualid)
+			return fbConfigCache[i].fbConfig;
 	}
 	
-	if (doBlend)
-		glEnable(GL_BLEND);
-	else
-		glDisable(GL_BLEND);
+	if (!fbconfigs)
+		fbconfigs = glXGetFBConfigs (display, scr, &nfbconfigs);
 	
-	// If scaling and blending, we need to draw our letterbox black border with
-	// the right opacity instead of relying on the clear color
-	if (isScaling && doBlend && !notificationMode)
+	for (i = 0; i < nfbconfigs; i++)
 	{
-		glDisable(GL_TEXTURE_2D);
-		glColor4f(0.0f, 0.0f, 0.0f, (float)w->opacity / OPAQUE);
+		visinfo = glXGetVisualFromFBConfig (display, fbconfigs[i]);
+		if (!visinfo)
+			continue;
+		if (visinfo->visualid != visualid)
+		{
+			XFree (visinfo);
+			continue;
+		}
+		XFree (visinfo);
 		
-		glBegin (GL_QUADS);
+		glXGetFBConfigAttrib (display, fbconfigs[i], GLX_DRAWABLE_TYPE, &value);
+		if (!(value & GLX_PIXMAP_BIT))
+			continue;
 		
-		// We can't overdraw because we're blending
+		glXGetFBConfigAttrib (display, fbconfigs[i],
+							  GLX_BIND_TO_TEXTURE_TARGETS_EXT,
+						&value);
+		if (!(value & GLX_TEXTURE_2D_BIT_EXT))
+			continue;
 		
-		// Top and bottom stripes, including sides
-		if (drawYOffset)
+		glXGetFBConfigAttrib (display, fbconfigs[i],
+							  GLX_BIND_TO_TEXTURE_RGBA_EXT,
+						&value);
+		if (value == False)
 		{
-			glVertex2d (0.0f, 0.0f);
-			glVertex2d (root_width, 0.0f);
-			glVertex2d (root_width, drawYOffset);
-			glVertex2d (0.0f, drawYOffset);
-			
-			glVertex2d (0.0f, root_height - drawYOffset);
-			glVertex2d (root_width, root_height - drawYOffset);
-			glVertex2d (root_width, root_height);
-			glVertex2d (0.0f, root_height);
+			glXGetFBConfigAttrib (display, fbconfigs[i],
+								  GLX_BIND_TO_TEXTURE_RGB_EXT,
+						 &value);
+			if (value == False)
+				continue;
 		}
 		
-		// Side stripes, excluding any top and bottom areas
-		if (drawXOffset)
-		{
-			glVertex2d (0.0f, drawYOffset);
-			glVertex2d (drawXOffset, drawYOffset);
-			glVertex2d (drawXOffset, root_height - drawYOffset);
-			glVertex2d (0.0f, root_height - drawYOffset);
-			
-			glVertex2d (root_width - drawXOffset, drawYOffset);
-			glVertex2d (root_width, drawYOffset);
-			glVertex2d (root_width, root_height - drawYOffset);
-			glVertex2d (root_width - drawXOffset, root_height - drawYOffset);
-		}
+		glXGetFBConfigAttrib(display, fbconfigs[i],
+							 GLX_SAMPLE_BUFFERS,
+					   &value);
+		if (value)
+			continue;
 		
-		glEnd ();
+		// 		glXGetFBConfigAttrib (display, fbconfigs[i],
+		// 							  GLX_Y_INVERTED_EXT,
+		// 						&value);
+		// 		if (value == True)
+		// 		{
+		// 			top = 0.0f;
+		// 			bottom = 1.0f;
+		// 		}
+		// 		else
+		// 		{
+		// 			top = 1.0f;
+		// 			bottom = 0.0f;
+		// 		}
+		
+		break;
 	}
 	
-	glEnable(GL_TEXTURE_2D);
+	GLXFBConfig fbConfig = None;
 	
-	if (w->isOverlay)
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, GL_ALPHA);
+	if (i == nfbconfigs)
+		fprintf (stderr, "Could not get fbconfig from window\n");
 	else
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, GL_ONE);
-	
-	glColor4f(1.0f, 1.0f, 1.0f, (float)w->opacity / OPAQUE);
+		fbConfig = fbconfigs[i];
 	
-	int originX, originY, width, height;
-	
-	if (notificationMode)
-	{
-		int xOffset = 0, yOffset = 0;
-		
-		width = w->a.width * currentScaleRatio;
-		height = w->a.height * currentScaleRatio;
-		
-		if (globalScaleRatio != 1.0f)
-		{
-			xOffset = (root_width - root_width * globalScaleRatio) / 2.0;
-			yOffset = (root_height - root_height * globalScaleRatio) / 2.0;
-		}
-		
-		originX = root_width - xOffset - width;
-		originY = root_height - yOffset - height;
-	}
-	else
+	// Misses are remembered too, they fall back to the root visual
+	if (fbConfigCacheCount < FBCONFIG_CACHE_SIZE)
 	{
-		originX = drawXOffset;
-		originY = drawYOffset;
-		
-		width = sourceWidth * currentScaleRatio;
-		height = sourceHeight * currentScaleRatio;
+		fbConfigCache[fbConfigCacheCount].visualid = visualid;
+		fbConfigCache[fbConfigCacheCount].fbConfig = fbConfig;
+		fbConfigCacheCount++;
 	}
 	
-	glBegin (GL_QUADS);
-	glTexCoord2d (0.0f, 0.0f);
-	glVertex2d (originX, originY);
-	glTexCoord2d (1.0f, 0.0f);
-	glVertex2d (originX + width, originY);
-	glTexCoord2d (1.0f, 1.0f);
-	glVertex2d (originX + width, originY + height);
-	glTexCoord2d (0.0f, 1.0f);
-	glVertex2d (originX, originY + height);
-	glEnd ();
+	return fbConfig;
 }
 
 static void
-paint_message (const char *message, int Y, float r, float g, float b)
+teardown_win_resources (Display *dpy, win *w)
 {
-	int messageLength = strlen(message);
-	GLfloat horizontalOffsets[messageLength + 1];
-	
-	horizontalOffsets[0] = 0;
+	if (!w)
+		return;
 	
-	__pointer_to_glGetPathSpacingNV(GL_ACCUM_ADJACENT_PAIRS_NV,
-									(GLsizei)messageLength, GL_UNSIGNED_BYTE, message,
-									textPathObjects,
-								 1.0, 1.0,
-								 GL_TRANSLATE_X_NV,
-								 &horizontalOffsets[1]);
+	if (w->fence)
+	{
+		__pointer_to_glDeleteSync (w->glFence);
+		w->glFence = NULL;
+		XSyncDestroyFence (dpy, w->fence);
+		w->fence = None;
+		w->fenceTriggered = False;
+	}
 	
-	float messageWidth = horizontalOffsets[messageLength - 1] + textXAdvance[message[messageLength - 1]];
+	if (w->picture)
+	{
+		XRenderFreePicture(dpy, w->picture);
+		w->picture = None;
+	}
 	
-	glPushMatrix();
+	if (w->pixmap)
+	{
+		if (compositeBackend == BACKEND_GL)
+		{
+			glBindTexture (GL_TEXTURE_2D, w->texName);
+			__pointer_to_glXReleaseTexImageEXT (dpy, w->glxPixmap, GLX_FRONT_LEFT_EXT);
+			glBindTexture (GL_TEXTURE_2D, 0);
+			glXDestroyPixmap(dpy, w->glxPixmap);
+			w->glxPixmap = None;
+		}
+		
+		XFreePixmap(dpy, w->pixmap);
+		w->pixmap = None;
+		w->textureSize = 0;
+	}
 	
-	glTranslatef(root_width - messageWidth - 100, Y + textYMax - textYMin, 0.0);
-	glScalef(1.0, -1.0, 1.0);
+	free(w->cpuPixels);
+	w->cpuPixels = NULL;
 	
-	glEnable(GL_STENCIL_TEST);
+	w->damaged = 0;
+	w->validContents = False;
+}
+
+/* Give back the pixmap and texture of a window that isn't being shown; the
+ * contents stay valid server-side and are bound again the next time it's
+ * painted.
+ */
+static void
+evict_win_resources (Display *dpy, win *w)
+{
+	Bool validContents = w->validContents;
+	int damaged = w->damaged;
 	
-	glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
-	glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+	teardown_win_resources(dpy, w);
 	
-	__pointer_to_glStencilFillPathInstancedNV(	(GLsizei)messageLength,
-												GL_UNSIGNED_BYTE, message, textPathObjects,
-											GL_PATH_FILL_MODE_NV, ~0, /* Use all stencil bits */
-											GL_TRANSLATE_X_NV, &horizontalOffsets[0]);
+	w->validContents = validContents;
+	w->damaged = damaged;
+	w->evicted = True;
+	textureEvictionCount++;
+}
+
+static XRenderPictFormat *
+render_win_format (Display *dpy, win *w)
+{
+	XRenderPictFormat template;
+	XRenderPictFormat *format;
 	
-	glColor3f(r,g,b);
-	__pointer_to_glCoverFillPathInstancedNV((GLsizei)messageLength,
-											GL_UNSIGNED_BYTE, message, textPathObjects,
-										 GL_PATH_FILL_COVER_MODE_NV,
-										 GL_TRANSLATE_X_NV, &horizontalOffsets[0]);
+	if (w->isOverlay && w->a.depth == 32)
+		return XRenderFindStandardFormat(dpy, PictStandardARGB32);
 	
-	__pointer_to_glStencilStrokePathInstancedNV((GLsizei)messageLength,
-												GL_UNSIGNED_BYTE, message, textPathObjects,
-											 1, ~0, /* Use all stencil bits */
-											 GL_TRANSLATE_X_NV, &horizontalOffsets[0]);
-	glColor3f(0.0,0.0,0.0);
-	__pointer_to_glCoverStrokePathInstancedNV((GLsizei)messageLength,
-											  GL_UNSIGNED_BYTE, message, textPathObjects,
-										   GL_PATH_STROKE_COVER_MODE_NV,
-										   GL_TRANSLATE_X_NV, &horizontalOffsets[0]);
+	// Like on GL, the alpha channel of anything but the overlay is ignored
+	memset(&template, 0, sizeof(template));
+	template.type = PictTypeDirect;
+	template.depth = w->a.depth;
+	template.direct.alphaMask = 0;
 	
-	glDisable(GL_STENCIL_TEST);
+	format = XRenderFindFormat(dpy, PictFormatType | PictFormatDepth | PictFormatAlphaMask, &template, 0);
+	if (!format)
+		format = XRenderFindFormat(dpy, PictFormatType | PictFormatDepth, &template, 0);
 	
-	glPopMatrix();
+	return format;
 }
 
 static void
-paint_debug_info (Display *dpy)
+ensure_win_resources (Display *dpy, win *w)
 {
-	int Y = 100;
-	
-	glBindTexture(GL_TEXTURE_2D, 0);
-	
-	char messageBuffer[256];
-	
-	sprintf(messageBuffer, "Compositing at %.1f FPS", currentFrameRate);
+	if (!w || w->passive || (compositeBackend == BACKEND_GL && !w->fbConfig))
+		return;
 	
-	paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
-	if (find_win(dpy, currentFocusWindow))
+	if (!w->pixmap)
 	{
-		if (gameFocused)
+		uint64_t startTime = get_time_in_microseconds();
+		
+		w->pixmap = XCompositeNameWindowPixmap (dpy, w->id);
+		
+		if (compositeBackend == BACKEND_GL)
 		{
-			sprintf(messageBuffer, "Presenting game window %x", (unsigned int)currentFocusWindow);
-			paint_message(messageBuffer, Y, 0.0f, 1.0f, 0.0f); Y += textYMax;
+			w->glxPixmap = glXCreatePixmap (dpy, w->fbConfig, w->pixmap, w->isOverlay ? tfpAttribsRGBA : tfpAttribs);
+			
+			glBindTexture (GL_TEXTURE_2D, w->texName);
+			__pointer_to_glXBindTexImageEXT (dpy, w->glxPixmap, GLX_FRONT_LEFT_EXT, NULL);
+			
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		}
-		else
+		else if (compositeBackend == BACKEND_RENDER)
 		{
-			// must be Steam
-			paint_message("Presenting Steam", Y, 1.0f, 1.0f, 0.0f); Y += textYMax;
+			XRenderPictFormat *format = render_win_format(dpy, w);
+			XRenderPictureAttributes pa;
+			
+			// Same as clamping to edge, for filtering when scaled
+			pa.repeat = RepeatPad;
+			
+			if (format)
+				w->picture = XRenderCreatePicture(dpy, w->pixmap, format, CPRepeat, &pa);
+		}
+		
+		// Estimate only; drivers pad and may keep depth 24 as 32bpp anyway
+		w->textureSize = (unsigned long)w->a.width * w->a.height * (w->a.depth > 16 ? 4 : 2);
+		w->lastPaintTime = get_time_in_milliseconds();
+		
+		if (w->evicted)
+		{
+			uint64_t restoreTime = get_time_in_microseconds() - startTime;
+			
+			w->evicted = False;
+			textureRestoreCount++;
+			if (restoreTime > textureRestoreMaxTime)
+				textureRestoreMaxTime = restoreTime;
 		}
 	}
 	
-	win *overlay = find_win(dpy, currentOverlayWindow);
-	win *notification = find_win(dpy, currentNotificationWindow);
-	
-	if (overlay && gamesRunningCount && overlay->opacity)
+	if (hasXFences && !w->fence)
 	{
-		sprintf(messageBuffer, "Compositing overlay at opacity %f", overlay->opacity / (float)OPAQUE);
-		paint_message(messageBuffer, Y, 1.0f, 0.0f, 1.0f); Y += textYMax;
+		w->fence = XSyncCreateFence (dpy, root, False);
+		w->glFence = __pointer_to_glImportSyncEXT (GL_SYNC_X11_FENCE_EXT, w->fence, 0);
+		w->fenceTriggered = False;
+		w->fenceDirty = True;
 	}
+}
+
+static Bool
+create_shm_segment (Display *dpy, XShmSegmentInfo *shm, unsigned long size)
+{
+	shm->shmid = shmget(IPC_PRIVATE, size, IPC_CREAT | 0600);
+	if (shm->shmid < 0)
+		return False;
 	
-	if (notification && gamesRunningCount && notification->opacity)
+	shm->shmaddr = shmat(shm->shmid, NULL, 0);
+	shm->readOnly = False;
+	
+	if (shm->shmaddr == (char *)-1 || !XShmAttach(dpy, shm))
 	{
-		sprintf(messageBuffer, "Compositing notification at opacity %f", notification->opacity / (float)OPAQUE);
-		paint_message(messageBuffer, Y, 1.0f, 0.0f, 1.0f); Y += textYMax;
+		shmctl(shm->shmid, IPC_RMID, NULL);
+		shm->shmaddr = NULL;
+		return False;
 	}
 	
-	if (focusedWindowNeedsScale) {
-		paint_message("Scaling current window", Y, 0.0f, 0.0f, 1.0f); Y += textYMax;
-	}
+	// Gone as soon as both of us detach, even if we crash
+	XPROF(XPROF_SHM_SEGMENT_SYNC, XSync(dpy, False));
+	shmctl(shm->shmid, IPC_RMID, NULL);
 	
-	if (gotXError) {
-		paint_message("Encountered X11 error", Y, 1.0f, 0.0f, 0.0f); Y += textYMax;
-	}
+	return True;
 }
 
 static void
-paint_all (Display *dpy)
+destroy_shm_segment (Display *dpy, XShmSegmentInfo *shm)
 {
-	win	*w;
-	win	*overlay;
-	win	*notification;
-	win	*t = NULL;
+	if (!shm->shmaddr)
+		return;
 	
-	Bool canUnredirect = True;
-	Bool overlayDamaged = False;
+	XShmDetach(dpy, shm);
+	shmdt(shm->shmaddr);
+	shm->shmaddr = NULL;
+}
+
+/* CPU backend: bring our copy of a window up to date with what was damaged
+ * since the last time, reading it back through a shared scratch segment.
+ */
+static void
+fetch_win_contents (Display *dpy, win *w)
+{
+	int x1, y1, x2, y2, y;
+	unsigned long size;
+	XImage *image;
 	
-	if (unredirectedWindow)
+	if (!w || !w->pixmap)
 		return;
 	
-	unsigned int currentTime = get_time_in_milliseconds();
-	Bool fadingOut = ((currentTime - fadeOutStartTime) < FADE_OUT_DURATION && fadeOutWindow.id != None);
-	
-	w = find_win(dpy, currentFocusWindow);
-	overlay = find_win(dpy, currentOverlayWindow);
-	notification = find_win(dpy, currentNotificationWindow);
+	if (w->a.depth < 24)
+		return;
 	
-	if (gamesRunningCount)
+	if (!w->cpuPixels || w->cpuWidth != w->a.width || w->cpuHeight != w->a.height)
 	{
-		if (overlay && overlay->damaged)
-			overlayDamaged = True;
-		if (notification && notification->damaged)
-			overlayDamaged = True;
+		free(w->cpuPixels);
+		w->cpuPixels = malloc((unsigned long)w->a.width * w->a.height * sizeof(uint32_t));
+		if (!w->cpuPixels)
+			return;
+		
+		w->cpuWidth = w->a.width;
+		w->cpuHeight = w->a.height;
+		
+		w->damageBoxX1 = 0;
+		w->damageBoxY1 = 0;
+		w->damageBoxX2 = w->cpuWidth;
+		w->damageBoxY2 = w->cpuHeight;
 	}
 	
-	if (!w)
-		return;
+	x1 = w->damageBoxX1 < 0 ? 0 : w->damageBoxX1;
+	y1 = w->damageBoxY1 < 0 ? 0 : w->damageBoxY1;
+	x2 = w->damageBoxX2 > w->cpuWidth ? w->cpuWidth : w->damageBoxX2;
+	y2 = w->damageBoxY2 > w->cpuHeight ? w->cpuHeight : w->damageBoxY2;
 	
-	// Don't pump new frames if no animation on the focus window, unless we're fading
-	if (!w->damaged && !overlayDamaged && !fadeOutWindow.id)
+	if (x2 <= x1 || y2 <= y1)
 		return;
 	
+	size = (unsigned long)(x2 - x1) * (y2 - y1) * sizeof(uint32_t);
 	
-	frameCounter++;
-	
-	if (frameCounter == 5)
+	if (size > cpuFetchSize)
 	{
-		currentFrameRate = 5 * 1000.0f / (currentTime - lastSampledFrameTime);
-		lastSampledFrameTime = currentTime;
-		frameCounter = 0;
+		destroy_shm_segment(dpy, &cpuFetchShm);
+		cpuFetchSize = 0;
+		
+		if (!create_shm_segment(dpy, &cpuFetchShm, size))
+		{
+			fprintf (stderr, "Could not create shared memory segment for window contents\n");
+			return;
+		}
+		cpuFetchSize = size;
 	}
 	
-	w->damaged = 0;
-	
-	ensure_win_resources(dpy, w);
-	ensure_win_resources(dpy, overlay);
-	ensure_win_resources(dpy, notification);
-	
-	glViewport(0, 0, root_width, root_height);
-	glLoadIdentity();
-	glOrtho(0.0f, root_width, root_height, 0.0f, -1.0f, 1.0f);
+	// The visual only provides channel masks, which we don't look at
+	image = XShmCreateImage(dpy, NULL, w->a.depth, ZPixmap, cpuFetchShm.shmaddr,
+							&cpuFetchShm, x2 - x1, y2 - y1);
+	if (!image)
+		return;
 	
-	glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
-	glClear(GL_COLOR_BUFFER_BIT);
+	Bool fetched = False;
 	
-	glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	if (image->bits_per_pixel == 32)
+		XPROF(XPROF_FETCH_SHM_GET_IMAGE, fetched = XShmGetImage(dpy, w->pixmap, image, x1, y1, AllPlanes));
 	
-	// Fading out from previous window?
-	if (fadingOut)
-	{
-		double newOpacity = ((currentTime - fadeOutStartTime) / (double)FADE_OUT_DURATION);
-		
-		// Draw it in the background
-		fadeOutWindow.opacity = (1.0d - newOpacity) * OPAQUE;
-		paint_window(dpy, &fadeOutWindow, True, False);
-		
-		w = find_win(dpy, currentFocusWindow);
-		ensure_win_resources(dpy, w);
-		
-		// Blend new window on top with linear crossfade
-		w->opacity = newOpacity * OPAQUE;
-		
-		paint_window(dpy, w, True, False);
-		
-		canUnredirect = False;
-	}
-	else
+	if (fetched)
 	{
-		w = find_win(dpy, currentFocusWindow);
-		ensure_win_resources(dpy, w);
-		// Just draw focused window as normal, be it Steam or the game
-		paint_window(dpy, w, False, False);
+		for (y = y1; y < y2; y++)
+			memcpy(w->cpuPixels + y * w->cpuWidth + x1,
+				   image->data + (y - y1) * image->bytes_per_line,
+				   (x2 - x1) * sizeof(uint32_t));
 		
-		if (focusedWindowNeedsScale)
-		{
-			canUnredirect = False;
-		}
+		cpuFetchedBytes += size;
 		
-		if (fadeOutWindow.id) {
-			
-			if (fadeOutWindowGone)
-			{
-				// This is the only reference to these resources now.
-				teardown_win_resources(dpy, &fadeOutWindow);
-				fadeOutWindowGone = False;
-			}
-			fadeOutWindow.id = None;
-			
-			// Finished fading out, mark previous window hidden
-			set_win_hidden(dpy, &fadeOutWindow, True);
-		}
+		w->damageBoxX1 = w->damageBoxY1 = 0;
+		w->damageBoxX2 = w->damageBoxY2 = 0;
 	}
 	
-	if (gamesRunningCount && overlay)
+	XFree(image);
+}
+
+/* Make the GPU wait for the X server to be done with everything that
+ * affected the window contents we're about to sample, and nothing else.
+ * Only call this on windows we're going to draw this frame.
+ */
+static void
+sync_win_resources (Display *dpy, win *w)
+{
+	if (compositeBackend == BACKEND_CPU)
 	{
-		if (overlay->opacity)
-		{
-			paint_window(dpy, overlay, True, False);
-			canUnredirect = False;
-		}
-		overlay->damaged = 0;
+		fetch_win_contents(dpy, w);
+		return;
 	}
 	
-	if (gamesRunningCount && notification)
+	if (!w || !w->glFence || !w->fenceDirty)
+		return;
+	
+	if (w->fenceTriggered)
 	{
-		if (notification->opacity)
+		// Can't reset a fence the server hasn't triggered yet; it was
+		// triggered a frame ago so this should hardly ever block.
+		uint64_t waitStart = get_time_in_microseconds();
+		GLenum result;
+		
+		XPROF(XPROF_FENCE_CLIENT_WAIT_SYNC,
+			  result = __pointer_to_glClientWaitSync (w->glFence, GL_SYNC_FLUSH_COMMANDS_BIT,
+													  FENCE_RESET_TIMEOUT));
+		uint64_t waitTime = get_time_in_microseconds() - waitStart;
+		
+		fenceWaitCount++;
+		fenceWaitTotalTime += waitTime;
+		if (waitTime > fenceWaitMaxTime)
+			fenceWaitMaxTime = waitTime;
+		
+		if (result == GL_TIMEOUT_EXPIRED || result == GL_WAIT_FAILED)
 		{
-			paint_window(dpy, notification, True, True);
-			canUnredirect = False;
+			fenceTimeoutCount++;
+			fprintf (stderr, "Timed out waiting for fence of window %lx, drawing it unsynchronized\n", w->id);
+			
+			// A fence stuck untriggered would time out every frame from now
+			// on; ensure_win_resources() makes a fresh one next frame
+			__pointer_to_glDeleteSync (w->glFence);
+			w->glFence = NULL;
+			XSyncDestroyFence (dpy, w->fence);
+			w->fence = None;
+			w->fenceTriggered = False;
+			return;
 		}
-		notification->damaged = 0;
+		
+		XSyncResetFence (dpy, w->fence);
 	}
 	
-	// Draw SW cursor if we need to
-	if (w && focusedWindowNeedsScale && gameFocused)
+	// The GL side waits on the server-side trigger, so the request can't
+	// sit in Xlib's buffer until the next flush
+	XSyncTriggerFence (dpy, w->fence);
+	XFlush (dpy);
+	__pointer_to_glWaitSync (w->glFence, 0, GL_TIMEOUT_IGNORED);
+	
+	w->fenceTriggered = True;
+	w->fenceDirty = False;
+	fencesTriggered++;
+}
+
+static void
+update_render_cursor (Display *dpy, unsigned int *pixels)
+{
+	Pixmap pixmap;
+	XImage *image;
+	GC gc;
+	
+	if (cursorPicture)
 	{
-		if (!hideCursorForMovement)
-			paint_fake_cursor(dpy, w);
-		canUnredirect = False;
+		XRenderFreePicture(dpy, cursorPicture);
+		cursorPicture = None;
 	}
 	
-	if (drawDebugInfo)
-		paint_debug_info(dpy);
+	image = XCreateImage(dpy, NULL, 32, ZPixmap, 0, (char *)pixels,
+						 cursorWidth, cursorHeight, 32, cursorWidth * sizeof(unsigned int));
+	if (!image)
+		return;
 	
-	glXSwapBuffers(dpy, root);
+	pixmap = XCreatePixmap(dpy, root, cursorWidth, cursorHeight, 32);
+	gc = XCreateGC(dpy, pixmap, 0, NULL);
+	XPutImage(dpy, pixmap, gc, image, 0, 0, 0, 0, cursorWidth, cursorHeight);
+	XFreeGC(dpy, gc);
 	
-	if (glGetError() != GL_NO_ERROR)
-	{
-		fprintf (stderr, "GL error!\n");
-		exit (1);
-	}
+	// The pixels are on the stack; only the structure is ours to free
+	XFree(image);
 	
-	// Enable when hitching and blinking issues are resolved
-	if (allowUnredirection && canUnredirect)
-	{
-		unredirectedWindow = currentFocusWindow;
-		teardown_win_resources(dpy, w);
-		XCompositeUnredirectWindow(dpy, unredirectedWindow, CompositeRedirectManual);
-	}
+	cursorPicture = XRenderCreatePicture(dpy, pixmap, XRenderFindStandardFormat(dpy, PictStandardARGB32),
+										 0, NULL);
+	XRenderSetPictureFilter(dpy, cursorPicture, FilterBilinear, NULL, 0);
+	XFreePixmap(dpy, pixmap);
 }
 
 static void
-setup_pointer_barriers (Display *dpy)
+paint_render_cursor (Display *dpy)
 {
-	int i;
-	win		    *w = find_win (dpy, currentFocusWindow);
+	if (!cursorPicture || fakeCursorWidth < 1.0f || fakeCursorHeight < 1.0f)
+		return;
 	
-	// If we had barriers before, get rid of them.
-	for (i = 0; i < 4; i++)
-	{
-		if (scaledFocusBarriers[i] != None)
-		{
-			XFixesDestroyPointerBarrier(dpy, scaledFocusBarriers[i]);
-			scaledFocusBarriers[i] = None;
-		}
-	}
+	XTransform transform = {{
+		{ XDoubleToFixed(cursorWidth / fakeCursorWidth), 0, 0 },
+		{ 0, XDoubleToFixed(cursorHeight / fakeCursorHeight), 0 },
+		{ 0, 0, XDoubleToFixed(1.0) }
+	}};
 	
-	if (focusedWindowNeedsScale == False && gameFocused)
+	XRenderSetPictureTransform(dpy, cursorPicture, &transform);
+	XRenderComposite(dpy, PictOpOver, cursorPicture, None, rootBuffer, 0, 0, 0, 0,
+					 fakeCursorX, fakeCursorY, ceilf(fakeCursorWidth), ceilf(fakeCursorHeight));
+}
+
+static void
+apply_cursor_state (Display *dpy)
+{
+	Bool newCursorVisibility = True;
+	
+	if (hideCursorForScale || hideCursorForMovement)
+		newCursorVisibility = False;
+	
+	if (newCursorVisibility != cursorVisible)
 	{
-		hideCursorForScale = False;
-		apply_cursor_state(dpy);
-		return;
+		cursorVisible = newCursorVisibility;
+		
+		if (cursorVisible)
+			XFixesShowCursor(dpy, DefaultRootWindow(dpy));
+		else
+			XFixesHideCursor(dpy, DefaultRootWindow(dpy));
 	}
+}
+
+/* The software cursor moved, changed or went away. The XRender backend
+ * repaints around it as part of its partial updates; the others only need
+ * to redraw the cursor over the frame they kept.
+ */
+static void
+damage_cursor (win *w)
+{
+	if (compositeBackend == BACKEND_RENDER)
+		w->damaged = 1;
+	else
+		cursorDamaged = True;
+}
+
+static void
+handle_mouse_movement(Display *dpy, int posX, int posY)
+{
+	// Some stuff likes to warp in-place
+	if (cursorX == posX && cursorY == posY)
+		return;
 	
-	// If we're scaling, take ownership of the cursor
-	if (doRender)
+	cursorX = posX;
+	cursorY = posY;
+	
+	win *w = find_win(dpy, currentFocusWindow);
+	
+	if (w && focusedWindowNeedsScale && gameFocused && !serverCursorWindow)
 	{
-		hideCursorForScale = True;
-		apply_cursor_state(dpy);
+		damage_cursor(w);
 	}
 	
-	if (!gameFocused)
-	{
+	// Ignore the first events as it's likely to be non-user-initiated warps
+	// Account for one warp from us, one warp from the app and one warp from
+	// the toolkit.
+	if (w && (w->cold->mouseMoved++ < 3))
 		return;
-	}
 	
-	// Constrain it to the window; careful, the corners will leak due to a known X server bug
-	scaledFocusBarriers[0] = XFixesCreatePointerBarrier(dpy, DefaultRootWindow(dpy), 0, w->a.y, root_width, w->a.y, 0, 0, NULL);
-	scaledFocusBarriers[1] = XFixesCreatePointerBarrier(dpy, DefaultRootWindow(dpy), w->a.x + w->a.width, 0, w->a.x + w->a.width, root_height, 0, 0, NULL);
-	scaledFocusBarriers[2] = XFixesCreatePointerBarrier(dpy, DefaultRootWindow(dpy), root_width, w->a.y + w->a.height, 0, w->a.y + w->a.height, 0, 0, NULL);
-	scaledFocusBarriers[3] = XFixesCreatePointerBarrier(dpy, DefaultRootWindow(dpy), w->a.x, root_height, w->a.x, 0, 0, 0, NULL);
+	lastCursorMovedTime = get_time_in_milliseconds();
 	
-	// Make sure the cursor is somewhere in our jail
-	Window window_returned, child;
-	int root_x, root_y;
-	int win_x, win_y;
-	unsigned int mask_return;
+	hideCursorForMovement = False;
+	apply_cursor_state(dpy);
+}
+
+/* How much to resize the game's cursor by so that it looks the same size
+ * as in Steam or the overlay.
+ */
+static float
+get_cursor_display_scale (Display *dpy)
+{
+	win *mainOverlayWindow = find_win(dpy, currentOverlayWindow);
 	
-	XQueryPointer(dpy, DefaultRootWindow(dpy), &window_returned,
-				  &child, &root_x, &root_y, &win_x, &win_y,
-			   &mask_return);
+	float displayCursorScaleRatio = 1.0f;
 	
-	if (root_x >= w->a.width || root_y >= w->a.height)
+	if (mainOverlayWindow)
 	{
-		XWarpPointer(dpy, None, currentFocusWindow, 0, 0, 0, 0, w->a.width / 2, w->a.height / 2);
+		// The first scale we need to apply is the Steam/overlay scale, if it exists
+		float steamScaleX = (float)root_width / mainOverlayWindow->a.width;
+		float steamScaleY = (float)root_height / mainOverlayWindow->a.height;
+		
+		float steamRatio = (steamScaleX < steamScaleY) ? steamScaleX : steamScaleY;
+		
+		displayCursorScaleRatio *= steamRatio;
+		
+		// Then any global scale, since it would also apply to the Steam window and its SW cursor
+		displayCursorScaleRatio *= globalScaleRatio;
 	}
+	
+	return displayCursorScaleRatio;
 }
 
-static void
-determine_and_apply_focus (Display *dpy)
+/* Follows the pointer and the cursor image for the software cursor, and
+ * works out where it goes on screen; done before drawing anything so the
+ * XRender backend knows what to repaint. Returns False if there's no image.
+ */
+static Bool
+update_fake_cursor (Display *dpy, win *w)
 {
-	win *w, *focus = NULL;
-	
-	gameFocused = False;
+	float scaledCursorX, scaledCursorY;
 	
-	unsigned long maxDamageSequence = 0;
-	Bool usingOverrideRedirectWindow = False;
+	Window window_returned, child;
+	int root_x, root_y;
+	int win_x, win_y;
+	unsigned int mask_return;
 	
-	unsigned int maxOpacity = 0;
+	XPROF(XPROF_FAKE_CURSOR_QUERY_POINTER,
+		  XQueryPointer(dpy, DefaultRootWindow(dpy), &window_returned,
+						&child, &root_x, &root_y, &win_x, &win_y,
+						&mask_return));
 	
-	if (unredirectedWindow != None)
-	{
-		XCompositeRedirectWindow(dpy, unredirectedWindow, CompositeRedirectManual);
-		ensure_win_resources(dpy, find_win(dpy, unredirectedWindow));
-		unredirectedWindow = None;
-	}
+	handle_mouse_movement( dpy, root_x, root_y );
 	
-	for (w = list; w; w = w->next)
+	// Also need new texture
+	if (cursorImageDirty)
 	{
-		if (w->isSteam && !gameFocused)
-		{
-			focus = w;
-		}
+		XFixesCursorImage* im;
 		
-		// We allow using an override redirect window in some cases, but if we have
-		// a choice between two windows we always prefer the non-override redirect one.
-		Bool windowIsOverrideRedirect = w->a.override_redirect && !w->ignoreOverrideRedirect;
+		XPROF(XPROF_FAKE_CURSOR_IMAGE, im = XFixesGetCursorImage(dpy));
 		
-		if (w->gameID && w->a.map_state == IsViewable && w->a.class == InputOutput &&
-			(w->damage_sequence >= maxDamageSequence) &&
-			(!windowIsOverrideRedirect || !usingOverrideRedirectWindow))
+		if (!im)
+			return False;
+		
+		cursorHotX = im->xhot;
+		cursorHotY = im->yhot;
+		
+		cursorWidth = im->width;
+		cursorHeight = im->height;
+		
+		if (compositeBackend == BACKEND_CPU)
 		{
-			focus = w;
-			gameFocused = True;
-			maxDamageSequence = w->damage_sequence;
+			free(cursorPixels);
+			cursorPixels = malloc(cursorWidth * cursorHeight * sizeof(uint32_t));
 			
-			if (windowIsOverrideRedirect)
-			{
-				usingOverrideRedirectWindow = True;
-			}
+			for (int i = 0; cursorPixels && i < cursorWidth * cursorHeight; i++)
+				cursorPixels[i] = im->pixels[i];
 		}
-		
-		if (w->isOverlay)
+		else if (compositeBackend == BACKEND_RENDER)
 		{
-			if (w->a.width == 1920 && w->opacity >= maxOpacity)
-			{
-				currentOverlayWindow = w->id;
-				maxOpacity = w->opacity;
-			}
-			else
-			{
-				currentNotificationWindow = w->id;
-			}
+			unsigned int cursorDataBuffer[cursorWidth * cursorHeight];
+			for (int i = 0; i < cursorWidth * cursorHeight; i++)
+				cursorDataBuffer[i] = im->pixels[i];
+			
+			update_render_cursor(dpy, cursorDataBuffer);
 		}
-	}
-	
-	if (!focus)
-	{
-		currentFocusWindow = None;
-		focusedWindowNeedsScale = False;
-		return;
-	}
-	
-	if (fadeOutWindow.id == None && currentFocusWindow != focus->id)
-	{
-		// Initiate fade out if switching focus
-		w = find_win(dpy, currentFocusWindow);
-		
-		if (w)
+		else
 		{
-			ensure_win_resources(dpy, w);
-			fadeOutWindow = *w;
-			fadeOutStartTime = get_time_in_milliseconds();
+			unsigned int cursorDataBuffer[cursorWidth * cursorHeight];
+			for (int i = 0; i < cursorWidth * cursorHeight; i++)
+				cursorDataBuffer[i] = im->pixels[i];
+			
+			glBindTexture(GL_TEXTURE_2D, cursorTextureName);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, cursorWidth, cursorHeight, 0, GL_BGRA, GL_UNSIGNED_BYTE, cursorDataBuffer);
+			
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 		}
-	}
-	
-	if (fadeOutWindow.id && currentFocusWindow != focus->id)
-	{
-		set_win_hidden(dpy, find_win(dpy, currentFocusWindow), True);
-	}
-	
-	currentFocusWindow = focus->id;
-	w = focus;
-	
-	set_win_hidden(dpy, w, False);
-	
-	if (w->a.width != root_width || w->a.height != root_height || globalScaleRatio != 1.0f)
-	{
-		float XRatio = (float)root_width / w->a.width;
-		float YRatio = (float)root_height / w->a.height;
 		
-		focusedWindowNeedsScale = True;
-		cursorScaleRatio = (XRatio < YRatio) ? XRatio : YRatio;
+		XFree(im);
 		
-		cursorOffsetX = (root_width - w->a.width * cursorScaleRatio * globalScaleRatio) / 2.0f;
-		cursorOffsetY = (root_height - w->a.height * cursorScaleRatio * globalScaleRatio) / 2.0f;
+		cursorImageDirty = False;
 	}
-	else
-		focusedWindowNeedsScale = False;
 	
-	setup_pointer_barriers(dpy);
+	// Actual point on scaled screen where the cursor hotspot should be
+	scaledCursorX = (win_x - w->a.x) * cursorScaleRatio * globalScaleRatio + cursorOffsetX;
+	scaledCursorY = (win_y - w->a.y) * cursorScaleRatio * globalScaleRatio + cursorOffsetY;
 	
-	if (gameFocused || !gamesRunningCount && list[0].id != focus->id)
+	if ( zoomScaleRatio != 1.0 )
 	{
-		XRaiseWindow(dpy, focus->id);
+		scaledCursorX += ((w->a.width / 2) - win_x) * cursorScaleRatio * globalScaleRatio;
+		scaledCursorY += ((w->a.height / 2) - win_y) * cursorScaleRatio * globalScaleRatio;
 	}
 	
-	XSetInputFocus(dpy, focus->id, RevertToNone, CurrentTime);
+	float displayCursorScaleRatio = get_cursor_display_scale(dpy);
 	
-	if (!focus->nudged)
-	{
-		XMoveWindow(dpy, focus->id, 1, 1);
-		focus->nudged = True;
-	}
+	// Apply the cursor offset inside the texture using the display scale
+	fakeCursorX = scaledCursorX - (cursorHotX * displayCursorScaleRatio);
+	fakeCursorY = scaledCursorY - (cursorHotY * displayCursorScaleRatio);
 	
-	if (w->a.x != 0 || w->a.y != 0)
-		XMoveWindow(dpy, focus->id, 0, 0);
+	fakeCursorWidth = cursorWidth * displayCursorScaleRatio;
+	fakeCursorHeight = cursorHeight * displayCursorScaleRatio;
 	
-	if (focus->isFullscreen && focusedWindowNeedsScale)
+	return True;
+}
+
+static void
+paint_fake_cursor (Display *dpy, win *w)
+{
+	if (compositeBackend == BACKEND_CPU)
 	{
-		XResizeWindow(dpy, focus->id, root_width, root_height);
+		cpu_surface cursorSurface = { cursorPixels, cursorWidth, cursorWidth, cursorHeight };
+		
+		if (cursorPixels)
+			cpu_draw_surface(&cpuBackBuffer, &cursorSurface, fakeCursorX, fakeCursorY,
+							 fakeCursorWidth, fakeCursorHeight, 255, True, True);
+		return;
 	}
-	else if (!focus->isFullscreen && focus->sizeHintsSpecified &&
-		(focus->a.width != focus->requestedWidth ||
-		focus->a.height != focus->requestedHeight))
+	
+	if (compositeBackend == BACKEND_RENDER)
 	{
-		XResizeWindow(dpy, focus->id, focus->requestedWidth, focus->requestedHeight);
+		paint_render_cursor(dpy);
+		return;
 	}
 	
-	Window	    root_return = None, parent_return = None;
-	Window	    *children = NULL;
-	unsigned int    nchildren = 0;
-	unsigned int    i = 0;
+	glEnable(GL_BLEND);
+	glBindTexture(GL_TEXTURE_2D, cursorTextureName);
+	glEnable(GL_TEXTURE_2D);
 	
-	XQueryTree (dpy, w->id, &root_return, &parent_return, &children, &nchildren);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	
-	while (i < nchildren)
-	{
-		XSelectInput(dpy, children[i], PointerMotionMask);
-		i++;
-	}
+	glColor3f(1.0f, 1.0f, 1.0f);
 	
-	XFree (children);
+	glBegin (GL_QUADS);
+	glTexCoord2d (0.0f, 0.0f);
+	glVertex2d (fakeCursorX, fakeCursorY);
+	glTexCoord2d (1.0f, 0.0f);
+	glVertex2d (fakeCursorX + fakeCursorWidth, fakeCursorY);
+	glTexCoord2d (1.0f, 1.0f);
+	glVertex2d (fakeCursorX + fakeCursorWidth, fakeCursorY + fakeCursorHeight);
+	glTexCoord2d (0.0f, 1.0f);
+	glVertex2d (fakeCursorX, fakeCursorY + fakeCursorHeight);
+	glEnd ();
 }
 
-/* Get prop from window
- *   not found: default
- *   otherwise the value
- */
-static unsigned int
-get_prop(Display *dpy, Window win, Atom prop, unsigned int def)
+/* Screen pixels the software cursor touches, including the partial ones. */
+static XRectangle
+fake_cursor_rect (void)
 {
-	Atom actual;
-	int format;
-	unsigned long n, left;
-	
-	unsigned char *data;
-	int result = XGetWindowProperty(dpy, win, prop, 0L, 1L, False,
-									XA_CARDINAL, &actual, &format,
-								 &n, &left, &data);
-	if (result == Success && data != NULL)
-	{
-		unsigned int i;
-		memcpy (&i, data, sizeof (unsigned int));
-		XFree( (void *) data);
-		return i;
-	}
-	return def;
+	XRectangle rect = { 0, 0, 0, 0 };
+	int x1 = floorf(fakeCursorX);
+	int y1 = floorf(fakeCursorY);
+	int x2 = ceilf(fakeCursorX + fakeCursorWidth) + 1;
+	int y2 = ceilf(fakeCursorY + fakeCursorHeight) + 1;
+	
+	if (x1 < 0)
+		x1 = 0;
+	if (y1 < 0)
+		y1 = 0;
+	if (x2 > root_width)
+		x2 = root_width;
+	if (y2 > root_height)
+		y2 = root_height;
+	
+	if (x2 > x1 && y2 > y1)
+		rect = (XRectangle){ x1, y1, x2 - x1, y2 - y1 };
+	
+	return rect;
 }
 
+/* CPU backend: the back buffer stays around between frames, so keeping
+ * what's under the cursor is enough to take it off again.
+ */
 static void
-get_size_hints(Display *dpy, win *w)
+save_cursor_under (void)
 {
-	XSizeHints hints;
-	long hintsSpecified;
+	XRectangle rect = fake_cursor_rect();
+	unsigned long size = (unsigned long)rect.width * rect.height;
+	int y;
 	
-	XGetWMNormalHints(dpy, w->id, &hints, &hintsSpecified);
-	
-	if (hintsSpecified & (PMaxSize | PMinSize) &&
-		hints.max_width * hints.max_height * hints.min_width * hints.min_height &&
-		hints.max_width == hints.min_width && hints.min_height == hints.max_height)
-	{
-		w->requestedWidth = hints.max_width;
-		w->requestedHeight = hints.max_height;
-		
-		w->sizeHintsSpecified = True;
-	}
-	else
+	if (size > cursorSaveUnderSize)
 	{
-		w->sizeHintsSpecified = False;
+		free(cursorSaveUnder);
+		cursorSaveUnder = malloc(size * sizeof(uint32_t));
+		cursorSaveUnderSize = cursorSaveUnder ? size : 0;
 		
-		// Below block checks for a pattern that matches old SDL fullscreen applications;
-		// SDL creates a fullscreen overrride-redirect window and reparents the game
-		// window under it, centered. We get rid of the modeswitch and also want that
-		// black border gone.
-		if (w->a.override_redirect)
-		{
-			Window	    root_return = None, parent_return = None;
-			Window	    *children = NULL;
-			unsigned int    nchildren = 0;
-			
-			XQueryTree (dpy, w->id, &root_return, &parent_return, &children, &nchildren);
-			
-			if (nchildren == 1)
-			{
-				XWindowAttributes attribs;
-				
-				XGetWindowAttributes (dpy, children[0], &attribs);
-				
-				// If we have a unique children that isn't override-reidrect that is
-				// contained inside this fullscreen window, it's probably it.
-				if (attribs.override_redirect == False &&
-					attribs.width <= w->a.width &&
-					attribs.height <= w->a.height)
-				{
-					w->sizeHintsSpecified = True;
-					
-					w->requestedWidth = attribs.width;
-					w->requestedHeight = attribs.height;
-					
-					XMoveWindow(dpy, children[0], 0, 0);
-					
-					w->ignoreOverrideRedirect = True;
-				}
-			}
-			
-			XFree (children);
-		}
+		if (!cursorSaveUnder)
+			rect.width = rect.height = 0;
 	}
+	
+	for (y = 0; y < rect.height; y++)
+		memcpy(cursorSaveUnder + y * rect.width,
+			   cpuBackBuffer.pixels + (rect.y + y) * cpuBackBuffer.stride + rect.x,
+			   rect.width * sizeof(uint32_t));
+	
+	cursorSaveUnderRect = rect;
 }
 
 static void
-map_win (Display *dpy, Window id, unsigned long sequence)
+restore_cursor_under (void)
 {
-	win		*w = find_win (dpy, id);
-	
-	if (!w)
-		return;
-	
-	w->a.map_state = IsViewable;
-	
-	/* This needs to be here or else we lose transparency messages */
-	XSelectInput (dpy, id, PropertyChangeMask | SubstructureNotifyMask |
-	PointerMotionMask | LeaveWindowMask);
-	
-	/* This needs to be here since we don't get PropertyNotify when unmapped */
-	w->opacity = get_prop (dpy, w->id, opacityAtom, TRANSLUCENT);
-	
-	w->isSteam = get_prop (dpy, w->id, steamAtom, 0);
-	w->gameID = get_prop (dpy, w->id, gameAtom, 0);
-	w->isOverlay = get_prop (dpy, w->id, overlayAtom, 0);
-	
-	get_size_hints(dpy, w);
+	XRectangle rect = cursorSaveUnderRect;
+	int y;
 	
-	w->damaged = 0;
-	w->damage_sequence = 0;
-	w->map_sequence = sequence;
-	
-	w->validContents = False;
+	for (y = 0; y < rect.height; y++)
+		memcpy(cpuBackBuffer.pixels + (rect.y + y) * cpuBackBuffer.stride + rect.x,
+			   cursorSaveUnder + y * rect.width,
+			   rect.width * sizeof(uint32_t));
 	
-	focusDirty = True;
+	cursorSaveUnderRect.width = cursorSaveUnderRect.height = 0;
 }
 
-static void
-finish_unmap_win (Display *dpy, win *w)
+/* GL backend: frames with a software cursor are composited into a
+ * screen-sized texture first, then copied to the back buffer under it.
+ */
+static Bool
+ensure_scene_framebuffer (void)
 {
-	w->damaged = 0;
-	w->validContents = False;
+	if (!hasSceneFramebuffer)
+		return False;
 	
-	if (w->pixmap && fadeOutWindow.id != w->id)
+	if (sceneTexture && sceneWidth == root_width && sceneHeight == root_height)
+		return True;
+	
+	if (!sceneTexture)
 	{
-		teardown_win_resources(dpy, w);
+		glGenTextures(1, &sceneTexture);
+		__pointer_to_glGenFramebuffers(1, &sceneFramebuffer);
 	}
 	
-	if (fadeOutWindow.id == w->id)
+	glBindTexture(GL_TEXTURE_2D, sceneTexture);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, root_width, root_height, 0, GL_BGRA, GL_UNSIGNED_BYTE, NULL);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	
+	__pointer_to_glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+	__pointer_to_glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneTexture, 0);
+	
+	if (__pointer_to_glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
 	{
-		fadeOutWindowGone = True;
+		fprintf (stderr, "Scene framebuffer incomplete, drawing the cursor with every frame\n");
+		hasSceneFramebuffer = False;
 	}
 	
-	/* don't care about properties anymore */
-	set_ignore (dpy, NextRequest (dpy));
-	XSelectInput(dpy, w->id, 0);
+	__pointer_to_glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	
-	clipChanged = True;
+	sceneWidth = root_width;
+	sceneHeight = root_height;
+	
+	return hasSceneFramebuffer;
 }
 
 static void
-unmap_win (Display *dpy, Window id, Bool fade)
+copy_scene_to_back_buffer (void)
 {
-	win *w = find_win (dpy, id);
-	if (!w)
-		return;
-	w->a.map_state = IsUnmapped;
-	
-	focusDirty = True;
-	
-	finish_unmap_win (dpy, w);
+	__pointer_to_glBindFramebuffer(GL_READ_FRAMEBUFFER, sceneFramebuffer);
+	__pointer_to_glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+	__pointer_to_glBlitFramebuffer(0, 0, root_width, root_height, 0, 0, root_width, root_height,
+								   GL_COLOR_BUFFER_BIT, GL_NEAREST);
+	__pointer_to_glBindFramebuffer(GL_FRAMEBUFFER, 0);
 }
 
-static void
-add_win (Display *dpy, Window id, Window prev, unsigned long sequence)
+typedef struct _win_geometry {
+	int			originX, originY;
+	int			width, height;
+	int			drawXOffset, drawYOffset;	/* letterbox */
+	Bool		isScaling;
+} win_geometry;
+
+/* Where paint_window puts a window on screen. Notifications are scaled like
+ * the overlay and sit in the bottom right corner.
+ */
+static Bool
+get_win_geometry (Display *dpy, win *w, Bool notificationMode, win_geometry *geometry)
 {
-	win				*new = malloc (sizeof (win));
-	win				**p;
+	int sourceWidth, sourceHeight;
+	int drawXOffset = 0, drawYOffset = 0;
+	Bool isScaling = False;
+	float currentScaleRatio = 1.0;
 	
-	if (!new)
-		return;
-	if (prev)
+	win *mainOverlayWindow = find_win(dpy, currentOverlayWindow);
+	
+	if (notificationMode && !mainOverlayWindow)
+		return False;
+	
+	if (notificationMode)
 	{
-		for (p = &list; *p; p = &(*p)->next)
-			if ((*p)->id == prev)
-				break;
+		sourceWidth = mainOverlayWindow->a.width;
+		sourceHeight = mainOverlayWindow->a.height;
 	}
 	else
-		p = &list;
-	new->id = id;
-	set_ignore (dpy, NextRequest (dpy));
-	if (!XGetWindowAttributes (dpy, id, &new->a))
-	{
-		free (new);
-		return;
-	}
-	new->damaged = 0;
-	new->validContents = False;
-	new->pixmap = None;
-	new->fbConfig = win_fbconfig(dpy, new->id);
-	if (new->fbConfig == None)
 	{
-		// XXX figure out why Thomas was Alone window doesn't work when using its
-		// visual but works with that fallback to the root window visual; is it
-		// because it has several samples?
-		new->fbConfig = win_fbconfig(dpy, root);
+		sourceWidth = w->a.width;
+		sourceHeight = w->a.height;
 	}
-	glGenTextures (1, &new->texName);
-	new->damage_sequence = 0;
-	new->map_sequence = 0;
-	if (new->a.class == InputOnly)
-		new->damage = None;
-	else
+	
+	if (sourceWidth != root_width || sourceHeight != root_height || globalScaleRatio != 1.0f)
 	{
-		new->damage = XDamageCreate (dpy, id, XDamageReportRawRectangles);
-		// Make sure the Windows we present have background = None for seamless unredirection
-		if (allowUnredirection)
-			XSetWindowBackgroundPixmap (dpy, id, None);
-	}
-	new->opacity = TRANSLUCENT;
-	
-	new->isOverlay = False;
-	new->isSteam = False;
-	new->gameID = 0;
-	new->isFullscreen = False;
-	new->isHidden = False;
-	new->sizeHintsSpecified = False;
-	new->requestedWidth = 0;
-	new->requestedHeight = 0;
-	new->nudged = False;
-	new->ignoreOverrideRedirect = False;
-	
-	new->mouseMoved = False;
-	
-	new->next = *p;
-	*p = new;
-	if (new->a.map_state == IsViewable)
-		map_win (dpy, id, sequence);
-	
-	focusDirty = True;
-}
-
-static void
-restack_win (Display *dpy, win *w, Window new_above)
-{
-	Window  old_above;
-	
-	if (w->next)
-		old_above = w->next->id;
-	else
-		old_above = None;
-	if (old_above != new_above)
-	{
-		win **prev;
+		float XRatio = (float)root_width / sourceWidth;
+		float YRatio = (float)root_height / sourceHeight;
 		
-		/* unhook */
-		for (prev = &list; *prev; prev = &(*prev)->next)
-			if ((*prev) == w)
-				break;
-			*prev = w->next;
+		currentScaleRatio = (XRatio < YRatio) ? XRatio : YRatio;
+		currentScaleRatio *= globalScaleRatio;
+		
+		drawXOffset = (root_width - sourceWidth * currentScaleRatio) / 2.0f;
+		drawYOffset = (root_height - sourceHeight * currentScaleRatio) / 2.0f;
 		
-		/* rehook */
-		for (prev = &list; *prev; prev = &(*prev)->next)
+		if ( zoomScaleRatio != 1.0 )
 		{
-			if ((*prev)->id == new_above)
-				break;
+			drawXOffset += ((sourceWidth / 2) - cursorX) * currentScaleRatio;
+			drawYOffset += ((sourceHeight / 2) - cursorY) * currentScaleRatio;
 		}
-		w->next = *prev;
-		*prev = w;
 		
-		focusDirty = True;
+		isScaling = True;
 	}
-}
-
-static void
-configure_win (Display *dpy, XConfigureEvent *ce)
-{
-	win		    *w = find_win (dpy, ce->window);
-	XserverRegion   damage = None;
 	
-	if (!w || w->id != ce->window)
+	if (notificationMode)
 	{
-		if (ce->window == root)
+		int xOffset = 0, yOffset = 0;
+		
+		geometry->width = w->a.width * currentScaleRatio;
+		geometry->height = w->a.height * currentScaleRatio;
+		
+		if (globalScaleRatio != 1.0f)
 		{
-			root_width = ce->width;
-			root_height = ce->height;
+			xOffset = (root_width - root_width * globalScaleRatio) / 2.0;
+			yOffset = (root_height - root_height * globalScaleRatio) / 2.0;
 		}
-		return;
+		
+		geometry->originX = root_width - xOffset - geometry->width;
+		geometry->originY = root_height - yOffset - geometry->height;
 	}
-	
-	w->a.x = ce->x;
-	w->a.y = ce->y;
-	if (w->a.width != ce->width || w->a.height != ce->height)
+	else
 	{
-		if (w->pixmap)
-		{
-			XFreePixmap (dpy, w->pixmap);
-			w->pixmap = None;
-		}
+		geometry->originX = drawXOffset;
+		geometry->originY = drawYOffset;
+		
+		geometry->width = sourceWidth * currentScaleRatio;
+		geometry->height = sourceHeight * currentScaleRatio;
 	}
-	w->a.width = ce->width;
-	w->a.height = ce->height;
-	w->a.border_width = ce->border_width;
-	w->a.override_redirect = ce->override_redirect;
-	restack_win (dpy, w, ce->above);
 	
-	focusDirty = True;
+	geometry->drawXOffset = drawXOffset;
+	geometry->drawYOffset = drawYOffset;
+	geometry->isScaling = isScaling;
+	
+	return True;
 }
 
+/* CPU backend version of the drawing part of paint_window. Without blending
+ * the letterbox is filled here rather than cleared beforehand, so the
+ * focused window costs a single pass over the screen.
+ */
 static void
-circulate_win (Display *dpy, XCirculateEvent *ce)
+paint_window_cpu (win *w, Bool doBlend, Bool drawLetterbox, win_geometry *geometry)
 {
-	win	    *w = find_win (dpy, ce->window);
-	Window  new_above;
+	unsigned int alpha = doBlend ? w->opacity >> 24 : 255;
+	cpu_surface source = { w->cpuPixels, w->cpuWidth, w->cpuWidth, w->cpuHeight };
+	int drawXOffset = geometry->drawXOffset, drawYOffset = geometry->drawYOffset;
 	
-	if (!w || w->id != ce->window)
+	if (drawLetterbox)
+	{
+		// Top and bottom stripes, including sides, then side stripes
+		cpu_fill_rect(&cpuBackBuffer, 0, 0, root_width, drawYOffset, 0xFF000000, alpha);
+		cpu_fill_rect(&cpuBackBuffer, 0, root_height - drawYOffset, root_width, drawYOffset, 0xFF000000, alpha);
+		cpu_fill_rect(&cpuBackBuffer, 0, drawYOffset, drawXOffset, root_height - 2 * drawYOffset, 0xFF000000, alpha);
+		cpu_fill_rect(&cpuBackBuffer, root_width - drawXOffset, drawYOffset, drawXOffset,
+					  root_height - 2 * drawYOffset, 0xFF000000, alpha);
+	}
+	
+	if (!w->cpuPixels)
 		return;
 	
-	if (ce->place == PlaceOnTop)
-		new_above = list->id;
-	else
-		new_above = None;
-	restack_win (dpy, w, new_above);
-	clipChanged = True;
+	cpu_draw_surface(&cpuBackBuffer, &source, geometry->originX, geometry->originY,
+					 geometry->width, geometry->height,
+					 alpha, doBlend && w->isOverlay, scaleFilter == GL_LINEAR);
 }
 
 static void
-finish_destroy_win (Display *dpy, Window id, Bool gone)
+paint_window_render (Display *dpy, win *w, Bool doBlend, Bool drawLetterbox, win_geometry *geometry)
 {
-	win	**prev, *w;
+	int drawXOffset = geometry->drawXOffset, drawYOffset = geometry->drawYOffset;
+	Picture mask = None;
 	
-	for (prev = &list; (w = *prev); prev = &w->next)
-		if (w->id == id)
+	if (drawLetterbox)
+	{
+		// Premultiplied, so black at any opacity is just alpha
+		XRenderColor black = { 0, 0, 0, doBlend ? w->opacity >> 16 : 0xFFFF };
+		XRectangle stripes[4];
+		int count = 0;
+		
+		// Top and bottom stripes, including sides, then side stripes
+		if (drawYOffset > 0)
 		{
-			if (gone)
-				finish_unmap_win (dpy, w);
-			*prev = w->next;
-			if (w->damage != None)
-			{
-				set_ignore (dpy, NextRequest (dpy));
-				XDamageDestroy (dpy, w->damage);
-				w->damage = None;
-			}
-			free (w);
-			break;
+			stripes[count++] = (XRectangle){ 0, 0, root_width, drawYOffset };
+			stripes[count++] = (XRectangle){ 0, root_height - drawYOffset, root_width, drawYOffset };
 		}
-}
-
-static void
-destroy_win (Display *dpy, Window id, Bool gone, Bool fade)
-{
-	if (currentFocusWindow == id && gone)
-		currentFocusWindow = None;
-	if (currentOverlayWindow == id && gone)
-		currentOverlayWindow = None;
-	if (currentNotificationWindow == id && gone)
-		currentNotificationWindow = None;
-	focusDirty = True;
+		if (drawXOffset > 0 && root_height > 2 * drawYOffset)
+		{
+			stripes[count++] = (XRectangle){ 0, drawYOffset, drawXOffset, root_height - 2 * drawYOffset };
+			stripes[count++] = (XRectangle){ root_width - drawXOffset, drawYOffset,
+											 drawXOffset, root_height - 2 * drawYOffset };
+		}
+		
+		if (count)
+			XRenderFillRectangles(dpy, doBlend ? PictOpOver : PictOpSrc, rootBuffer, &black, stripes, count);
+	}
 	
-	finish_destroy_win (dpy, id, gone);
+	if (!w->picture || geometry->width <= 0 || geometry->height <= 0)
+		return;
+	
+	XTransform transform = {{
+		{ XDoubleToFixed((double)w->a.width / geometry->width), 0, 0 },
+		{ 0, XDoubleToFixed((double)w->a.height / geometry->height), 0 },
+		{ 0, 0, XDoubleToFixed(1.0) }
+	}};
+	
+	XRenderSetPictureTransform(dpy, w->picture, &transform);
+	XRenderSetPictureFilter(dpy, w->picture, scaleFilter == GL_LINEAR ? FilterBilinear : FilterNearest,
+							NULL, 0);
+	
+	if (doBlend && w->opacity != OPAQUE)
+	{
+		XRenderColor color = { 0, 0, 0, w->opacity >> 16 };
+		
+		mask = XRenderCreateSolidFill(dpy, &color);
+	}
+	
+	XRenderComposite(dpy, doBlend ? PictOpOver : PictOpSrc, w->picture, mask, rootBuffer,
+					 0, 0, 0, 0, geometry->originX, geometry->originY,
+					 geometry->width, geometry->height);
+	
+	if (mask)
+		XRenderFreePicture(dpy, mask);
 }
 
 static void
-damage_win (Display *dpy, XDamageNotifyEvent *de)
+paint_window (Display *dpy, win *w, Bool doBlend, Bool notificationMode)
 {
-	win	*w = find_win (dpy, de->drawable);
-	win *focus = find_win(dpy, currentFocusWindow);
+	win_geometry geometry;
 	
 	if (!w)
 		return;
 	
-	w->validContents = True;
+	if (w->isOverlay && !w->validContents)
+		return;
 	
-	if (w->isOverlay && !w->opacity)
+	w->lastPaintTime = get_time_in_milliseconds();
+	
+	if (switchStartTime && w->id == switchWindow)
+		switchWindowPainted = True;
+	
+	if (!get_win_geometry(dpy, w, notificationMode, &geometry))
 		return;
 	
-	// First damage event we get, compute focus; we only want to focus damaged
-	// windows to have meaningful frames.
-	if (w->gameID && w->damage_sequence == 0)
-		focusDirty = True;
+	if (compositeBackend == BACKEND_CPU)
+	{
+		paint_window_cpu(w, doBlend, geometry.isScaling && !notificationMode, &geometry);
+		return;
+	}
 	
-	w->damage_sequence = damageSequence++;
+	if (compositeBackend == BACKEND_RENDER)
+	{
+		paint_window_render(dpy, w, doBlend, geometry.isScaling && !notificationMode, &geometry);
+		return;
+	}
 	
-	// If we just passed the focused window, we might be eliglible to take over
-	if (focus && focus != w && w->gameID &&
-		w->damage_sequence > focus->damage_sequence)
-		focusDirty = True;
+	Bool isScaling = geometry.isScaling;
+	int drawXOffset = geometry.drawXOffset, drawYOffset = geometry.drawYOffset;
+	int originX = geometry.originX, originY = geometry.originY;
+	int width = geometry.width, height = geometry.height;
 	
-	w->damaged = 1;
+	glBindTexture (GL_TEXTURE_2D, w->texName);
+	glEnable(GL_TEXTURE_2D);
 	
-	if (w->damage)
-		XDamageSubtract(dpy, w->damage, None, None);
-}
-
-static int
-error (Display *dpy, XErrorEvent *ev)
-{
-	int	    o;
-	const char    *name = NULL;
-	static char buffer[256];
+	// Filter can be changed at runtime through the control socket
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, scaleFilter);
+	glTexParameteri (GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, scaleFilter);
 	
-	if (should_ignore (dpy, ev->serial))
-		return 0;
+	if (doBlend)
+		glEnable(GL_BLEND);
+	else
+		glDisable(GL_BLEND);
 	
-	if (ev->request_code == composite_opcode &&
-		ev->minor_code == X_CompositeRedirectSubwindows)
+	// If scaling and blending, we need to draw our letterbox black border with
+	// the right opacity instead of relying on the clear color
+	if (isScaling && doBlend && !notificationMode)
 	{
-		fprintf (stderr, "Another composite manager is already running\n");
-		exit (1);
+		glDisable(GL_TEXTURE_2D);
+		glColor4f(0.0f, 0.0f, 0.0f, (float)w->opacity / OPAQUE);
+		
+		glBegin (GL_QUADS);
+		
+		// We can't overdraw because we're blending
+		
+		// Top and bottom stripes, including sides
+		if (drawYOffset)
+		{
+			glVertex2d (0.0f, 0.0f);
+			glVertex2d (root_width, 0.0f);
+			glVertex2d (root_width, drawYOffset);
+			glVertex2d (0.0f, drawYOffset);
+			
+			glVertex2d (0.0f, root_height - drawYOffset);
+			glVertex2d (root_width, root_height - drawYOffset);
+			glVertex2d (root_width, root_height);
+			glVertex2d (0.0f, root_height);
+		}
+		
+		// Side stripes, excluding any top and bottom areas
+		if (drawXOffset)
+		{
+			glVertex2d (0.0f, drawYOffset);
+			glVertex2d (drawXOffset, drawYOffset);
+			glVertex2d (drawXOffset, root_height - drawYOffset);
+			glVertex2d (0.0f, root_height - drawYOffset);
+			
+			glVertex2d (root_width - drawXOffset, drawYOffset);
+			glVertex2d (root_width, drawYOffset);
+			glVertex2d (root_width, root_height - drawYOffset);
+			glVertex2d (root_width - drawXOffset, root_height - drawYOffset);
+		}
+		
+		glEnd ();
 	}
 	
-	o = ev->error_code - xfixes_error;
-	switch (o) {
-		case BadRegion: name = "BadRegion";	break;
-		default: break;
-	}
-	o = ev->error_code - damage_error;
-	switch (o) {
-		case BadDamage: name = "BadDamage";	break;
-		default: break;
-	}
-	o = ev->error_code - render_error;
-	switch (o) {
-		case BadPictFormat: name ="BadPictFormat"; break;
-		case BadPicture: name ="BadPicture"; break;
-		case BadPictOp: name ="BadPictOp"; break;
-		case BadGlyphSet: name ="BadGlyphSet"; break;
-		case BadGlyph: name ="BadGlyph"; break;
-		default: break;
-	}
+	glEnable(GL_TEXTURE_2D);
 	
-	if (name == NULL)
-	{
-		buffer[0] = '\0';
-		XGetErrorText (dpy, ev->error_code, buffer, sizeof (buffer));
-		name = buffer;
-	}
+	if (w->isOverlay)
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, GL_ALPHA);
+	else
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_A, GL_ONE);
 	
-	fprintf (stderr, "error %d: %s request %d minor %d serial %lu\n",
-			 ev->error_code, (strlen (name) > 0) ? name : "unknown",
-			 ev->request_code, ev->minor_code, ev->serial);
+	glColor4f(1.0f, 1.0f, 1.0f, (float)w->opacity / OPAQUE);
 	
-	gotXError = True;
-	/*    abort ();	    this is just annoying to most people */
-	return 0;
+	glBegin (GL_QUADS);
+	glTexCoord2d (0.0f, 0.0f);
+	glVertex2d (originX, originY);
+	glTexCoord2d (1.0f, 0.0f);
+	glVertex2d (originX + width, originY);
+	glTexCoord2d (1.0f, 1.0f);
+	glVertex2d (originX + width, originY + height);
+	glTexCoord2d (0.0f, 1.0f);
+	glVertex2d (originX, originY + height);
+	glEnd ();
 }
 
 static void
-usage (char *program)
+paint_message (const char *message, int Y, float r, float g, float b)
+{
+	int messageLength = strlen(message);
+	GLfloat horizontalOffsets[messageLength + 1];
+	
+	horizontalOffsets[0] = 0;
+	
+	__pointer_to_glGetPathSpacingNV(GL_ACCUM_ADJACENT_PAIRS_NV,
+									(GLsizei)messageLength, GL_UNSIGNED_BYTE, message,
+									textPathObjects,
+								 1.0, 1.0,
+								 GL_TRANSLATE_X_NV,
+								 &horizontalOffsets[1]);
+	
+	float messageWidth = horizontalOffsets[messageLength - 1] + textXAdvance[message[messageLength - 1]];
+	
+	glPushMatrix();
+	
+	glTranslatef(root_width - messageWidth - 100, Y + textYMax - textYMin, 0.0);
+	glScalef(1.0, -1.0, 1.0);
+	
+	glEnable(GL_STENCIL_TEST);
+	
+	glStencilFunc(GL_NOTEQUAL, 0, 0xFF);
+	glStencilOp(GL_KEEP, GL_KEEP, GL_ZERO);
+	
+	__pointer_to_glStencilFillPathInstancedNV(	(GLsizei)messageLength,
+												GL_UNSIGNED_BYTE, message, textPathObjects,
+											GL_PATH_FILL_MODE_NV, ~0, /* Use all stencil bits */
+											GL_TRANSLATE_X_NV, &horizontalOffsets[0]);
+	
+	glColor3f(r,g,b);
+	__pointer_to_glCoverFillPathInstancedNV((GLsizei)messageLength,
+											GL_UNSIGNED_BYTE, message, textPathObjects,
+										 GL_PATH_FILL_COVER_MODE_NV,
+										 GL_TRANSLATE_X_NV, &horizontalOffsets[0]);
+	
+	__pointer_to_glStencilStrokePathInstancedNV((GLsizei)messageLength,
+												GL_UNSIGNED_BYTE, message, textPathObjects,
+											 1, ~0, /* Use all stencil bits */
+											 GL_TRANSLATE_X_NV, &horizontalOffsets[0]);
+	glColor3f(0.0,0.0,0.0);
+	__pointer_to_glCoverStrokePathInstancedNV((GLsizei)messageLength,
+											  GL_UNSIGNED_BYTE, message, textPathObjects,
+										   GL_PATH_STROKE_COVER_MODE_NV,
+										   GL_TRANSLATE_X_NV, &horizontalOffsets[0]);
+	
+	glDisable(GL_STENCIL_TEST);
+	
+	glPopMatrix();
+}
+
+static void
+paint_debug_info (Display *dpy)
+{
+	int Y = 100;
+	
+	glBindTexture(GL_TEXTURE_2D, 0);
+	
+	char messageBuffer[256];
+	
+	sprintf(messageBuffer, "Compositing at %.1f FPS", currentFrameRate);
+	
+	paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	if (find_win(dpy, currentFocusWindow))
+	{
+		if (gameFocused)
+		{
+			win *game = find_win(dpy, currentFocusWindow);
+			
+			sprintf(messageBuffer, "Presenting game window %x", (unsigned int)currentFocusWindow);
+			paint_message(messageBuffer, Y, 0.0f, 1.0f, 0.0f); Y += textYMax;
+			
+			sprintf(messageBuffer, "Game at %.1f FPS, jitter %.2fms, %u dropped, %u duplicated",
+					game->frameIntervalAverage ? 1000.0f / game->frameIntervalAverage : 0.0f,
+					sqrtf(game->cold->frameIntervalVariance),
+					game->cold->droppedFrames, game->cold->duplicatedFrames);
+			paint_message(messageBuffer, Y, 0.0f, 1.0f, 0.0f); Y += textYMax;
+		}
+		else
+		{
+			// must be Steam
+			paint_message("Presenting Steam", Y, 1.0f, 1.0f, 0.0f); Y += textYMax;
+		}
+	}
+	
+	win *overlay = find_win(dpy, currentOverlayWindow);
+	win *notification = find_win(dpy, currentNotificationWindow);
+	
+	if (overlay && gamesRunningCount && overlay->opacity)
+	{
+		sprintf(messageBuffer, "Compositing overlay at opacity %f", overlay->opacity / (float)OPAQUE);
+		paint_message(messageBuffer, Y, 1.0f, 0.0f, 1.0f); Y += textYMax;
+	}
+	
+	if (notification && gamesRunningCount && notification->opacity)
+	{
+		sprintf(messageBuffer, "Compositing notification at opacity %f", notification->opacity / (float)OPAQUE);
+		paint_message(messageBuffer, Y, 1.0f, 0.0f, 1.0f); Y += textYMax;
+	}
+	
+	if (focusedWindowNeedsScale) {
+		paint_message("Scaling current window", Y, 0.0f, 0.0f, 1.0f); Y += textYMax;
+	}
+	
+	sprintf(messageBuffer, "Presentation mode: %s", presentationModeNames[currentPresentationMode]);
+	paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	
+	if (framePacing && gameFocused && pacer_active(&gamePacer))
+	{
+		sprintf(messageBuffer, "Pacing game at %.2f vblanks per frame", gamePacer.ratio);
+		paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	}
+	
+	if (gotXError) {
+		paint_message("Encountered X11 error", Y, 1.0f, 0.0f, 0.0f); Y += textYMax;
+	}
+	
+	if (hasPresent)
+	{
+		sprintf(messageBuffer, "Present: MSC %llu, swap to scanout %.2fms",
+				(unsigned long long)lastVblankMsc, swapToScanoutLatency);
+		paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	}
+	
+	if (hasXFences)
+	{
+		sprintf(messageBuffer, "Fences: %u triggered, %u waits, %.2fms max wait, %u timeouts",
+				fencesTriggered, fenceWaitCount, fenceWaitMaxTime / 1000.0f, fenceTimeoutCount);
+		paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	}
+	
+	sprintf(messageBuffer, "Textures: %.1fMB resident, %u evicted, %u restored, %.2fms max restore",
+			residentTextureMemory / (1024.0f * 1024.0f), textureEvictionCount,
+			textureRestoreCount, textureRestoreMaxTime / 1000.0f);
+	paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	
+	sprintf(messageBuffer, "Switches: %u (%u pre-warmed, %u avoided), last %.2fms, max %.2fms",
+			switchCount, switchWarmCount, focusSwitchesAvoided, lastSwitchLatency, maxSwitchLatency);
+	paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	
+	int worstSite = 0;
+	int i;
+	
+	for (i = 1; i < XPROF_SITE_COUNT; i++)
+	{
+		if (xprofSites[i].lastFrameTime > xprofSites[worstSite].lastFrameTime)
+			worstSite = i;
+	}
+	
+	sprintf(messageBuffer, "X blocking: %u calls %.2fms last frame (%s %.2fms), %.2fms max, %lu requests",
+			xprofTotal.lastFrameCalls, xprofTotal.lastFrameTime / 1000.0f,
+			xprofSiteTable[worstSite].name, xprofSites[worstSite].lastFrameTime / 1000.0f,
+			xprofMaxFrameTime / 1000.0f, xprofLastFrameRequests);
+	paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	
+	sprintf(messageBuffer, "Layers: %u culled, %.2f megapixels saved",
+			culledLayers, culledPixels / 1000000.0f);
+	paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	
+	if (hasTimerQueries)
+	{
+		sprintf(messageBuffer, "GPU: game %.2fms overlay %.2fms notification %.2fms cursor %.2fms",
+				layerGPUTime[LAYER_GAME], layerGPUTime[LAYER_OVERLAY],
+				layerGPUTime[LAYER_NOTIFICATION], layerGPUTime[LAYER_CURSOR]);
+		paint_message(messageBuffer, Y, 1.0f, 1.0f, 1.0f); Y += textYMax;
+	}
+}
+
+static void
+paint_frame_time_strip (float *history, unsigned int head, float originX, float originY,
+						float graphWidth, float graphHeight, float maxTime)
+{
+	int i;
+	
+	glBegin (GL_LINE_STRIP);
+	for (i = 0; i < FRAME_HISTORY_LENGTH; i++)
+	{
+		// Oldest sample on the left, newest on the right
+		float frameTime = history[(head + i) % FRAME_HISTORY_LENGTH];
+		
+		if (frameTime > maxTime)
+			frameTime = maxTime;
+		
+		glVertex2f (originX + i * graphWidth / (FRAME_HISTORY_LENGTH - 1),
+					originY + graphHeight - frameTime * graphHeight / maxTime);
+	}
+	glEnd ();
+}
+
+static void
+paint_frame_graph (void)
+{
+	int i;
+	float graphWidth = FRAME_HISTORY_LENGTH * 2;
+	float graphHeight = 200.0f;
+	float originX = 100.0f;
+	float originY = root_height - graphHeight - 100.0f;
+	
+	// Three refresh intervals fit in the graph; anything above gets clamped
+	float maxTime = refreshInterval * 3;
+	
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDisable(GL_TEXTURE_2D);
+	glEnable(GL_BLEND);
+	
+	glColor4f(0.0f, 0.0f, 0.0f, 0.6f);
+	glBegin (GL_QUADS);
+	glVertex2f (originX, originY);
+	glVertex2f (originX + graphWidth, originY);
+	glVertex2f (originX + graphWidth, originY + graphHeight);
+	glVertex2f (originX, originY + graphHeight);
+	glEnd ();
+	
+	// Threshold markers at one and two refresh intervals
+	glBegin (GL_LINES);
+	for (i = 1; i <= 2; i++)
+	{
+		float markerY = originY + graphHeight - refreshInterval * i * graphHeight / maxTime;
+		
+		if (i == 1)
+			glColor4f(0.0f, 1.0f, 0.0f, 0.8f);
+		else
+			glColor4f(1.0f, 0.0f, 0.0f, 0.8f);
+		
+		glVertex2f (originX, markerY);
+		glVertex2f (originX + graphWidth, markerY);
+	}
+	glEnd ();
+	
+	// Focused game's damage intervals under the compositor's frame times
+	glColor4f(1.0f, 1.0f, 0.0f, 1.0f);
+	paint_frame_time_strip(gameFrameTimeHistory, gameFrameTimeHistoryHead,
+						   originX, originY, graphWidth, graphHeight, maxTime);
+	
+	glColor4f(1.0f, 1.0f, 1.0f, 1.0f);
+	paint_frame_time_strip(frameTimeHistory, frameTimeHistoryHead,
+						   originX, originY, graphWidth, graphHeight, maxTime);
+	
+	// Per-layer GPU cost as stacked bars to the right of the graph
+	if (hasTimerQueries)
+	{
+		static const float layerColors[LAYER_COUNT][3] = {
+			{ 0.0f, 1.0f, 0.0f },
+			{ 1.0f, 0.0f, 1.0f },
+			{ 0.0f, 1.0f, 1.0f },
+			{ 1.0f, 1.0f, 1.0f },
+		};
+		float barX = originX + graphWidth + 10.0f;
+		float barY = originY + graphHeight;
+		
+		glBegin (GL_QUADS);
+		for (i = 0; i < LAYER_COUNT; i++)
+		{
+			float barHeight = layerGPUTime[i] * graphHeight / maxTime;
+			
+			if (barY - barHeight < originY)
+				barHeight = barY - originY;
+			
+			glColor4f(layerColors[i][0], layerColors[i][1], layerColors[i][2], 0.8f);
+			glVertex2f (barX, barY - barHeight);
+			glVertex2f (barX + 20.0f, barY - barHeight);
+			glVertex2f (barX + 20.0f, barY);
+			glVertex2f (barX, barY);
+			
+			barY -= barHeight;
+		}
+		glEnd ();
+	}
+}
+
+static void
+apply_presentation_mode (Display *dpy)
+{
+	unsigned int newMode = PRESENTATION_MODE_FIFO;
+	win *w = find_win(dpy, currentFocusWindow);
+	
+	if (gameFocused && w)
+	{
+		if (w->presentationMode != PRESENTATION_MODE_UNSET)
+			newMode = w->presentationMode;
+		else
+			newMode = rootPresentationMode;
+		
+		if (newMode >= PRESENTATION_MODE_COUNT)
+			newMode = PRESENTATION_MODE_FIFO;
+	}
+	
+	if (newMode == currentPresentationMode)
+		return;
+	
+	currentPresentationMode = newMode;
+	scheduledPaintTime = 0;
+	
+	if (!__pointer_to_glXSwapIntervalEXT)
+		return;
+	
+	if (newMode == PRESENTATION_MODE_IMMEDIATE)
+	{
+		// Late swaps tear instead of waiting for the next vblank if we can,
+		// otherwise don't sync at all
+		__pointer_to_glXSwapIntervalEXT(dpy, root, hasSwapControlTear ? -1 : 0);
+	}
+	else
+	{
+		__pointer_to_glXSwapIntervalEXT(dpy, root, 1);
+	}
+}
+
+static uint64_t
+get_next_vblank_time (Display *dpy, uint64_t now)
+{
+	uint64_t interval = refreshInterval * 1000.0f;
+	
+	// With Present, vblank timestamps come in asynchronously after each swap
+	if (!hasPresent && __pointer_to_glXGetSyncValuesOML)
+	{
+		int64_t ust, msc, sbc;
+		Bool result;
+		
+		// UST is CLOCK_MONOTONIC in microseconds on the drivers we care about
+		XPROF(XPROF_VBLANK_SYNC_VALUES, result = __pointer_to_glXGetSyncValuesOML(dpy, root, &ust, &msc, &sbc));
+		if (result && ust)
+			lastVblankTime = ust;
+	}
+	
+	if (!lastVblankTime || !interval)
+		return now;
+	
+	if (lastVblankTime > now)
+		return lastVblankTime;
+	
+	return lastVblankTime + ((now - lastVblankTime) / interval + 1) * interval;
+}
+
+static void
+request_present_feedback (win *w, uint32_t swapSerial)
+{
+	if (!w || !w->cold->presentPending)
+		return;
+	
+	w->cold->feedbackSwapSerial = swapSerial;
+	w->cold->feedbackClientSerial = w->cold->presentSerial;
+	w->cold->presentPending = False;
+}
+
+/* Clients presenting to redirected windows only learn when their pixmap
+ * got copied, not when it reached the screen. Once a swap of ours is out,
+ * tell them in STEAM_PRESENT_FEEDBACK on their window:
+ *   client present serial, MSC low, MSC high, UST low, UST high
+ */
+static void
+handle_present_complete (Display *dpy, XPresentCompleteNotifyEvent *pe)
+{
+	win *w;
+	
+	if (pe->window == root)
+	{
+		lastVblankTime = pe->ust;
+		lastVblankMsc = pe->msc;
+		
+		if (pe->kind != PresentCompleteKindNotifyMSC || pe->serial_number != presentSwapSerial)
+			return;
+		
+		if (lastSwapSubmitTime && pe->ust > lastSwapSubmitTime)
+			swapToScanoutLatency = (pe->ust - lastSwapSubmitTime) / 1000.0f;
+		
+		for (w = list; w; w = w->next)
+		{
+			if (w->cold->feedbackSwapSerial != pe->serial_number)
+				continue;
+			
+			long feedback[5];
+			
+			feedback[0] = w->cold->feedbackClientSerial;
+			feedback[1] = pe->msc & 0xFFFFFFFF;
+			feedback[2] = pe->msc >> 32;
+			feedback[3] = pe->ust & 0xFFFFFFFF;
+			feedback[4] = pe->ust >> 32;
+			
+			set_ignore (dpy, NextRequest (dpy));
+			XChangeProperty(dpy, w->id, presentFeedbackAtom, XA_CARDINAL, 32, PropModeReplace,
+							(unsigned char *)feedback, 5);
+			
+			w->cold->feedbackSwapSerial = 0;
+		}
+		
+		return;
+	}
+	
+	// Only top-level windows are selected; events still queued for one
+	// that's been destroyed are dropped without querying the tree
+	w = lookup_win(pe->window);
+	
+	if (!w || pe->kind != PresentCompleteKindPixmap)
+		return;
+	
+	w->cold->presentSerial = pe->serial_number;
+	w->cold->presentPending = True;
+	w->cold->clientPresentCount++;
+}
+
+/* Publish pacing statistics of the focused game on the root window as an
+ * array of CARDINALs:
+ *   game ID, window, frame rate in mFPS, interval std deviation in usec,
+ *   client frames, dropped frames, duplicated frames
+ * Updated at most once per FRAME_STATS_UPDATE_PERIOD, or on focus change.
+ */
+static void
+update_frame_stats_prop (Display *dpy)
+{
+	unsigned int currentTime = get_time_in_milliseconds();
+	win *w = find_win(dpy, currentFocusWindow);
+	
+	if (!gameFocused || !w)
+	{
+		if (frameStatsWindow != None)
+		{
+			XDeleteProperty(dpy, root, frameStatsAtom);
+			frameStatsWindow = None;
+		}
+		return;
+	}
+	
+	if (frameStatsWindow == w->id &&
+		currentTime - lastFrameStatsUpdateTime < FRAME_STATS_UPDATE_PERIOD)
+		return;
+	
+	long stats[7];
+	
+	stats[0] = w->gameID;
+	stats[1] = w->id;
+	stats[2] = w->frameIntervalAverage ? 1000000.0f / w->frameIntervalAverage : 0;
+	stats[3] = sqrtf(w->cold->frameIntervalVariance) * 1000.0f;
+	stats[4] = w->cold->clientFrameCount;
+	stats[5] = w->cold->droppedFrames;
+	stats[6] = w->cold->duplicatedFrames;
+	
+	XChangeProperty(dpy, root, frameStatsAtom, XA_CARDINAL, 32, PropModeReplace,
+					(unsigned char *)stats, 7);
+	
+	frameStatsWindow = w->id;
+	lastFrameStatsUpdateTime = currentTime;
+}
+
+static Bool
+texture_evictable (win *w)
+{
+	int i;
+	
+	if (!w->pixmap || w->id == currentFocusWindow || w->id == fadeOutWindow.id)
+		return False;
+	
+	for (i = 0; i < PREWARM_MAX; i++)
+	{
+		if (w->id == prewarmWindows[i])
+			return False;
+	}
+	
+	// Overlays being shown are only painted when damaged or over new frames
+	if (gamesRunningCount && w->opacity &&
+		(w->id == currentOverlayWindow || w->id == currentNotificationWindow))
+		return False;
+	
+	return True;
+}
+
+/* Release textures of windows that haven't been shown for a while, like the
+ * transparent overlay or Steam hidden behind a game, and of the least
+ * recently shown ones when over the budget.
+ */
+static void
+manage_texture_residency (Display *dpy)
+{
+	unsigned int currentTime = get_time_in_milliseconds();
+	win *w;
+	
+	residentTextureMemory = fadeOutWindowGone ? fadeOutWindow.textureSize : 0;
+	
+	for (w = list; w; w = w->next)
+	{
+		if (texture_evictable(w) && currentTime - w->lastPaintTime > TEXTURE_EVICTION_TIMEOUT)
+			evict_win_resources(dpy, w);
+		
+		residentTextureMemory += w->textureSize;
+	}
+	
+	while (textureBudget && residentTextureMemory > textureBudget)
+	{
+		win *oldest = NULL;
+		
+		for (w = list; w; w = w->next)
+		{
+			if (texture_evictable(w) && (!oldest || w->lastPaintTime < oldest->lastPaintTime))
+				oldest = w;
+		}
+		
+		// Everything left is on screen
+		if (!oldest)
+			break;
+		
+		residentTextureMemory -= oldest->textureSize;
+		evict_win_resources(dpy, oldest);
+	}
+}
+
+/* Pick the windows most likely to be shown next: the overlay while games
+ * run, Steam while a game is focused, and the newest game while Steam is.
+ */
+static void
+update_prewarm_windows (void)
+{
+	unsigned long maxMapSequence = 0;
+	win *w;
+	
+	memset(prewarmWindows, 0, sizeof(prewarmWindows));
+	
+	if (gamesRunningCount)
+		prewarmWindows[0] = currentOverlayWindow;
+	
+	for (w = list; w; w = w->next)
+	{
+		if (w->a.map_state != IsViewable || w->id == currentFocusWindow)
+			continue;
+		
+		if (gameFocused && w->isSteam && prewarmWindows[1] == None)
+			prewarmWindows[1] = w->id;
+		
+		if (!gameFocused && w->gameID && w->map_sequence >= maxMapSequence)
+		{
+			prewarmWindows[2] = w->id;
+			maxMapSequence = w->map_sequence;
+		}
+	}
+}
+
+/* Binds at most one likely-next window; only called with nothing else to
+ * do, so the work lands between frames rather than in the switch.
+ */
+static void
+prewarm_likely_windows (Display *dpy)
+{
+	int i;
+	
+	update_prewarm_windows();
+	
+	for (i = 0; i < PREWARM_MAX; i++)
+	{
+		win *w = find_win(dpy, prewarmWindows[i]);
+		
+		if (!w || w->id != prewarmWindows[i] || w->pixmap || w->a.map_state != IsViewable)
+			continue;
+		
+		ensure_win_resources(dpy, w);
+		prewarmCount++;
+		return;
+	}
+}
+
+static void
+begin_switch_timing (win *w)
+{
+	if (!w)
+		return;
+	
+	switchStartTime = get_time_in_microseconds();
+	switchWindow = w->id;
+	switchWindowPainted = False;
+	switchWasWarm = w->pixmap != None;
+}
+
+/* Where the damage on a window ended up on screen, with a pixel of margin
+ * for filtering.
+ */
+static XRectangle
+damage_box_on_screen (win *w, win_geometry *geometry)
+{
+	float scaleX = (float)geometry->width / w->a.width;
+	float scaleY = (float)geometry->height / w->a.height;
+	int x1 = geometry->originX + floorf(w->damageBoxX1 * scaleX) - 1;
+	int y1 = geometry->originY + floorf(w->damageBoxY1 * scaleY) - 1;
+	int x2 = geometry->originX + ceilf(w->damageBoxX2 * scaleX) + 1;
+	int y2 = geometry->originY + ceilf(w->damageBoxY2 * scaleY) + 1;
+	XRectangle rect = { 0, 0, 0, 0 };
+	
+	if (x1 < 0)
+		x1 = 0;
+	if (y1 < 0)
+		y1 = 0;
+	if (x2 > root_width)
+		x2 = root_width;
+	if (y2 > root_height)
+		y2 = root_height;
+	
+	if (x2 > x1 && y2 > y1)
+	{
+		rect.x = x1;
+		rect.y = y1;
+		rect.width = x2 - x1;
+		rect.height = y2 - y1;
+	}
+	
+	return rect;
+}
+
+/* XRender backend: work out what needs repainting this frame into
+ * allDamage, and keep drawing to it. That's everything if any layer moved,
+ * appeared or changed opacity; otherwise what the windows damaged, plus
+ * where the cursor was and is.
+ */
+static void
+begin_render_frame (Display *dpy, win *layers[3], Bool fading, Bool drawCursor)
+{
+	render_frame_state state;
+	XRectangle rects[5];
+	unsigned long area = 0;
+	int count = 0;
+	int i;
+	
+	memset(&state, 0, sizeof(state));
+	state.filter = scaleFilter;
+	
+	for (i = 0; i < 3; i++)
+	{
+		win_geometry geometry;
+		
+		if (!layers[i] || !get_win_geometry(dpy, layers[i], i == 2, &geometry))
+			continue;
+		
+		state.window[i] = layers[i]->id;
+		state.opacity[i] = layers[i]->opacity;
+		state.originX[i] = geometry.originX;
+		state.originY[i] = geometry.originY;
+		state.width[i] = geometry.width;
+		state.height[i] = geometry.height;
+		
+		if (layers[i]->damageBoxX2 > layers[i]->damageBoxX1 &&
+			layers[i]->damageBoxY2 > layers[i]->damageBoxY1)
+			rects[count++] = damage_box_on_screen(layers[i], &geometry);
+		
+		layers[i]->damageBoxX1 = layers[i]->damageBoxY1 = 0;
+		layers[i]->damageBoxX2 = layers[i]->damageBoxY2 = 0;
+	}
+	
+	XRectangle cursorRect = { 0, 0, 0, 0 };
+	
+	if (drawCursor)
+		cursorRect = fake_cursor_rect();
+	if (cursorRect.width)
+		rects[count++] = cursorRect;
+	if (lastRenderCursorRect.width)
+		rects[count++] = lastRenderCursorRect;
+	
+	lastRenderCursorRect = cursorRect;
+	
+	if (renderFullRepaint || fading || memcmp(&state, &lastRenderFrame, sizeof(state)))
+	{
+		rects[0] = (XRectangle){ 0, 0, root_width, root_height };
+		count = 1;
+	}
+	
+	lastRenderFrame = state;
+	renderFullRepaint = False;
+	
+	for (i = 0; i < count; i++)
+		area += rects[i].width * rects[i].height;
+	
+	renderRepaintFraction = (float)area / ((unsigned long)root_width * root_height);
+	if (renderRepaintFraction > 1.0f)
+		renderRepaintFraction = 1.0f;
+	
+	allDamage = XFixesCreateRegion(dpy, rects, count);
+	XFixesSetPictureClipRegion(dpy, rootBuffer, 0, 0, allDamage);
+}
+
+static void
+present_render_frame (Display *dpy)
+{
+	XFixesSetPictureClipRegion(dpy, rootPicture, 0, 0, allDamage);
+	XRenderComposite(dpy, PictOpSrc, rootBuffer, None, rootPicture, 0, 0, 0, 0, 0, 0,
+					 root_width, root_height);
+	
+	XFixesDestroyRegion(dpy, allDamage);
+	allDamage = None;
+	
+	XFlush(dpy);
+}
+
+static int
+build_paint_layers (win *w, win *overlay, win *notification, Bool fadingOut, paint_layer *layers)
+{
+	int count = 0;
+	
+	// The window being faded from goes under the focused one, both blended
+	if (fadingOut)
+		layers[count++] = (paint_layer){ &fadeOutWindow, True, False, LAYER_GAME, False };
+	
+	layers[count++] = (paint_layer){ w, fadingOut, False, LAYER_GAME, False };
+	
+	if (gamesRunningCount && overlay && overlay->opacity)
+		layers[count++] = (paint_layer){ overlay, True, False, LAYER_OVERLAY, False };
+	
+	if (gamesRunningCount && notification && notification->opacity)
+		layers[count++] = (paint_layer){ notification, True, True, LAYER_NOTIFICATION, False };
+	
+	return count;
+}
+
+/* Whether the backend has contents of the window to draw: read back
+ * pixels, a picture or a texture bound to its pixmap. Culling runs before
+ * resources are ensured, so a window only just mapped doesn't have them
+ * yet.
+ */
+static Bool
+win_has_contents (win *w)
+{
+	if (compositeBackend == BACKEND_CPU)
+		return w->cpuPixels != NULL;
+	else if (compositeBackend == BACKEND_RENDER)
+		return w->picture != None;
+	else
+		return w->texName && w->glxPixmap != None;
+}
+
+/* Adds what a layer paints opaque to region. Layers drawn without blending
+ * are opaque over their whole image; blended ones only at full opacity,
+ * their letterbox and, if they use their alpha, where they say they're
+ * opaque. Nothing counts before there's something to draw.
+ */
+static void
+add_opaque_layer (Region region, paint_layer *layer, win_geometry *geometry)
+{
+	win *w = layer->w;
+	XRectangle rect;
+	int i;
+	
+	if (!win_has_contents(w))
+		return;
+	
+	if (w->isOverlay && !w->validContents)
+		return;
+	
+	if (!layer->blend)
+	{
+		rect = (XRectangle){ geometry->originX, geometry->originY, geometry->width, geometry->height };
+		XUnionRectWithRegion(&rect, region, region);
+		return;
+	}
+	
+	if (w->opacity != OPAQUE)
+		return;
+	
+	// Zoomed in, the image runs off screen and there's no letterbox
+	if (geometry->isScaling && !layer->notification &&
+		geometry->drawXOffset >= 0 && geometry->drawYOffset >= 0)
+	{
+		int drawXOffset = geometry->drawXOffset, drawYOffset = geometry->drawYOffset;
+		XRectangle stripes[4] = {
+			{ 0, 0, root_width, drawYOffset },
+			{ 0, root_height - drawYOffset, root_width, drawYOffset },
+			{ 0, drawYOffset, drawXOffset, root_height - 2 * drawYOffset },
+			{ root_width - drawXOffset, drawYOffset, drawXOffset, root_height - 2 * drawYOffset },
+		};
+		
+		for (i = 0; i < 4; i++)
+		{
+			if (stripes[i].width && stripes[i].height)
+				XUnionRectWithRegion(&stripes[i], region, region);
+		}
+	}
+	
+	if (!w->isOverlay)
+	{
+		rect = (XRectangle){ geometry->originX, geometry->originY, geometry->width, geometry->height };
+		XUnionRectWithRegion(&rect, region, region);
+		return;
+	}
+	
+	if (!w->cold || !w->a.width || !w->a.height)
+		return;
+	
+	float scaleX = (float)geometry->width / w->a.width;
+	float scaleY = (float)geometry->height / w->a.height;
+	
+	for (i = 0; i < w->cold->opaqueRectCount; i++)
+	{
+		XRectangle *opaque = &w->cold->opaqueRects[i];
+		
+		// Rounded inwards, partly covered pixels aren't opaque
+		int x1 = ceilf(geometry->originX + opaque->x * scaleX);
+		int y1 = ceilf(geometry->originY + opaque->y * scaleY);
+		int x2 = floorf(geometry->originX + (opaque->x + opaque->width) * scaleX);
+		int y2 = floorf(geometry->originY + (opaque->y + opaque->height) * scaleY);
+		
+		if (x2 <= x1 || y2 <= y1)
+			continue;
+		
+		rect = (XRectangle){ x1, y1, x2 - x1, y2 - y1 };
+		XUnionRectWithRegion(&rect, region, region);
+	}
+}
+
+/* Goes through the layers top to bottom, culling those entirely under
+ * opaque ones above. Returns True if the screen is covered without a
+ * clear.
+ */
+static Bool
+cull_paint_layers (Display *dpy, paint_layer *layers, int count)
+{
+	Region opaque = XCreateRegion();
+	Bool screenCovered;
+	int i;
+	
+	culledLayers = 0;
+	culledPixels = 0;
+	
+	for (i = count - 1; i >= 0; i--)
+	{
+		paint_layer *layer = &layers[i];
+		win_geometry geometry;
+		XRectangle extents;
+		
+		if (!get_win_geometry(dpy, layer->w, layer->notification, &geometry))
+			continue;
+		
+		// Blended letterboxes are drawn, otherwise they're left to the clear
+		if (geometry.isScaling && layer->blend && !layer->notification)
+			extents = (XRectangle){ 0, 0, root_width, root_height };
+		else
+			extents = (XRectangle){ geometry.originX, geometry.originY, geometry.width, geometry.height };
+		
+		if (XRectInRegion(opaque, extents.x, extents.y, extents.width, extents.height) == RectangleIn)
+		{
+			layer->culled = True;
+			culledLayers++;
+			culledPixels += (unsigned long)extents.width * extents.height;
+			TRACE_INSTANT("layer culled", layer->w->id);
+			continue;
+		}
+		
+		add_opaque_layer(opaque, layer, &geometry);
+	}
+	
+	screenCovered = XRectInRegion(opaque, 0, 0, root_width, root_height) == RectangleIn;
+	XDestroyRegion(opaque);
+	
+	culledLayerCount += culledLayers;
+	
+	return screenCovered;
+}
+
+static void
+paint_hud (Display *dpy)
+{
+	if (drawDebugInfo)
+	{
+		// Glyphs are only set up once actually needed
+		if (!textRenderingInitialized)
+			init_text_rendering();
+		paint_debug_info(dpy);
+	}
+	
+	if (drawFrameGraph)
+		paint_frame_graph();
+}
+
+/* Only the software cursor changed since the last frame: take it off what
+ * was composited then and draw it again where it is now.
+ */
+static void
+paint_cursor_frame (Display *dpy, win *w)
+{
+	Bool drawCursor = !hideCursorForMovement && update_fake_cursor(dpy, w);
+	
+	cursorDamaged = False;
+	cursorOnlyFrames++;
+	
+	TRACE_BEGIN("cursor frame", 0);
+	
+	if (compositeBackend == BACKEND_CPU)
+	{
+		XRectangle rects[2];
+		int count = 0;
+		int i;
+		
+		if (cursorSaveUnderRect.width)
+			rects[count++] = cursorSaveUnderRect;
+		
+		restore_cursor_under();
+		
+		if (drawCursor)
+		{
+			save_cursor_under();
+			paint_fake_cursor(dpy, w);
+			
+			if (cursorSaveUnderRect.width)
+				rects[count++] = cursorSaveUnderRect;
+		}
+		
+		for (i = 0; i < count; i++)
+			XShmPutImage(dpy, root, cpuPresentGC, cpuBackBufferImage, rects[i].x, rects[i].y,
+						 rects[i].x, rects[i].y, rects[i].width, rects[i].height, False);
+		
+		XPROF(XPROF_CURSOR_FRAME_SYNC, XSync(dpy, False));
+	}
+	else
+	{
+		glViewport(0, 0, root_width, root_height);
+		glLoadIdentity();
+		glOrtho(0.0f, root_width, root_height, 0.0f, -1.0f, 1.0f);
+		glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		
+		copy_scene_to_back_buffer();
+		
+		if (drawCursor)
+			paint_fake_cursor(dpy, w);
+		
+		paint_hud(dpy);
+		
+		TRACE_BEGIN("swap", 0);
+		XPROF(XPROF_CURSOR_FRAME_SWAP_BUFFERS, glXSwapBuffers(dpy, root));
+		TRACE_END("swap");
+	}
+	
+	TRACE_END("cursor frame");
+}
+
+static void
+paint_all (Display *dpy)
+{
+	win	*w;
+	win	*overlay;
+	win	*notification;
+	win	*t = NULL;
+	
+	Bool canUnredirect = True;
+	Bool overlayDamaged = False;
+	
+	if (unredirectedWindow)
+		return;
+	
+	unsigned int currentTime = get_time_in_milliseconds();
+	Bool fadingOut = ((currentTime - fadeOutStartTime) < fadeOutDuration && fadeOutWindow.id != None);
+	
+	w = find_win(dpy, currentFocusWindow);
+	overlay = find_win(dpy, currentOverlayWindow);
+	notification = find_win(dpy, currentNotificationWindow);
+	
+	if (gamesRunningCount)
+	{
+		if (overlay && overlay->damaged)
+			overlayDamaged = True;
+		if (notification && notification->damaged)
+			overlayDamaged = True;
+	}
+	
+	if (!w)
+		return;
+	
+	// Don't pump new frames if no animation on the focus window, unless we're fading
+	if (!w->damaged && !overlayDamaged && !fadeOutWindow.id)
+	{
+		if (!cursorDamaged)
+			return;
+		
+		if (sceneValid && sceneWindow == w->id)
+		{
+			paint_cursor_frame(dpy, w);
+			return;
+		}
+	}
+	
+	Bool pacedFrame = False;
+	
+	if (framePacing && gameFocused && w->damaged && !overlayDamaged && !fadeOutWindow.id &&
+		currentPresentationMode != PRESENTATION_MODE_IMMEDIATE)
+	{
+		pacer_set_cadence(&gamePacer, w->frameIntervalAverage, refreshInterval);
+		
+		pacedFrame = pacer_active(&gamePacer);
+	}
+	
+	if (pacedFrame)
+	{
+		uint64_t now = get_time_in_microseconds();
+		
+		// Hold early frames until the vblank the pacer picked for them
+		if (!gamePacer.targetVblank)
+		{
+			uint64_t nextVblank = get_next_vblank_time(dpy, now + PACING_PAINT_MARGIN);
+			
+			scheduledPaintTime = pacer_schedule_frame(&gamePacer, nextVblank,
+													  refreshInterval * 1000.0f) - PACING_PAINT_MARGIN;
+		}
+		
+		if (now < scheduledPaintTime)
+			return;
+	}
+	// In mailbox mode, hold on to game damage until right before vblank so
+	// that only the newest frame gets composited
+	else if (currentPresentationMode == PRESENTATION_MODE_MAILBOX &&
+		!overlayDamaged && !fadeOutWindow.id)
+	{
+		uint64_t now = get_time_in_microseconds();
+		
+		if (!scheduledPaintTime)
+			scheduledPaintTime = get_next_vblank_time(dpy, now) - MAILBOX_PAINT_MARGIN;
+		
+		if (now < scheduledPaintTime)
+			return;
+	}
+	
+	scheduledPaintTime = 0;
+	
+	
+	frameCounter++;
+	
+	if (frameCounter == 5)
+	{
+		currentFrameRate = 5 * 1000.0f / (currentTime - lastSampledFrameTime);
+		lastSampledFrameTime = currentTime;
+		frameCounter = 0;
+	}
+	
+	w->damaged = 0;
+	cursorDamaged = False;
+	
+	uint64_t compositeStartTime = get_time_in_microseconds();
+	
+	TRACE_BEGIN("paint", currentFocusWindow);
+	
+	paint_layer layers[PAINT_LAYER_MAX];
+	int layerCount;
+	int i;
+	
+	if (fadingOut)
+	{
+		double newOpacity = ((currentTime - fadeOutStartTime) / (double)fadeOutDuration);
+		
+		// Linear crossfade, the old window in the background
+		fadeOutWindow.opacity = (1.0d - newOpacity) * OPAQUE;
+		w->opacity = newOpacity * OPAQUE;
+	}
+	
+	layerCount = build_paint_layers(w, overlay, notification, fadingOut, layers);
+	
+	Bool screenCovered = cull_paint_layers(dpy, layers, layerCount);
+	
+	for (i = 0; i < layerCount; i++)
+	{
+		// The faded out window is a snapshot that keeps what it had
+		if (layers[i].culled || layers[i].w == &fadeOutWindow)
+			continue;
+		
+		ensure_win_resources(dpy, layers[i].w);
+		sync_win_resources(dpy, layers[i].w);
+	}
+	
+	// Where the software cursor goes needs to be known before drawing
+	Bool drawCursor = focusedWindowNeedsScale && gameFocused && !hideCursorForMovement &&
+		!serverCursorWindow;
+	
+	if (drawCursor)
+		drawCursor = update_fake_cursor(dpy, w);
+	
+	// Keep a copy of the frame without the cursor if it's likely to move
+	// on its own
+	Bool useCursorPlane = focusedWindowNeedsScale && gameFocused && !serverCursorWindow;
+	
+	if (compositeBackend == BACKEND_CPU)
+	{
+		cursorSaveUnderRect.width = cursorSaveUnderRect.height = 0;
+		
+		// Otherwise the focused window and its letterbox cover everything
+		if (fadingOut || zoomScaleRatio != 1.0 || !w->cpuPixels || layers[0].culled)
+		{
+			if (screenCovered)
+				skippedClearCount++;
+			else
+				cpu_fill_rect(&cpuBackBuffer, 0, 0, root_width, root_height, 0xFF000000, 255);
+		}
+	}
+	else if (compositeBackend == BACKEND_RENDER)
+	{
+		win *renderLayers[3] = {
+			w,
+			gamesRunningCount && overlay && overlay->opacity ? overlay : NULL,
+			gamesRunningCount && notification && notification->opacity ? notification : NULL
+		};
+		
+		begin_render_frame(dpy, renderLayers, fadingOut || fadeOutWindow.id, drawCursor);
+		
+		// Partial repaints already only touch where the cursor was and is
+		useCursorPlane = False;
+		
+		if (fadingOut || zoomScaleRatio != 1.0 || !w->picture || layers[0].culled)
+		{
+			XRenderColor black = { 0, 0, 0, 0xFFFF };
+			
+			if (screenCovered)
+				skippedClearCount++;
+			else
+				XRenderFillRectangle(dpy, PictOpSrc, rootBuffer, &black, 0, 0, root_width, root_height);
+		}
+	}
+	else
+	{
+		if (useCursorPlane)
+			useCursorPlane = ensure_scene_framebuffer();
+		if (useCursorPlane)
+			__pointer_to_glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+		
+		glViewport(0, 0, root_width, root_height);
+		glLoadIdentity();
+		glOrtho(0.0f, root_width, root_height, 0.0f, -1.0f, 1.0f);
+		
+		if (screenCovered)
+		{
+			skippedClearCount++;
+		}
+		else
+		{
+			glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
+			glClear(GL_COLOR_BUFFER_BIT);
+		}
+		
+		glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
+	
+	collect_layer_timings();
+	
+	int timing = -1;
+	
+	for (i = 0; i < layerCount; i++)
+	{
+		paint_layer *layer = &layers[i];
+		
+		if (layer->culled)
+			continue;
+		
+		// One span per kind of layer, even with two windows fading
+		if (layer->timing != timing)
+		{
+			if (timing >= 0)
+				end_layer_timing(timing);
+			begin_layer_timing(layer->timing);
+			timing = layer->timing;
+		}
+		
+		paint_window(dpy, layer->w, layer->blend, layer->notification);
+		
+		if (layer->w != &fadeOutWindow)
+			record_win_presented(layer->w);
+		
+		// Anything but the focused window means we can't hand it the screen
+		if (layer->w != w)
+			canUnredirect = False;
+	}
+	
+	if (timing >= 0)
+		end_layer_timing(timing);
+	
+	if (focusedWindowNeedsScale)
+	{
+		canUnredirect = False;
+	}
+	
+	if (!fadingOut && fadeOutWindow.id)
+	{
+		if (fadeOutWindowGone)
+		{
+			// This is the only reference to these resources now.
+			teardown_win_resources(dpy, &fadeOutWindow);
+			fadeOutWindowGone = False;
+		}
+		TRACE_INSTANT("fade end", fadeOutWindow.id);
+		fadeOutWindow.id = None;
+		
+		// Finished fading out, mark previous window hidden
+		set_win_hidden(dpy, &fadeOutWindow, True);
+	}
+	
+	if (gamesRunningCount && overlay)
+		overlay->damaged = 0;
+	if (gamesRunningCount && notification)
+		notification->damaged = 0;
+	
+	if (useCursorPlane && compositeBackend == BACKEND_GL)
+		copy_scene_to_back_buffer();
+	
+	sceneValid = useCursorPlane;
+	sceneWindow = w->id;
+	
+	// Draw SW cursor if we need to
+	if (w && focusedWindowNeedsScale && gameFocused)
+	{
+		if (drawCursor)
+		{
+			if (compositeBackend == BACKEND_CPU)
+				save_cursor_under();
+			
+			begin_layer_timing(LAYER_CURSOR);
+			paint_fake_cursor(dpy, w);
+			end_layer_timing(LAYER_CURSOR);
+		}
+		canUnredirect = False;
+	}
+	
+	compositeTime = (get_time_in_microseconds() - compositeStartTime) / 1000.0f;
+	if (compositeTime > maxCompositeTime)
+		maxCompositeTime = compositeTime;
+	
+	TRACE_BEGIN("present", 0);
+	
+	if (compositeBackend == BACKEND_CPU)
+	{
+		XShmPutImage(dpy, root, cpuPresentGC, cpuBackBufferImage, 0, 0, 0, 0,
+					 root_width, root_height, False);
+		
+		// The next frame is drawn into the same buffer, so the server must
+		// be done reading it by then
+		XPROF(XPROF_PAINT_SYNC, XSync(dpy, False));
+	}
+	else if (compositeBackend == BACKEND_RENDER)
+	{
+		present_render_frame(dpy);
+	}
+	else
+	{
+		paint_hud(dpy);
+		
+		TRACE_BEGIN("swap", 0);
+		XPROF(XPROF_PAINT_SWAP_BUFFERS, glXSwapBuffers(dpy, root));
+		TRACE_END("swap");
+	}
+	
+	TRACE_END("present");
+	
+	uint64_t frameTime = get_time_in_microseconds();
+	
+	if (lastFrameTime)
+		push_frame_time(frameTimeHistory, &frameTimeHistoryHead, (frameTime - lastFrameTime) / 1000.0f);
+	lastFrameTime = frameTime;
+	
+	if (startupTime)
+	{
+		mark_startup_phase("first frame");
+		report_startup();
+	}
+	
+	if (switchWindowPainted)
+	{
+		lastSwitchLatency = (frameTime - switchStartTime) / 1000.0f;
+		if (lastSwitchLatency > maxSwitchLatency)
+			maxSwitchLatency = lastSwitchLatency;
+		
+		switchCount++;
+		if (switchWasWarm)
+			switchWarmCount++;
+		
+		switchStartTime = 0;
+		switchWindowPainted = False;
+	}
+	
+	if (hasPresent)
+	{
+		// Everything shown for the first time in this frame gets its
+		// feedback once we know when it hit the screen
+		request_present_feedback(w, presentSwapSerial + 1);
+		if (gamesRunningCount && overlay && overlay->opacity)
+			request_present_feedback(overlay, presentSwapSerial + 1);
+		if (gamesRunningCount && notification && notification->opacity)
+			request_present_feedback(notification, presentSwapSerial + 1);
+		
+		// Ask for the timestamp of the vblank this swap goes out on
+		lastSwapSubmitTime = frameTime;
+		XPresentNotifyMSC(dpy, root, ++presentSwapSerial, 0, 1, 0);
+	}
+	else if (!__pointer_to_glXGetSyncValuesOML && currentPresentationMode != PRESENTATION_MODE_IMMEDIATE)
+	{
+		// Without sync control, a vsynced swap returning is our best guess at
+		// where vblank is
+		lastVblankTime = frameTime;
+	}
+	
+	pacer_frame_presented(&gamePacer, pacedFrame);
+	
+	update_frame_stats_prop(dpy);
+	
+	manage_texture_residency(dpy);
+	
+	if (compositeBackend == BACKEND_GL && glGetError() != GL_NO_ERROR)
+	{
+		fprintf (stderr, "GL error!\n");
+		exit (1);
+	}
+	
+	TRACE_END("paint");
+	
+	// Enable when hitching and blinking issues are resolved
+	if (allowUnredirection && canUnredirect)
+	{
+		unredirectedWindow = currentFocusWindow;
+		sceneValid = False;
+		teardown_win_resources(dpy, w);
+		XCompositeUnredirectWindow(dpy, unredirectedWindow, CompositeRedirectManual);
+		TRACE_INSTANT("unredirect", unredirectedWindow);
+	}
+}
+
+/* Server cursor mode. The X server draws the cursor where the pointer
+ * really is, in the game's own coordinates, so this only works when a game
+ * is letterboxed but not resized: the cursor then belongs a fixed distance
+ * away, which is folded into the hotspot of a copy of the game's cursor,
+ * resized to match Steam's.
+ */
+static Bool
+server_cursor_usable (win *w)
+{
+	if (!serverCursor || !w || !gameFocused || !focusedWindowNeedsScale)
+		return False;
+	
+	return cursorScaleRatio * globalScaleRatio == 1.0f && zoomScaleRatio == 1.0f;
+}
+
+/* Builds a cursor from serverCursorSource, scaled and with its image moved
+ * by offsetX, offsetY from the pointer. Returns None if the server can't
+ * show one that big.
+ */
+static Cursor
+create_server_cursor (Display *dpy, float scale, int offsetX, int offsetY)
+{
+	int scaledWidth = ceilf(serverCursorSourceWidth * scale);
+	int scaledHeight = ceilf(serverCursorSourceHeight * scale);
+	
+	// Where the image goes relative to the hotspot; the cursor has to
+	// cover both
+	int imageX = offsetX - (int)roundf(serverCursorSourceHotX * scale);
+	int imageY = offsetY - (int)roundf(serverCursorSourceHotY * scale);
+	int left = imageX < 0 ? imageX : 0;
+	int top = imageY < 0 ? imageY : 0;
+	int right = imageX + scaledWidth > 1 ? imageX + scaledWidth : 1;
+	int bottom = imageY + scaledHeight > 1 ? imageY + scaledHeight : 1;
+	
+	Pixmap pixmap;
+	Picture source, picture;
+	XImage *image;
+	Cursor cursor;
+	GC gc;
+	
+	if (!maxCursorWidth)
+	{
+		XPROF(XPROF_SERVER_CURSOR_BEST_SIZE,
+			  XQueryBestCursor(dpy, root, 0xFFFF, 0xFFFF, &maxCursorWidth, &maxCursorHeight));
+	}
+	
+	if (right - left > maxCursorWidth || bottom - top > maxCursorHeight)
+		return None;
+	
+	image = XCreateImage(dpy, NULL, 32, ZPixmap, 0, (char *)serverCursorSource,
+						 serverCursorSourceWidth, serverCursorSourceHeight, 32,
+						 serverCursorSourceWidth * sizeof(unsigned int));
+	if (!image)
+		return None;
+	
+	pixmap = XCreatePixmap(dpy, root, serverCursorSourceWidth, serverCursorSourceHeight, 32);
+	gc = XCreateGC(dpy, pixmap, 0, NULL);
+	XPutImage(dpy, pixmap, gc, image, 0, 0, 0, 0, serverCursorSourceWidth, serverCursorSourceHeight);
+	XFreeGC(dpy, gc);
+	XFree(image);
+	
+	source = XRenderCreatePicture(dpy, pixmap, XRenderFindStandardFormat(dpy, PictStandardARGB32), 0, NULL);
+	XFreePixmap(dpy, pixmap);
+	
+	XTransform transform = {{
+		{ XDoubleToFixed(1.0 / scale), 0, 0 },
+		{ 0, XDoubleToFixed(1.0 / scale), 0 },
+		{ 0, 0, XDoubleToFixed(1.0) }
+	}};
+	
+	XRenderSetPictureTransform(dpy, source, &transform);
+	XRenderSetPictureFilter(dpy, source, FilterBilinear, NULL, 0);
+	
+	// New pixmaps start out with garbage in them
+	pixmap = XCreatePixmap(dpy, root, right - left, bottom - top, 32);
+	picture = XRenderCreatePicture(dpy, pixmap, XRenderFindStandardFormat(dpy, PictStandardARGB32), 0, NULL);
+	XFreePixmap(dpy, pixmap);
+	
+	XRenderColor transparent = { 0, 0, 0, 0 };
+	
+	XRenderFillRectangle(dpy, PictOpSrc, picture, &transparent, 0, 0, right - left, bottom - top);
+	XRenderComposite(dpy, PictOpSrc, source, None, picture, 0, 0, 0, 0,
+					 imageX - left, imageY - top, scaledWidth, scaledHeight);
+	
+	cursor = XRenderCreateCursor(dpy, picture, -left, -top);
+	
+	XRenderFreePicture(dpy, source);
+	XRenderFreePicture(dpy, picture);
+	
+	return cursor;
+}
+
+/* Puts back an unscaled copy of the game's cursor and goes back to
+ * compositing it.
+ */
+static void
+stop_server_cursor (Display *dpy)
+{
+	if (!serverCursorWindow)
+		return;
+	
+	if (serverCursorSource)
+	{
+		Cursor cursor = create_server_cursor(dpy, 1.0f, 0, 0);
+		
+		if (cursor)
+		{
+			// The window may be gone already
+			set_ignore (dpy, NextRequest (dpy));
+			XDefineCursor(dpy, serverCursorWindow, cursor);
+			XFreeCursor(dpy, cursor);
+		}
+	}
+	
+	if (serverCursorImage)
+	{
+		XFreeCursor(dpy, serverCursorImage);
+		serverCursorImage = None;
+	}
+	
+	serverCursorWindow = None;
+	cursorImageDirty = True;
+}
+
+/* Picks up the game's current cursor, unless the one shown is already
+ * ours, and defines the scaled version on its window. Falls back to the
+ * composited cursor if that doesn't work out.
+ */
+static Bool
+update_server_cursor (Display *dpy)
+{
+	win *w = find_win(dpy, serverCursorWindow);
+	XFixesCursorImage *im;
+	Cursor cursor;
+	
+	if (!w)
+		return False;
+	
+	XPROF(XPROF_SERVER_CURSOR_IMAGE, im = XFixesGetCursorImage(dpy));
+	
+	if (im && im->atom != scaledCursorAtom)
+	{
+		free(serverCursorSource);
+		serverCursorSource = malloc(im->width * im->height * sizeof(unsigned int));
+		
+		for (int i = 0; serverCursorSource && i < im->width * im->height; i++)
+			serverCursorSource[i] = im->pixels[i];
+		
+		serverCursorSourceWidth = im->width;
+		serverCursorSourceHeight = im->height;
+		serverCursorSourceHotX = im->xhot;
+		serverCursorSourceHotY = im->yhot;
+	}
+	
+	if (im)
+		XFree(im);
+	
+	if (!serverCursorSource)
+	{
+		stop_server_cursor(dpy);
+		return False;
+	}
+	
+	cursor = create_server_cursor(dpy, get_cursor_display_scale(dpy),
+								  cursorOffsetX - w->a.x, cursorOffsetY - w->a.y);
+	if (!cursor)
+	{
+		stop_server_cursor(dpy);
+		return False;
+	}
+	
+	// Lets us tell our own cursor apart when the server reports it shown
+	XFixesSetCursorName(dpy, cursor, SCALED_CURSOR_NAME);
+	XDefineCursor(dpy, w->id, cursor);
+	
+	if (serverCursorImage)
+		XFreeCursor(dpy, serverCursorImage);
+	serverCursorImage = cursor;
+	
+	return True;
+}
+
+static Bool
+start_server_cursor (Display *dpy, win *w)
+{
+	if (!server_cursor_usable(w))
+	{
+		stop_server_cursor(dpy);
+		return False;
+	}
+	
+	if (serverCursorWindow != w->id)
+	{
+		stop_server_cursor(dpy);
+		serverCursorWindow = w->id;
+	}
+	
+	return update_server_cursor(dpy);
+}
+
+static void
+setup_pointer_barriers (Display *dpy)
+{
+	int i;
+	win		    *w = find_win (dpy, currentFocusWindow);
+	
+	// If we had barriers before, get rid of them.
+	for (i = 0; i < 4; i++)
+	{
+		if (scaledFocusBarriers[i] != None)
+		{
+			XFixesDestroyPointerBarrier(dpy, scaledFocusBarriers[i]);
+			scaledFocusBarriers[i] = None;
+		}
+	}
+	
+	if (focusedWindowNeedsScale == False && gameFocused)
+	{
+		stop_server_cursor(dpy);
+		hideCursorForScale = False;
+		apply_cursor_state(dpy);
+		return;
+	}
+	
+	// If we're scaling, take ownership of the cursor, unless the server
+	// can show it where it belongs
+	if (doRender)
+	{
+		hideCursorForScale = !start_server_cursor(dpy, w);
+		apply_cursor_state(dpy);
+	}
+	
+	if (!gameFocused)
+	{
+		return;
+	}
+	
+	// Constrain it to the window; careful, the corners will leak due to a known X server bug
+	scaledFocusBarriers[0] = XFixesCreatePointerBarrier(dpy, DefaultRootWindow(dpy), 0, w->a.y, root_width, w->a.y, 0, 0, NULL);
+	scaledFocusBarriers[1] = XFixesCreatePointerBarrier(dpy, DefaultRootWindow(dpy), w->a.x + w->a.width, 0, w->a.x + w->a.width, root_height, 0, 0, NULL);
+	scaledFocusBarriers[2] = XFixesCreatePointerBarrier(dpy, DefaultRootWindow(dpy), root_width, w->a.y + w->a.height, 0, w->a.y + w->a.height, 0, 0, NULL);
+	scaledFocusBarriers[3] = XFixesCreatePointerBarrier(dpy, DefaultRootWindow(dpy), w->a.x, root_height, w->a.x, 0, 0, 0, NULL);
+	
+	// Make sure the cursor is somewhere in our jail
+	Window window_returned, child;
+	int root_x, root_y;
+	int win_x, win_y;
+	unsigned int mask_return;
+	
+	XPROF(XPROF_BARRIERS_QUERY_POINTER,
+		  XQueryPointer(dpy, DefaultRootWindow(dpy), &window_returned,
+						&child, &root_x, &root_y, &win_x, &win_y,
+						&mask_return));
+	
+	if (root_x >= w->a.width || root_y >= w->a.height)
+	{
+		XWarpPointer(dpy, None, currentFocusWindow, 0, 0, 0, 0, w->a.width / 2, w->a.height / 2);
+	}
+}
+
+/* Makes room for count focus candidates; returns False if out of memory. */
+static Bool
+reserve_focus_candidates (int count)
+{
+	focus_candidate *candidates;
+	win **wins;
+	
+	if (count <= focusCandidateCapacity)
+		return True;
+	
+	count *= 2;
+	
+	candidates = realloc(focusCandidates, count * sizeof(focus_candidate));
+	if (!candidates)
+		return False;
+	focusCandidates = candidates;
+	
+	wins = realloc(focusCandidateWins, count * sizeof(win *));
+	if (!wins)
+		return False;
+	focusCandidateWins = wins;
+	
+	focusCandidateCapacity = count;
+	return True;
+}
+
+static void
+determine_and_apply_focus (Display *dpy)
+{
+	win *w, *focus = NULL;
+	win *steamWindow = NULL, *current = NULL, *damageLeader = NULL;
+	int candidateCount = 0, currentIndex = -1, focusIndex, index;
+	uint64_t now = get_time_in_milliseconds();
+	uint64_t nowUs = get_time_in_microseconds();
+	
+	gameFocused = False;
+	
+	unsigned long maxDamageSequence = 0;
+	
+	unsigned int maxOpacity = 0;
+	
+	if (unredirectedWindow != None)
+	{
+		XCompositeRedirectWindow(dpy, unredirectedWindow, CompositeRedirectManual);
+		TRACE_INSTANT("redirect", unredirectedWindow);
+		ensure_win_resources(dpy, find_win(dpy, unredirectedWindow));
+		unredirectedWindow = None;
+	}
+	
+	lastFocusScoreTime = now;
+	
+	for (w = list; w; w = w->next)
+	{
+		if (w->gameID && w->a.map_state == IsViewable && w->a.class == InputOutput)
+		{
+			candidateCount++;
+			
+			if (w->damage_sequence >= maxDamageSequence)
+			{
+				maxDamageSequence = w->damage_sequence;
+				damageLeader = w;
+			}
+		}
+	}
+	
+	if (!reserve_focus_candidates(candidateCount))
+		fprintf (stderr, "Out of memory scoring %d game windows\n", candidateCount);
+	candidateCount = 0;
+	
+	for (w = list; w; w = w->next)
+	{
+		if (w->isSteam)
+		{
+			steamWindow = w;
+		}
+		
+		if (w->gameID && w->a.map_state == IsViewable && w->a.class == InputOutput &&
+			candidateCount < focusCandidateCapacity)
+		{
+			focus_candidate *candidate = &focusCandidates[candidateCount];
+			
+			candidate->frameInterval = w->frameIntervalAverage;
+			candidate->lastDamageTime = w->lastDamageTime;
+			candidate->mapTime = w->mapTime;
+			candidate->area = ((float)w->a.width * w->a.height) / ((float)root_width * root_height);
+			candidate->damageSequence = w->damage_sequence;
+			candidate->overrideRedirect = w->a.override_redirect && !w->ignoreOverrideRedirect;
+			
+			if (w->id == currentFocusWindow)
+				currentIndex = candidateCount;
+			
+			focusCandidateWins[candidateCount++] = w;
+		}
+		
+		if (w->isOverlay)
+		{
+			if (w->a.width == 1920 && w->opacity >= maxOpacity)
+			{
+				currentOverlayWindow = w->id;
+				maxOpacity = w->opacity;
+			}
+			else
+			{
+				currentNotificationWindow = w->id;
+			}
+		}
+	}
+	
+	focusIndex = focus_pick(focusCandidates, candidateCount, currentIndex, nowUs, focusStartTime);
+	
+	for (index = 0; index < candidateCount; index++)
+		focusCandidateWins[index]->focusScore = focusCandidates[index].score;
+	
+	if (focusIndex >= 0)
+	{
+		gameFocused = True;
+		focus = focusCandidateWins[focusIndex];
+		current = currentIndex >= 0 ? focusCandidateWins[currentIndex] : NULL;
+		
+		// Picking the most recently damaged window would have switched here
+		if (focus == current && damageLeader && damageLeader != current &&
+			damageLeader->id != lastDamageLeader)
+		{
+			focusSwitchesAvoided++;
+			TRACE_INSTANT("focus switch avoided", damageLeader->id);
+		}
+	}
+	else
+	{
+		focus = steamWindow;
+	}
+	
+	lastDamageLeader = damageLeader ? damageLeader->id : None;
+	
+	if (!focus)
+	{
+		currentFocusWindow = None;
+		focusedWindowNeedsScale = False;
+		apply_presentation_mode(dpy);
+		return;
+	}
+	
+	if (fadeOutWindow.id == None && currentFocusWindow != focus->id)
+	{
+		// Initiate fade out if switching focus
+		w = find_win(dpy, currentFocusWindow);
+		
+		if (w)
+		{
+			ensure_win_resources(dpy, w);
+			snapshot_win(&fadeOutWindow, w);
+			fadeOutStartTime = get_time_in_milliseconds();
+			TRACE_INSTANT("fade start", w->id);
+		}
+	}
+	
+	if (fadeOutWindow.id && currentFocusWindow != focus->id)
+	{
+		set_win_hidden(dpy, find_win(dpy, currentFocusWindow), True);
+	}
+	
+	if (currentFocusWindow != focus->id)
+	{
+		memset(&gamePacer, 0, sizeof(gamePacer));
+		begin_switch_timing(focus);
+		focusStartTime = nowUs;
+		TRACE_INSTANT("focus switch", focus->id);
+	}
+	
+	currentFocusWindow = focus->id;
+	w = focus;
+	
+	set_win_hidden(dpy, w, False);
+	
+	if (w->a.width != root_width || w->a.height != root_height || globalScaleRatio != 1.0f)
+	{
+		float XRatio = (float)root_width / w->a.width;
+		float YRatio = (float)root_height / w->a.height;
+		
+		focusedWindowNeedsScale = True;
+		cursorScaleRatio = (XRatio < YRatio) ? XRatio : YRatio;
+		
+		cursorOffsetX = (root_width - w->a.width * cursorScaleRatio * globalScaleRatio) / 2.0f;
+		cursorOffsetY = (root_height - w->a.height * cursorScaleRatio * globalScaleRatio) / 2.0f;
+	}
+	else
+		focusedWindowNeedsScale = False;
+	
+	setup_pointer_barriers(dpy);
+	
+	apply_presentation_mode(dpy);
+	
+	if (gameFocused || !gamesRunningCount && list[0].id != focus->id)
+	{
+		XRaiseWindow(dpy, focus->id);
+	}
+	
+	XSetInputFocus(dpy, focus->id, RevertToNone, CurrentTime);
+	
+	if (!focus->cold->nudged)
+	{
+		XMoveWindow(dpy, focus->id, 1, 1);
+		focus->cold->nudged = True;
+	}
+	
+	if (w->a.x != 0 || w->a.y != 0)
+		XMoveWindow(dpy, focus->id, 0, 0);
+	
+	if (focus->isFullscreen && focusedWindowNeedsScale)
+	{
+		XResizeWindow(dpy, focus->id, root_width, root_height);
+	}
+	else if (!focus->isFullscreen && focus->cold->sizeHintsSpecified &&
+		(focus->a.width != focus->cold->requestedWidth ||
+		focus->a.height != focus->cold->requestedHeight))
+	{
+		XResizeWindow(dpy, focus->id, focus->cold->requestedWidth, focus->cold->requestedHeight);
+	}
+	
+	Window	    root_return = None, parent_return = None;
+	Window	    *children = NULL;
+	unsigned int    nchildren = 0;
+	unsigned int    i = 0;
+	
+	XPROF(XPROF_FOCUS_QUERY_TREE, XQueryTree (dpy, w->id, &root_return, &parent_return, &children, &nchildren));
+	
+	while (i < nchildren)
+	{
+		XSelectInput(dpy, children[i], PointerMotionMask);
+		i++;
+	}
+	
+	XFree (children);
+}
+
+/* Get prop from window
+ *   not found: default
+ *   otherwise the value
+ */
+static unsigned int
+get_prop(Display *dpy, Window win, Atom prop, unsigned int def)
+{
+	Atom actual;
+	int format;
+	unsigned long n, left;
+	
+	unsigned char *data;
+	int result;
+	
+	XPROF(XPROF_GET_PROP,
+		  result = XGetWindowProperty(dpy, win, prop, 0L, 1L, False,
+									  XA_CARDINAL, &actual, &format,
+									  &n, &left, &data));
+	if (result == Success && data != NULL)
+	{
+		unsigned int i;
+		memcpy (&i, data, sizeof (unsigned int));
+		XFree( (void *) data);
+		return i;
+	}
+	return def;
+}
+
+/* Only overlays are painted with their alpha channel, so only they need to
+ * tell us which parts are opaque for the layers under them to be skipped.
+ */
+static void
+get_opaque_region (Display *dpy, win *w)
+{
+	Atom actual;
+	int format;
+	unsigned long n, left;
+	
+	unsigned char *data = NULL;
+	int result;
+	
+	free(w->cold->opaqueRects);
+	w->cold->opaqueRects = NULL;
+	w->cold->opaqueRectCount = 0;
+	
+	if (!w->isOverlay)
+		return;
+	
+	XPROF(XPROF_OPAQUE_REGION,
+		  result = XGetWindowProperty(dpy, w->id, opaqueRegionAtom, 0L, OPAQUE_REGION_MAX_RECTS * 4,
+									  False, XA_CARDINAL, &actual, &format,
+									  &n, &left, &data));
+	
+	if (result != Success || !data)
+		return;
+	
+	// x, y, width, height for each rectangle; format 32 comes back as longs
+	if (format == 32 && n >= 4)
+	{
+		long *values = (long *)data;
+		int i;
+		
+		w->cold->opaqueRects = malloc((n / 4) * sizeof(XRectangle));
+		
+		for (i = 0; w->cold->opaqueRects && i < n / 4; i++)
+		{
+			w->cold->opaqueRects[i] = (XRectangle){ values[i * 4], values[i * 4 + 1],
+													values[i * 4 + 2], values[i * 4 + 3] };
+		}
+		
+		if (w->cold->opaqueRects)
+			w->cold->opaqueRectCount = n / 4;
+	}
+	
+	XFree(data);
+}
+
+static void
+get_size_hints(Display *dpy, win *w)
+{
+	XSizeHints hints;
+	long hintsSpecified;
+	
+	XPROF(XPROF_SIZE_HINTS, XGetWMNormalHints(dpy, w->id, &hints, &hintsSpecified));
+	
+	if (hintsSpecified & (PMaxSize | PMinSize) &&
+		hints.max_width * hints.max_height * hints.min_width * hints.min_height &&
+		hints.max_width == hints.min_width && hints.min_height == hints.max_height)
+	{
+		w->cold->requestedWidth = hints.max_width;
+		w->cold->requestedHeight = hints.max_height;
+		
+		w->cold->sizeHintsSpecified = True;
+	}
+	else
+	{
+		w->cold->sizeHintsSpecified = False;
+		
+		// Below block checks for a pattern that matches old SDL fullscreen applications;
+		// SDL creates a fullscreen overrride-redirect window and reparents the game
+		// window under it, centered. We get rid of the modeswitch and also want that
+		// black border gone.
+		if (w->a.override_redirect)
+		{
+			Window	    root_return = None, parent_return = None;
+			Window	    *children = NULL;
+			unsigned int    nchildren = 0;
+			
+			XPROF(XPROF_SIZE_HINTS_QUERY_TREE,
+				  XQueryTree (dpy, w->id, &root_return, &parent_return, &children, &nchildren));
+			
+			if (nchildren == 1)
+			{
+				XWindowAttributes attribs;
+				
+				XPROF(XPROF_SIZE_HINTS_GET_ATTRIBUTES, XGetWindowAttributes (dpy, children[0], &attribs));
+				
+				// If we have a unique children that isn't override-reidrect that is
+				// contained inside this fullscreen window, it's probably it.
+				if (attribs.override_redirect == False &&
+					attribs.width <= w->a.width &&
+					attribs.height <= w->a.height)
+				{
+					w->cold->sizeHintsSpecified = True;
+					
+					w->cold->requestedWidth = attribs.width;
+					w->cold->requestedHeight = attribs.height;
+					
+					XMoveWindow(dpy, children[0], 0, 0);
+					
+					w->ignoreOverrideRedirect = True;
+				}
+			}
+			
+			XFree (children);
+		}
+	}
+}
+
+/* Nothing reads the individual rectangles: GL only needs to know a window
+ * changed, the other backends repaint the bounding box of the damage.
+ */
+static int
+damage_report_level (void)
+{
+	if (compositeBackend == BACKEND_GL)
+		return XDamageReportNonEmpty;
+	
+	return XDamageReportBoundingBox;
+}
+
+// Atoms only ever use the low 29 bits
+#define			WIN_TYPE_UNKNOWN ((Atom)~0UL)
+
+static Atom
+get_win_type (Display *dpy, Window id)
+{
+	Atom actual;
+	int format;
+	unsigned long n, left;
+	unsigned char *data = NULL;
+	Atom type = None;
+	int result;
+	
+	set_ignore (dpy, NextRequest (dpy));
+	XPROF(XPROF_WIN_TYPE,
+		  result = XGetWindowProperty(dpy, id, winTypeAtom, 0L, 1L, False,
+									  XA_ATOM, &actual, &format, &n, &left, &data));
+	if (result == Success && data != NULL)
+	{
+		if (n)
+			type = *(Atom *)data;
+		XFree(data);
+	}
+	
+	return type;
+}
+
+/* Whether a window can't ever be the focus, overlay or notification: menus,
+ * tooltips and the like that don't carry any of our properties. The window
+ * type is only read the first time it's needed and when it changes.
+ */
+static Bool
+classify_win_passive (Display *dpy, win *w)
+{
+	Atom type;
+	
+	if (w->isSteam || w->gameID || w->isOverlay)
+		return False;
+	
+	if (w->cold->windowType == WIN_TYPE_UNKNOWN)
+		w->cold->windowType = get_win_type(dpy, w->id);
+	type = w->cold->windowType;
+	
+	return type == winMenuAtom || type == winDropdownMenuAtom || type == winPopupMenuAtom ||
+		type == winTooltipAtom || type == winNotificationAtom || type == winComboAtom ||
+		type == winDNDAtom || type == winDockAtom || type == winToolbarAtom ||
+		type == winUtilAtom || type == winDesktopAtom;
+}
+
+static void
+track_win (Display *dpy, win *w)
+{
+	if (w->a.class == InputOnly)
+		return;
+	
+	if (!w->damage)
+		w->damage = XDamageCreate (dpy, w->id, damage_report_level());
+	
+	if (compositeBackend == BACKEND_GL && !w->fbConfig)
+	{
+		w->fbConfig = win_fbconfig(dpy, w->cold->visualid);
+		if (w->fbConfig == None)
+		{
+			// XXX figure out why Thomas was Alone window doesn't work when using its
+			// visual but works with that fallback to the root window visual; is it
+			// because it has several samples?
+			w->fbConfig = win_fbconfig(dpy, XVisualIDFromVisual(DefaultVisual(dpy, scr)));
+		}
+	}
+	
+	if (compositeBackend == BACKEND_GL && !w->texName)
+		glGenTextures (1, &w->texName);
+}
+
+static void
+untrack_win (Display *dpy, win *w)
+{
+	teardown_win_resources(dpy, w);
+	
+	if (w->damage)
+	{
+		set_ignore (dpy, NextRequest (dpy));
+		XDamageDestroy (dpy, w->damage);
+		w->damage = None;
+	}
+	
+	if (w->texName)
+	{
+		glDeleteTextures (1, &w->texName);
+		w->texName = 0;
+	}
+	
+	w->fbConfig = None;
+}
+
+/* Gives the window full tracking or only bookkeeping depending on its type
+ * and properties. Called on map and when any of the properties involved
+ * change; a window gets no damage object or texture before its first map.
+ */
+static void
+update_win_class (Display *dpy, win *w)
+{
+	Bool wasPassive = w->passive;
+	
+	w->passive = classify_win_passive(dpy, w);
+	
+	if (w->passive)
+	{
+		if (!wasPassive)
+		{
+			untrack_win(dpy, w);
+			passiveWinCount++;
+		}
+		return;
+	}
+	
+	track_win(dpy, w);
+	
+	// Whatever it drew while passive went unreported
+	if (wasPassive && w->a.map_state == IsViewable && w->a.class != InputOnly)
+	{
+		w->validContents = True;
+		w->damaged = 1;
+	}
+}
+
+static void
+map_win (Display *dpy, Window id, unsigned long sequence)
+{
+	win		*w = find_win (dpy, id);
+	
+	if (!w)
+		return;
+	
+	w->a.map_state = IsViewable;
+	
+	/* This needs to be here or else we lose transparency messages */
+	XSelectInput (dpy, id, PropertyChangeMask | SubstructureNotifyMask |
+	PointerMotionMask | LeaveWindowMask);
+	
+	/* Present event selections aren't replaced when made again, so only
+	 * ever make one per window */
+	if (hasPresent && !w->cold->presentEventId)
+		w->cold->presentEventId = XPresentSelectInput (dpy, id, PresentCompleteNotifyMask);
+	
+	/* This needs to be here since we don't get PropertyNotify when unmapped */
+	w->opacity = get_prop (dpy, w->id, opacityAtom, TRANSLUCENT);
+	
+	w->isSteam = get_prop (dpy, w->id, steamAtom, 0);
+	w->gameID = get_prop (dpy, w->id, gameAtom, 0);
+	w->isOverlay = get_prop (dpy, w->id, overlayAtom, 0);
+	w->presentationMode = get_prop (dpy, w->id, presentationModeAtom, PRESENTATION_MODE_UNSET);
+	
+	update_win_class(dpy, w);
+	
+	get_size_hints(dpy, w);
+	get_opaque_region(dpy, w);
+	
+	w->damaged = 0;
+	w->damage_sequence = 0;
+	w->map_sequence = sequence;
+	w->mapTime = get_time_in_microseconds();
+	
+	reset_frame_stats(w);
+	
+	w->validContents = False;
+	
+	focusDirty = True;
+}
+
+static void
+finish_unmap_win (Display *dpy, win *w)
+{
+	w->damaged = 0;
+	w->validContents = False;
+	
+	if (w->pixmap && fadeOutWindow.id != w->id)
+	{
+		teardown_win_resources(dpy, w);
+	}
+	
+	if (fadeOutWindow.id == w->id)
+	{
+		fadeOutWindowGone = True;
+		
+		// The fade copy owns these now and tears them down when it's done
+		w->pixmap = None;
+		w->glxPixmap = None;
+		w->fence = None;
+		w->glFence = NULL;
+		w->textureSize = 0;
+		w->cpuPixels = NULL;
+		w->picture = None;
+	}
+	
+	/* don't care about properties anymore */
+	set_ignore (dpy, NextRequest (dpy));
+	XSelectInput(dpy, w->id, 0);
+	
+	clipChanged = True;
+}
+
+static void
+unmap_win (Display *dpy, Window id, Bool fade)
+{
+	win *w = find_win (dpy, id);
+	if (!w)
+		return;
+	w->a.map_state = IsUnmapped;
+	
+	focusDirty = True;
+	
+	finish_unmap_win (dpy, w);
+}
+
+static void
+add_win_with_attributes (Display *dpy, Window id, Window prev, unsigned long sequence,
+						 XWindowAttributes *attribs, VisualID visualid, Atom windowType)
+{
+	win				*new = alloc_win ();
+	win				*below;
+	
+	if (!new)
+		return;
+	// An unknown sibling puts the window at the bottom, like it always did
+	if (prev)
+		below = lookup_win(prev);
+	else
+		below = list;
+	new->id = id;
+	set_win_attributes(new, attribs);
+	new->damaged = 0;
+	new->validContents = False;
+	new->pixmap = None;
+	new->fence = None;
+	new->glFence = NULL;
+	new->fenceTriggered = False;
+	new->fenceDirty = False;
+	new->textureSize = 0;
+	new->lastPaintTime = 0;
+	new->evicted = False;
+	new->cpuPixels = NULL;
+	new->cpuWidth = 0;
+	new->cpuHeight = 0;
+	new->picture = None;
+	new->damageBoxX1 = new->damageBoxY1 = 0;
+	new->damageBoxX2 = new->damageBoxY2 = 0;
+	new->fbConfig = None;
+	new->texName = 0;
+	new->damage = None;
+	new->cold->visualid = visualid;
+	new->damage_sequence = 0;
+	reset_frame_stats(new);
+	new->map_sequence = 0;
+	new->mapTime = get_time_in_microseconds();
+	new->focusScore = 0.0f;
+	new->damageEvents = 0;
+	new->damageFlooded = False;
+	new->damageSubtractPending = False;
+	new->damageFloodTime = 0;
+	if (new->a.class != InputOnly)
+	{
+		// Make sure the Windows we present have background = None for seamless unredirection
+		if (allowUnredirection)
+			XSetWindowBackgroundPixmap (dpy, id, None);
+	}
+	new->opacity = TRANSLUCENT;
+	
+	new->isOverlay = False;
+	new->isSteam = False;
+	new->gameID = 0;
+	new->passive = False;
+	new->cold->windowType = windowType;
+	new->isFullscreen = False;
+	new->isHidden = False;
+	new->cold->sizeHintsSpecified = False;
+	new->cold->requestedWidth = 0;
+	new->cold->requestedHeight = 0;
+	new->cold->nudged = False;
+	new->ignoreOverrideRedirect = False;
+	new->presentationMode = PRESENTATION_MODE_UNSET;
+	new->cold->presentSerial = 0;
+	new->cold->presentPending = False;
+	new->cold->clientPresentCount = 0;
+	new->cold->feedbackSwapSerial = 0;
+	new->cold->feedbackClientSerial = 0;
+	
+	new->cold->mouseMoved = False;
+	
+	link_win_above(new, below);
+	hash_win(new);
+	if (new->a.map_state == IsViewable)
+		map_win (dpy, id, sequence);
+	
+	focusDirty = True;
+}
+
+static void
+add_win (Display *dpy, Window id, Window prev, unsigned long sequence)
+{
+	XWindowAttributes attribs;
+	Status status;
+	
+	set_ignore (dpy, NextRequest (dpy));
+	XPROF(XPROF_ADD_WIN_GET_ATTRIBUTES, status = XGetWindowAttributes (dpy, id, &attribs));
+	if (!status)
+		return;
+	
+	add_win_with_attributes(dpy, id, prev, sequence, &attribs,
+							XVisualIDFromVisual(attribs.visual), WIN_TYPE_UNKNOWN);
+}
+
+typedef struct _prefetched_win {
+	Window		id;
+	XWindowAttributes	a;
+	VisualID	visualid;
+	Atom		windowType;
+	Bool		valid;
+} prefetched_win;
+
+/* Gets attributes, geometry and the window type for the windows already
+ * there at startup in one go through XCB, costing a single round trip
+ * instead of three per window. Returns NULL if that's not possible;
+ * add_win() will query them itself.
+ */
+static prefetched_win *
+prefetch_windows (Display *dpy, Window *children, unsigned int nchildren)
+{
+	xcb_connection_t *xcb = XGetXCBConnection(dpy);
+	xcb_get_window_attributes_cookie_t *attribCookies;
+	xcb_get_geometry_cookie_t *geometryCookies;
+	xcb_get_property_cookie_t *typeCookies;
+	prefetched_win *windows;
+	unsigned int i;
+	
+	attribCookies = malloc(nchildren * sizeof(*attribCookies));
+	geometryCookies = malloc(nchildren * sizeof(*geometryCookies));
+	typeCookies = malloc(nchildren * sizeof(*typeCookies));
+	windows = calloc(nchildren, sizeof(*windows));
+	
+	if (!attribCookies || !geometryCookies || !typeCookies || !windows)
+	{
+		free(attribCookies);
+		free(geometryCookies);
+		free(typeCookies);
+		free(windows);
+		return NULL;
+	}
+	
+	for (i = 0; i < nchildren; i++)
+	{
+		attribCookies[i] = xcb_get_window_attributes(xcb, children[i]);
+		geometryCookies[i] = xcb_get_geometry(xcb, children[i]);
+		typeCookies[i] = xcb_get_property(xcb, 0, children[i], winTypeAtom, XCB_ATOM_ATOM, 0, 1);
+	}
+	
+	for (i = 0; i < nchildren; i++)
+	{
+		xcb_get_window_attributes_reply_t *attribReply;
+		xcb_get_geometry_reply_t *geometryReply;
+		xcb_get_property_reply_t *typeReply;
+		xcb_generic_error_t *attribError = NULL, *geometryError = NULL, *typeError = NULL;
+		XWindowAttributes *attribs = &windows[i].a;
+		
+		windows[i].id = children[i];
+		
+		// Windows destroyed in the meantime just come back with errors. The
+		// wait for the first reply is the round trip; the rest stream in
+		// right behind it.
+		if (i == 0)
+			XPROF(XPROF_PREFETCH_WINDOWS,
+				  attribReply = xcb_get_window_attributes_reply(xcb, attribCookies[i], &attribError));
+		else
+			attribReply = xcb_get_window_attributes_reply(xcb, attribCookies[i], &attribError);
+		geometryReply = xcb_get_geometry_reply(xcb, geometryCookies[i], &geometryError);
+		typeReply = xcb_get_property_reply(xcb, typeCookies[i], &typeError);
+		
+		windows[i].windowType = None;
+		if (typeReply && typeReply->type == XCB_ATOM_ATOM &&
+			xcb_get_property_value_length(typeReply) >= (int)sizeof(xcb_atom_t))
+			windows[i].windowType = *(xcb_atom_t *)xcb_get_property_value(typeReply);
+		
+		if (attribReply && geometryReply)
+		{
+			attribs->x = geometryReply->x;
+			attribs->y = geometryReply->y;
+			attribs->width = geometryReply->width;
+			attribs->height = geometryReply->height;
+			attribs->border_width = geometryReply->border_width;
+			attribs->depth = geometryReply->depth;
+			attribs->root = geometryReply->root;
+			attribs->class = attribReply->_class;
+			attribs->bit_gravity = attribReply->bit_gravity;
+			attribs->win_gravity = attribReply->win_gravity;
+			attribs->backing_store = attribReply->backing_store;
+			attribs->backing_planes = attribReply->backing_planes;
+			attribs->backing_pixel = attribReply->backing_pixel;
+			attribs->save_under = attribReply->save_under;
+			attribs->colormap = attribReply->colormap;
+			attribs->map_installed = attribReply->map_is_installed;
+			attribs->map_state = attribReply->map_state;
+			attribs->all_event_masks = attribReply->all_event_masks;
+			attribs->your_event_mask = attribReply->your_event_mask;
+			attribs->do_not_propagate_mask = attribReply->do_not_propagate_mask;
+			attribs->override_redirect = attribReply->override_redirect;
+			attribs->screen = ScreenOfDisplay(dpy, scr);
+			
+			windows[i].visualid = attribReply->visual;
+			windows[i].valid = True;
+		}
+		
+		free(attribReply);
+		free(geometryReply);
+		free(typeReply);
+		free(attribError);
+		free(geometryError);
+		free(typeError);
+	}
+	
+	free(attribCookies);
+	free(geometryCookies);
+	free(typeCookies);
+	
+	return windows;
+}
+
+static void
+add_prefetched_windows (Display *dpy, prefetched_win *windows, unsigned int count)
+{
+	Window prev = None;
+	unsigned int i;
+	
+	for (i = 0; i < count; i++)
+	{
+		if (!windows[i].valid)
+			continue;
+		
+		// Changes to the type of an unmapped window aren't reported, so it's
+		// only worth keeping for the ones mapped right away
+		add_win_with_attributes(dpy, windows[i].id, prev, 0, &windows[i].a, windows[i].visualid,
+								windows[i].a.map_state == IsViewable ?
+								windows[i].windowType : WIN_TYPE_UNKNOWN);
+		prev = windows[i].id;
+	}
+}
+
+static void
+restack_win (Display *dpy, win *w, Window new_above)
+{
+	if (restack_win_above(w, new_above))
+		focusDirty = True;
+}
+
+static void
+configure_win (Display *dpy, XConfigureEvent *ce)
+{
+	win		    *w = find_win (dpy, ce->window);
+	XserverRegion   damage = None;
+	
+	if (!w || w->id != ce->window)
+	{
+		if (ce->window == root)
+		{
+			root_width = ce->width;
+			root_height = ce->height;
+		}
+		return;
+	}
+	
+	w->a.x = ce->x;
+	w->a.y = ce->y;
+	if (w->a.width != ce->width || w->a.height != ce->height)
+	{
+		if (w->picture)
+		{
+			XRenderFreePicture (dpy, w->picture);
+			w->picture = None;
+		}
+		if (w->pixmap)
+		{
+			XFreePixmap (dpy, w->pixmap);
+			w->pixmap = None;
+		}
+	}
+	w->a.width = ce->width;
+	w->a.height = ce->height;
+	w->a.border_width = ce->border_width;
+	w->a.override_redirect = ce->override_redirect;
+	restack_win (dpy, w, ce->above);
+	
+	focusDirty = True;
+}
+
+static void
+circulate_win (Display *dpy, XCirculateEvent *ce)
+{
+	win	    *w = find_win (dpy, ce->window);
+	Window  new_above;
+	
+	if (!w || w->id != ce->window)
+		return;
+	
+	if (ce->place == PlaceOnTop)
+		new_above = list->id;
+	else
+		new_above = None;
+	restack_win (dpy, w, new_above);
+	clipChanged = True;
+}
+
+static void
+finish_destroy_win (Display *dpy, Window id, Bool gone)
+{
+	win	*w = lookup_win(id);
+	
+	if (!w)
+		return;
+	
+	if (gone)
+		finish_unmap_win (dpy, w);
+	unlink_win(w);
+	unhash_win(w);
+	if (w->damage != None)
+	{
+		set_ignore (dpy, NextRequest (dpy));
+		XDamageDestroy (dpy, w->damage);
+		w->damage = None;
+	}
+	/* The server drops the selection along with a destroyed window */
+	if (w->cold->presentEventId && !gone)
+	{
+		set_ignore (dpy, NextRequest (dpy));
+		XPresentFreeInput (dpy, w->id, w->cold->presentEventId);
+	}
+	free_win (w);
+}
+
+static void
+destroy_win (Display *dpy, Window id, Bool gone, Bool fade)
+{
+	if (currentFocusWindow == id && gone)
+		currentFocusWindow = None;
+	if (currentOverlayWindow == id && gone)
+		currentOverlayWindow = None;
+	if (currentNotificationWindow == id && gone)
+		currentNotificationWindow = None;
+	focusDirty = True;
+	
+	finish_destroy_win (dpy, id, gone);
+}
+
+static void
+add_damage_box (win *w, const XRectangle *area)
+{
+	// The CPU backend only reads back what changed, even from hidden
+	// overlays, and the XRender one only repaints it
+	if (compositeBackend == BACKEND_GL)
+		return;
+	
+	if (w->damageBoxX2 <= w->damageBoxX1 || w->damageBoxY2 <= w->damageBoxY1)
+	{
+		w->damageBoxX1 = area->x;
+		w->damageBoxY1 = area->y;
+		w->damageBoxX2 = area->x + area->width;
+		w->damageBoxY2 = area->y + area->height;
+	}
+	else
+	{
+		if (area->x < w->damageBoxX1)
+			w->damageBoxX1 = area->x;
+		if (area->y < w->damageBoxY1)
+			w->damageBoxY1 = area->y;
+		if (area->x + area->width > w->damageBoxX2)
+			w->damageBoxX2 = area->x + area->width;
+		if (area->y + area->height > w->damageBoxY2)
+			w->damageBoxY2 = area->y + area->height;
+	}
+}
+
+static void
+damage_win (Display *dpy, XDamageNotifyEvent *de)
+{
+	// Damage objects only exist on top-level windows; damage still queued
+	// for one that's been destroyed is dropped without querying the tree
+	win	*w = lookup_win (de->drawable);
+	win *focus = find_win(dpy, currentFocusWindow);
+	
+	if (!w)
+		return;
+	
+	w->validContents = True;
+	w->fenceDirty = True;
+	
+	add_damage_box(w, &de->area);
+	
+	w->damageEvents++;
+	damageEventCount++;
+	
+	if (!w->damageFlooded && w->damageEvents > DAMAGE_FLOOD_EVENTS)
+	{
+		w->damageFlooded = True;
+		w->damageFloodTime = get_time_in_milliseconds();
+		damageFloodCount++;
+	}
+	
+	// Until it's subtracted, the server won't report more damage
+	if (w->damageFlooded)
+		w->damageSubtractPending = True;
+	else if (w->damage)
+		XDamageSubtract(dpy, w->damage, None, None);
+	
+	if (w->isOverlay && !w->opacity)
+		return;
+	
+	// First damage event we get, compute focus; we only want to focus damaged
+	// windows to have meaningful frames.
+	if (w->gameID && w->damage_sequence == 0)
+		focusDirty = True;
+	
+	w->damage_sequence = damageSequence++;
+	
+	// Events can come in batches; only the last one of a batch counts
+	// as a new frame from the client.
+	if (!de->more)
+		record_client_frame(w);
+	
+	// Another game rendering might be eligible to take over; scores only move
+	// with sustained damage, so there's no point checking on every frame
+	if (focus && focus != w && w->gameID &&
+		get_time_in_milliseconds() - lastFocusScoreTime >= FOCUS_RESCORE_PERIOD)
+		focusDirty = True;
+	
+	w->damaged = 1;
+}
+
+/* Called once per pass of the main loop: lets flooding windows report
+ * damage again, and takes them out of flood mode once it's been long enough.
+ */
+static void
+flush_damage (Display *dpy)
+{
+	uint64_t now = get_time_in_milliseconds();
+	win *w;
+	
+	for (w = list; w; w = w->next)
+	{
+		if (w->damageSubtractPending)
+		{
+			if (w->damage)
+				XDamageSubtract(dpy, w->damage, None, None);
+			w->damageSubtractPending = False;
+		}
+		
+		if (w->damageFlooded && now - w->damageFloodTime >= DAMAGE_FLOOD_HOLD)
+			w->damageFlooded = False;
+		
+		w->damageEvents = 0;
+	}
+	
+	damageEventsPerPass = damageEventCount;
+	if (damageEventCount > maxDamageEventsPerPass)
+		maxDamageEventsPerPass = damageEventCount;
+	damageEventCount = 0;
+}
+
+static int
+error (Display *dpy, XErrorEvent *ev)
+{
+	int	    o;
+	const char    *name = NULL;
+	static char buffer[256];
+	
+	if (should_ignore (dpy, ev->serial))
+		return 0;
+	
+	if (ev->request_code == composite_opcode &&
+		ev->minor_code == X_CompositeRedirectSubwindows)
+	{
+		fprintf (stderr, "Another composite manager is already running\n");
+		exit (1);
+	}
+	
+	o = ev->error_code - xfixes_error;
+	switch (o) {
+		case BadRegion: name = "BadRegion";	break;
+		default: break;
+	}
+	o = ev->error_code - damage_error;
+	switch (o) {
+		case BadDamage: name = "BadDamage";	break;
+		default: break;
+	}
+	o = ev->error_code - render_error;
+	switch (o) {
+		case BadPictFormat: name ="BadPictFormat"; break;
+		case BadPicture: name ="BadPicture"; break;
+		case BadPictOp: name ="BadPictOp"; break;
+		case BadGlyphSet: name ="BadGlyphSet"; break;
+		case BadGlyph: name ="BadGlyph"; break;
+		default: break;
+	}
+	
+	if (name == NULL)
+	{
+		buffer[0] = '\0';
+		XGetErrorText (dpy, ev->error_code, buffer, sizeof (buffer));
+		name = buffer;
+	}
+	
+	fprintf (stderr, "error %d: %s request %d minor %d serial %lu\n",
+			 ev->error_code, (strlen (name) > 0) ? name : "unknown",
+			 ev->request_code, ev->minor_code, ev->serial);
+	
+	gotXError = True;
+	/*    abort ();	    this is just annoying to most people */
+	return 0;
+}
+
+static unsigned long
+checkpoint_win_flags (win *w)
+{
+	unsigned long flags = 0;
+	
+	if (w->cold->nudged)
+		flags |= STATE_FLAG_NUDGED;
+	if (w->ignoreOverrideRedirect)
+		flags |= STATE_FLAG_IGNORE_OVERRIDE_REDIRECT;
+	if (w->validContents)
+		flags |= STATE_FLAG_VALID_CONTENTS;
+	if (w->isHidden)
+		flags |= STATE_FLAG_HIDDEN;
+	
+	return flags;
+}
+
+/* Saves what a new instance needs to pick up where we are. Cheap enough to
+ * call every loop: it runs at most every STATE_CHECKPOINT_PERIOD unless
+ * focus moved, and only touches the property when something changed.
+ * Damage sequences are saved as their order among mapped windows.
+ */
+static void
+checkpoint_state (Display *dpy)
+{
+	long checkpoint[STATE_CHECKPOINT_HEADER + 3 * STATE_CHECKPOINT_MAX_WINDOWS];
+	unsigned int length = STATE_CHECKPOINT_HEADER;
+	unsigned int currentTime = get_time_in_milliseconds();
+	win *w, *v;
+	
+	if (stateCheckpointLength && stateCheckpoint[1] == currentFocusWindow &&
+		currentTime - lastStateCheckpointTime < STATE_CHECKPOINT_PERIOD)
+		return;
+	
+	lastStateCheckpointTime = currentTime;
+	
+	for (w = list; w && length < sizeof(checkpoint) / sizeof(checkpoint[0]); w = w->next)
+	{
+		unsigned long order = 0;
+		
+		if (w->a.map_state != IsViewable)
+			continue;
+		
+		// Zero stays zero; never damaged means something to focus logic
+		if (w->damage_sequence)
+		{
+			order = 1;
+			for (v = list; v; v = v->next)
+			{
+				if (v->a.map_state == IsViewable && v->damage_sequence &&
+					v->damage_sequence < w->damage_sequence)
+					order++;
+			}
+		}
+		
+		checkpoint[length++] = w->id;
+		checkpoint[length++] = order;
+		checkpoint[length++] = checkpoint_win_flags(w);
+	}
+	
+	checkpoint[0] = STATE_CHECKPOINT_VERSION;
+	checkpoint[1] = currentFocusWindow;
+	checkpoint[2] = (length - STATE_CHECKPOINT_HEADER) / 3;
+	
+	if (length == stateCheckpointLength &&
+		!memcmp(checkpoint, stateCheckpoint, length * sizeof(long)))
+		return;
+	
+	XChangeProperty(dpy, root, stateCheckpointAtom, XA_CARDINAL, 32, PropModeReplace,
+					(unsigned char *)checkpoint, length);
+	
+	memcpy(stateCheckpoint, checkpoint, length * sizeof(long));
+	stateCheckpointLength = length;
+}
+
+/* Adopts the state a previous instance left behind, so the focus logic
+ * lands on the same window right away. Returns True if there was any.
+ */
+static Bool
+restore_state_checkpoint (Display *dpy)
+{
+	Atom actual;
+	int format;
+	unsigned long n, left;
+	unsigned char *data = NULL;
+	unsigned long maxOrder = 0;
+	win *w, *focus = NULL;
+	long *values;
+	unsigned long i;
+	
+	int result;
+	
+	XPROF(XPROF_CHECKPOINT_GET_PROPERTY,
+		  result = XGetWindowProperty(dpy, root, stateCheckpointAtom, 0L,
+									  sizeof(stateCheckpoint) / sizeof(stateCheckpoint[0]),
+									  False, XA_CARDINAL, &actual, &format, &n, &left, &data));
+	
+	if (result != Success || !data)
+		return False;
+	
+	values = (long *)data;
+	
+	if (actual != XA_CARDINAL || format != 32 || n < STATE_CHECKPOINT_HEADER ||
+		values[0] != STATE_CHECKPOINT_VERSION ||
+		STATE_CHECKPOINT_HEADER + 3 * (unsigned long)values[2] > n)
+	{
+		XFree(data);
+		return False;
+	}
+	
+	for (i = 0; i < values[2]; i++)
+	{
+		long *record = &values[STATE_CHECKPOINT_HEADER + 3 * i];
+		
+		w = lookup_win((Window)record[0]);
+		
+		if (!w || w->a.map_state != IsViewable)
+			continue;
+		
+		w->damage_sequence = record[1];
+		w->cold->nudged = !!(record[2] & STATE_FLAG_NUDGED);
+		w->ignoreOverrideRedirect = !!(record[2] & STATE_FLAG_IGNORE_OVERRIDE_REDIRECT);
+		w->validContents = !!(record[2] & STATE_FLAG_VALID_CONTENTS);
+		w->isHidden = !!(record[2] & STATE_FLAG_HIDDEN);
+		
+		if (w->damage_sequence > maxOrder)
+			maxOrder = w->damage_sequence;
+		
+		if (w->id == (Window)values[1])
+			focus = w;
+	}
+	
+	// Ties between games went to whoever had focus
+	if (focus && focus->damage_sequence)
+		focus->damage_sequence = ++maxOrder;
+	
+	damageSequence = maxOrder + 1;
+	
+	XFree(data);
+	return True;
+}
+
+// Readiness is reported on this fd, and to $NOTIFY_SOCKET like sd_notify()
+static int		readyFd = -1;
+
+static void
+notify_ready (void)
+{
+	static const char message[] = "READY=1\n";
+	const char *notifySocket = getenv("NOTIFY_SOCKET");
+	
+	if (readyFd >= 0)
+	{
+		if (write(readyFd, message, sizeof(message) - 1) < 0)
+			fprintf (stderr, "Couldn't report readiness: %s\n", strerror(errno));
+		close(readyFd);
+		readyFd = -1;
+	}
+	
+	if (notifySocket && (notifySocket[0] == '/' || notifySocket[0] == '@') &&
+		strlen(notifySocket) < sizeof(((struct sockaddr_un *)0)->sun_path))
+	{
+		struct sockaddr_un addr;
+		socklen_t length;
+		int fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+		
+		if (fd < 0)
+			return;
+		
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strcpy(addr.sun_path, notifySocket);
+		length = offsetof(struct sockaddr_un, sun_path) + strlen(notifySocket);
+		
+		// Abstract namespace
+		if (addr.sun_path[0] == '@')
+			addr.sun_path[0] = '\0';
+		
+		sendto(fd, message, sizeof(message) - 2, MSG_NOSIGNAL, (struct sockaddr *)&addr, length);
+		close(fd);
+	}
+}
+
+static void
+usage (char *program)
 {
 	fprintf (stderr, "%s v%s\n", program, "v4");
 	fprintf (stderr, "usage: %s [options]\n", program);
@@ -1728,83 +5318,1331 @@ usage (char *program)
 	fprintf (stderr, "   -n\n      Normal client-side compositing with transparency support\n");
 	fprintf (stderr, "   -s\n      Draw server-side shadows with sharp edges.\n");
 	fprintf (stderr, "   -S\n      Enable synchronous operation (for debugging).\n");
+	fprintf (stderr, "   -T file\n      Write a timeline trace in Chrome trace event format, for ui.perfetto.dev.\n");
+	fprintf (stderr, "   -V\n      Print events and the blocking X calls made while handling them.\n      SIGUSR1 prints a summary of blocking calls at any time.\n");
+	fprintf (stderr, "   -g\n      Draw a frame-time graph and per-layer GPU timings.\n");
+	fprintf (stderr, "   -p\n      Pace games rendering below the refresh rate to whole vblanks.\n");
+	fprintf (stderr, "   -x\n      Have the X server show the cursor of letterboxed games rather than compositing it.\n");
+	fprintf (stderr, "   -b megabytes\n      Budget for window textures; the least recently shown are released beyond it.\n");
+	fprintf (stderr, "   -B gl|cpu|render\n      Composite with OpenGL, on the CPU through MIT-SHM, or with XRender.\n      (default gl, or render if GL is software-only or lacks texture-from-pixmap)\n");
+	fprintf (stderr, "   -R fd\n      Write READY=1 to this file descriptor once compositing.\n");
+	fprintf (stderr, "   -k socket\n      Listen for control and statistics requests on this socket.\n      (default $XDG_RUNTIME_DIR/steamcompmgr.sock)\n");
 	exit (1);
 }
 
 static Bool
-register_cm (Display *dpy)
+register_cm (Display *dpy)
+{
+	Window w;
+	Atom a;
+	static char net_wm_cm[] = "_NET_WM_CM_Sxx";
+	
+	snprintf (net_wm_cm, sizeof (net_wm_cm), "_NET_WM_CM_S%d", scr);
+	a = XInternAtom (dpy, net_wm_cm, False);
+	
+	w = XGetSelectionOwner (dpy, a);
+	if (w != None)
+	{
+		XTextProperty tp;
+		char **strs;
+		int count;
+		Atom winNameAtom = XInternAtom (dpy, "_NET_WM_NAME", False);
+		
+		if (!XGetTextProperty (dpy, w, &tp, winNameAtom) &&
+			!XGetTextProperty (dpy, w, &tp, XA_WM_NAME))
+		{
+			fprintf (stderr,
+					 "Another composite manager is already running (0x%lx)\n",
+					 (unsigned long) w);
+			return False;
+		}
+		if (XmbTextPropertyToTextList (dpy, &tp, &strs, &count) == Success)
+		{
+			fprintf (stderr,
+					 "Another composite manager is already running (%s)\n",
+					 strs[0]);
+			
+			XFreeStringList (strs);
+		}
+		
+		XFree (tp.value);
+		
+		return False;
+	}
+	
+	w = XCreateSimpleWindow (dpy, RootWindow (dpy, scr), 0, 0, 1, 1, 0, None,
+							 None);
+	
+	Xutf8SetWMProperties (dpy, w, "steamcompmgr", "steamcompmgr", NULL, 0, NULL, NULL,
+						  NULL);
+	
+	Atom atomWmCheck = XInternAtom(dpy, "_NET_SUPPORTING_WM_CHECK", False);
+	XChangeProperty(dpy, root, atomWmCheck,
+					XA_WINDOW, 32, PropModeReplace, (unsigned char *)&w, 1);
+	XChangeProperty(dpy, w, atomWmCheck,
+					XA_WINDOW, 32, PropModeReplace, (unsigned char *)&w, 1);
+	
+	
+	Atom fullScreenSupported = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
+	XChangeProperty(dpy, root, XInternAtom(dpy, "_NET_SUPPORTED", False),
+					XA_ATOM, 32, PropModeAppend, (unsigned char *)&fullScreenSupported, 1);
+	
+	XSetSelectionOwner (dpy, a, w, 0);
+	
+	ourWindow = w;
+	
+	exposeEvent.type = Expose;
+	exposeEvent.xexpose.window = ourWindow;
+	exposeEvent.xexpose.width = 1;
+	exposeEvent.xexpose.height = 1;
+	
+	return True;
+}
+
+static void
+handle_event (Display *dpy, XEvent *ev)
+{
+	if ((ev->type & 0x7f) != KeymapNotify)
+		discard_ignore (dpy, ev->xany.serial);
+	if (debugEvents)
+	{
+		printf ("event %x\n", ev->type);
+	}
+	switch (ev->type) {
+		case CreateNotify:
+			if (ev->xcreatewindow.parent == root)
+				add_win (dpy, ev->xcreatewindow.window, 0, ev->xcreatewindow.serial);
+			break;
+		case ConfigureNotify:
+			configure_win (dpy, &ev->xconfigure);
+			break;
+		case DestroyNotify:
+		{
+			win * w = find_win(dpy, ev->xdestroywindow.window);
+			
+			if (w && w->id == ev->xdestroywindow.window)
+				destroy_win (dpy, ev->xdestroywindow.window, True, True);
+			break;
+		}
+		case MapNotify:
+		{
+			win * w = find_win(dpy, ev->xmap.window);
+			
+			if (w && w->id == ev->xmap.window)
+				map_win (dpy, ev->xmap.window, ev->xmap.serial);
+			break;
+		}
+		case UnmapNotify:
+		{
+			win * w = find_win(dpy, ev->xunmap.window);
+			
+			if (w && w->id == ev->xunmap.window)
+				unmap_win (dpy, ev->xunmap.window, True);
+			break;
+		}
+		case ReparentNotify:
+			if (ev->xreparent.parent == root)
+				add_win (dpy, ev->xreparent.window, 0, ev->xreparent.serial);
+			else
+			{
+				win * w = find_win(dpy, ev->xreparent.window);
+				
+				if (w && w->id == ev->xreparent.window)
+				{
+					destroy_win (dpy, ev->xreparent.window, False, True);
+				}
+				else
+				{
+					// If something got reparented _to_ a toplevel window,
+					// go check for the fullscreen workaround again.
+					w = find_win(dpy, ev->xreparent.parent);
+					if (w)
+					{
+						get_size_hints(dpy, w);
+						focusDirty = True;
+					}
+				}
+			}
+			break;
+		case CirculateNotify:
+			circulate_win (dpy, &ev->xcirculate);
+			break;
+		case Expose:
+			// Only the XRender backend keeps what it drew to the screen
+			if (ev->xexpose.window == root)
+				renderFullRepaint = True;
+			break;
+		case GenericEvent:
+			if (hasPresent && ev->xcookie.extension == present_opcode &&
+				XGetEventData (dpy, &ev->xcookie))
+			{
+				if (ev->xcookie.evtype == PresentCompleteNotify)
+					handle_present_complete (dpy, (XPresentCompleteNotifyEvent *) ev->xcookie.data);
+				
+				XFreeEventData (dpy, &ev->xcookie);
+			}
+			break;
+		case PropertyNotify:
+			/* check if Trans property was changed */
+			if (ev->xproperty.atom == opacityAtom)
+			{
+				/* reset mode and redraw window */
+				win * w = find_win(dpy, ev->xproperty.window);
+				win * mainOverlayWindow = find_win(dpy, currentOverlayWindow);
+				if (w && w->isOverlay)
+				{
+					unsigned int newOpacity = get_prop(dpy, w->id, opacityAtom, TRANSLUCENT);
+					
+					if (newOpacity != w->opacity)
+					{
+						if (!w->opacity)
+							begin_switch_timing(w);
+						
+						w->damaged = 1;
+						w->opacity = newOpacity;
+					}
+					
+					if (w->opacity && w->isOverlay && unredirectedWindow != None)
+					{
+						XCompositeRedirectWindow(dpy, unredirectedWindow, CompositeRedirectManual);
+						TRACE_INSTANT("redirect", unredirectedWindow);
+						ensure_win_resources(dpy, find_win(dpy, unredirectedWindow));
+						unredirectedWindow = None;
+					}
+					
+					if (w->isOverlay)
+					{
+						set_win_hidden(dpy, w, w->opacity == TRANSLUCENT);
+					}
+					
+					unsigned int maxOpacity = 0;
+					
+					for (w = list; w; w = w->next)
+					{
+						if (w->isOverlay)
+						{
+							if (w->a.width == 1920 && w->opacity >= maxOpacity)
+							{
+								currentOverlayWindow = w->id;
+								maxOpacity = w->opacity;
+							}
+						}
+					}
+				}
+			}
+			if (ev->xproperty.atom == steamAtom)
+			{
+				win * w = find_win(dpy, ev->xproperty.window);
+				if (w)
+				{
+					w->isSteam = get_prop(dpy, w->id, steamAtom, 0);
+					update_win_class(dpy, w);
+					focusDirty = True;
+				}
+			}
+			if (ev->xproperty.atom == gameAtom)
+			{
+				win * w = find_win(dpy, ev->xproperty.window);
+				if (w)
+				{
+					w->gameID = get_prop(dpy, w->id, gameAtom, 0);
+					update_win_class(dpy, w);
+					focusDirty = True;
+				}
+			}
+			if (ev->xproperty.atom == overlayAtom)
+			{
+				win * w = find_win(dpy, ev->xproperty.window);
+				if (w)
+				{
+					w->isOverlay = get_prop(dpy, w->id, overlayAtom, 0);
+					update_win_class(dpy, w);
+					get_opaque_region(dpy, w);
+					focusDirty = True;
+					
+					// Overlay windows need a RGBA pixmap, so destroy the old one there
+					// It'll be reallocated as RGBA in ensure_win_resources()
+					if (w->pixmap && w->isOverlay)
+					{
+						teardown_win_resources(dpy, w);
+					}
+				}
+			}
+			if (ev->xproperty.atom == winTypeAtom)
+			{
+				win * w = find_win(dpy, ev->xproperty.window);
+				if (w && w->id == ev->xproperty.window)
+				{
+					w->cold->windowType = WIN_TYPE_UNKNOWN;
+					update_win_class(dpy, w);
+				}
+			}
+			if (ev->xproperty.atom == opaqueRegionAtom)
+			{
+				win * w = find_win(dpy, ev->xproperty.window);
+				if (w && w->id == ev->xproperty.window)
+				{
+					get_opaque_region(dpy, w);
+					w->damaged = 1;
+				}
+			}
+			if (ev->xproperty.atom == sizeHintsAtom)
+			{
+				win * w = find_win(dpy, ev->xproperty.window);
+				if (w)
+				{
+					get_size_hints(dpy, w);
+					focusDirty = True;
+				}
+			}
+			if (ev->xproperty.atom == presentationModeAtom)
+			{
+				if (ev->xproperty.window == root)
+				{
+					rootPresentationMode = get_prop(dpy, root, presentationModeAtom, PRESENTATION_MODE_FIFO);
+				}
+				else
+				{
+					win * w = find_win(dpy, ev->xproperty.window);
+					if (w)
+						w->presentationMode = get_prop(dpy, w->id, presentationModeAtom, PRESENTATION_MODE_UNSET);
+				}
+				
+				apply_presentation_mode(dpy);
+			}
+			if (ev->xproperty.atom == gamesRunningAtom)
+			{
+				gamesRunningCount = get_prop(dpy, root, gamesRunningAtom, 0);
+				
+				focusDirty = True;
+			}
+			if (ev->xproperty.atom == screenScaleAtom)
+			{
+				overscanScaleRatio = get_prop(dpy, root, screenScaleAtom, 0xFFFFFFFF) / (double)0xFFFFFFFF;
+				
+				globalScaleRatio = overscanScaleRatio * zoomScaleRatio;
+				
+				win *w;
+				
+				if (w = find_win(dpy, currentFocusWindow))
+					w->damaged = 1;
+				
+				focusDirty = True;
+			}
+			if (ev->xproperty.atom == screenZoomAtom)
+			{
+				zoomScaleRatio = get_prop(dpy, root, screenZoomAtom, 0xFFFF) / (double)0xFFFF;
+				
+				globalScaleRatio = overscanScaleRatio * zoomScaleRatio;
+				
+				win *w;
+				
+				if (w = find_win(dpy, currentFocusWindow))
+					w->damaged = 1;
+				
+				focusDirty = True;
+			}
+			break;
+		case ClientMessage:
+		{
+			win * w = find_win(dpy, ev->xclient.window);
+			if (w)
+			{
+				if (ev->xclient.data.l[1] == fullscreenAtom)
+				{
+					w->isFullscreen = ev->xclient.data.l[0];
+					
+					focusDirty = True;
+				}
+			}
+			break;
+		}
+		case LeaveNotify:
+			if (ev->xcrossing.window == currentFocusWindow)
+			{
+				// This shouldn't happen due to our pointer barriers,
+				// but there is a known X server bug; warp to last good
+				// position.
+				XWarpPointer(dpy, None, currentFocusWindow, 0, 0, 0, 0,
+							 cursorX, cursorY);
+			}
+			break;
+		case MotionNotify:
+		{
+			win * w = find_win(dpy, ev->xmotion.window);
+			if (w && w->id == currentFocusWindow)
+			{
+				handle_mouse_movement( dpy, ev->xmotion.x, ev->xmotion.y );
+			}
+			break;
+		}
+		default:
+			if (ev->type == damage_event + XDamageNotify)
+			{
+				damage_win (dpy, (XDamageNotifyEvent *) ev);
+			}
+			else if (ev->type == xfixes_event + XFixesCursorNotify)
+			{
+				XFixesCursorNotifyEvent *cursorEvent = (XFixesCursorNotifyEvent *) ev;
+				win *w = find_win(dpy, currentFocusWindow);
+				
+				cursorImageDirty = True;
+				
+				if (serverCursorWindow)
+				{
+					// The game changed its cursor over ours
+					if (cursorEvent->cursor_name != scaledCursorAtom && !update_server_cursor(dpy))
+					{
+						hideCursorForScale = True;
+						apply_cursor_state(dpy);
+					}
+				}
+				else if (w && focusedWindowNeedsScale && gameFocused)
+					damage_cursor(w);
+			}
+			break;
+	}
+}
+
+/* Runtime control socket. Clients send newline-terminated commands and get
+ * one line of JSON back for each:
+ *   stats
+ *   profile
+ *   set hud|graph|unredirect|pacing 0|1
+ *   set presentation fifo|mailbox|immediate
+ *   set filter linear|nearest
+ *   set fade|cursor_hide <milliseconds>
+ *   set texture_budget <megabytes>
+ */
+#define			CONTROL_MAX_CLIENTS 8
+#define			CONTROL_BUFFER_SIZE 1024
+#define			CONTROL_REPLY_SIZE 16384
+
+typedef struct _control_client {
+	int		fd;
+	char	buffer[CONTROL_BUFFER_SIZE];
+	int		length;
+} control_client;
+
+static char		*controlSocketPath = NULL;
+int				controlSocket = -1;
+control_client	controlClients[CONTROL_MAX_CLIENTS];
+
+static void
+init_control_socket (void)
+{
+	struct sockaddr_un addr;
+	int i;
+	
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		controlClients[i].fd = -1;
+	
+	if (!controlSocketPath)
+		return;
+	
+	if (strlen(controlSocketPath) >= sizeof(addr.sun_path))
+	{
+		fprintf (stderr, "Control socket path too long: %s\n", controlSocketPath);
+		return;
+	}
+	
+	controlSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (controlSocket < 0)
+	{
+		fprintf (stderr, "Couldn't create control socket: %s\n", strerror(errno));
+		return;
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, controlSocketPath);
+	
+	// We own the compositor selection by now, so a leftover socket is stale
+	unlink(controlSocketPath);
+	
+	if (bind(controlSocket, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(controlSocket, CONTROL_MAX_CLIENTS) < 0)
+	{
+		fprintf (stderr, "Couldn't listen on %s: %s\n", controlSocketPath, strerror(errno));
+		close(controlSocket);
+		controlSocket = -1;
+	}
+}
+
+static void
+close_control_client (control_client *client)
+{
+	close(client->fd);
+	client->fd = -1;
+	client->length = 0;
+}
+
+/* Once something didn't fit, length stays at CONTROL_REPLY_SIZE so the
+ * truncated reply can be told apart and replaced. */
+static void
+reply_append (char *reply, int *length, const char *format, ...)
+{
+	va_list args;
+	int written;
+	
+	if (*length >= CONTROL_REPLY_SIZE)
+		return;
+	
+	va_start(args, format);
+	written = vsnprintf(reply + *length, CONTROL_REPLY_SIZE - *length, format, args);
+	va_end(args);
+	
+	if (written < 0 || written >= CONTROL_REPLY_SIZE - *length)
+		*length = CONTROL_REPLY_SIZE;
+	else
+		*length += written;
+}
+
+static int
+compare_floats (const void *a, const void *b)
+{
+	float fa = *(const float *)a;
+	float fb = *(const float *)b;
+	
+	return (fa > fb) - (fa < fb);
+}
+
+static void
+control_profile (char *reply, int *length)
+{
+	Bool first = True;
+	int i;
+	
+	reply_append(reply, length, "{\"calls\":%lu,\"time_us\":%llu,\"last_frame_calls\":%u,"
+				 "\"last_frame_us\":%llu,\"max_frame_us\":%llu,\"last_frame_requests\":%lu,"
+				 "\"max_frame_requests\":%lu,\"sites\":{",
+				 xprofTotal.calls, (unsigned long long)xprofTotal.time, xprofTotal.lastFrameCalls,
+				 (unsigned long long)xprofTotal.lastFrameTime, (unsigned long long)xprofMaxFrameTime,
+				 xprofLastFrameRequests, xprofMaxFrameRequests);
+	
+	for (i = 0; i < XPROF_SITE_COUNT; i++)
+	{
+		reply_append(reply, length, "%s\"%s\":{\"calls\":%lu,\"time_us\":%llu,\"max_us\":%llu,"
+					 "\"last_frame_calls\":%u,\"last_frame_us\":%llu}",
+					 i ? "," : "", xprofSiteTable[i].name, xprofSites[i].calls,
+					 (unsigned long long)xprofSites[i].time, (unsigned long long)xprofSites[i].maxTime,
+					 xprofSites[i].lastFrameCalls, (unsigned long long)xprofSites[i].lastFrameTime);
+	}
+	
+	reply_append(reply, length, "},\"events\":[");
+	
+	for (i = 0; i < XPROF_EVENT_SLOTS; i++)
+	{
+		if (!xprofEvents[i].count)
+			continue;
+		
+		reply_append(reply, length, "%s{\"type\":\"%s%d\",\"count\":%lu,\"requests\":%lu,"
+					 "\"calls\":%lu,\"time_us\":%llu,\"max_us\":%llu}",
+					 first ? "" : ",",
+					 i == XPROF_EVENT_DAMAGE ? "damage" : i == XPROF_EVENT_OTHER ? "extension" : "",
+					 i < LASTEvent ? i : 0,
+					 xprofEvents[i].count, xprofEvents[i].requests, xprofEvents[i].calls,
+					 (unsigned long long)xprofEvents[i].time, (unsigned long long)xprofEvents[i].maxTime);
+		first = False;
+	}
+	
+	reply_append(reply, length, "]}");
+}
+
+static void
+control_stats (Display *dpy, char *reply, int *length)
+{
+	float sorted[FRAME_HISTORY_LENGTH];
+	int count = 0;
+	Bool first = True;
+	win *w;
+	int i;
+	
+	for (i = 0; i < FRAME_HISTORY_LENGTH; i++)
+	{
+		if (frameTimeHistory[i] > 0.0f)
+			sorted[count++] = frameTimeHistory[i];
+	}
+	
+	qsort(sorted, count, sizeof(float), compare_floats);
+	
+	reply_append(reply, length, "{\"frame_time\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f},",
+				 count ? sorted[count * 50 / 100] : 0.0f,
+				 count ? sorted[count * 90 / 100] : 0.0f,
+				 count ? sorted[count * 99 / 100] : 0.0f,
+				 count ? sorted[count - 1] : 0.0f);
+	reply_append(reply, length, "\"fps\":%.1f,\"refresh_interval\":%.3f,\"presentation_mode\":\"%s\",",
+				 currentFrameRate, refreshInterval,
+				 currentPresentationMode < PRESENTATION_MODE_COUNT ?
+				 presentationModeNames[currentPresentationMode] : "unset");
+	reply_append(reply, length, "\"focus\":%lu,\"unredirected\":%lu,\"x_round_trips\":%lu,",
+				 currentFocusWindow, unredirectedWindow, xRoundTrips);
+	reply_append(reply, length, "\"fences\":{\"triggered\":%u,\"waits\":%u,\"max_wait_us\":%llu,"
+				 "\"timeouts\":%u},",
+				 fencesTriggered, fenceWaitCount, (unsigned long long)fenceWaitMaxTime,
+				 fenceTimeoutCount);
+	reply_append(reply, length, "\"textures\":{\"resident\":%lu,\"budget\":%lu,\"evictions\":%u,"
+				 "\"restores\":%u,\"max_restore_us\":%llu},",
+				 residentTextureMemory, textureBudget, textureEvictionCount,
+				 textureRestoreCount, (unsigned long long)textureRestoreMaxTime);
+	reply_append(reply, length, "\"switches\":{\"count\":%u,\"prewarmed\":%u,\"prewarm_binds\":%u,"
+				 "\"last_latency\":%.3f,\"max_latency\":%.3f,\"avoided\":%u},",
+				 switchCount, switchWarmCount, prewarmCount, lastSwitchLatency, maxSwitchLatency,
+				 focusSwitchesAvoided);
+	reply_append(reply, length, "\"damage\":{\"events_per_pass\":%u,\"max_events_per_pass\":%u,"
+				 "\"floods\":%u},",
+				 damageEventsPerPass, maxDamageEventsPerPass, damageFloodCount);
+	reply_append(reply, length, "\"events\":{\"deferred\":%lu,\"coalesced\":%lu,\"max_drain_us\":%llu,"
+				 "\"passive_windows\":%lu,\"trace_dropped\":%lu},",
+				 deferredEventCount, coalescedEventCount, (unsigned long long)maxEventDrainTime,
+				 passiveWinCount, trace_dropped());
+	reply_append(reply, length, "\"layers\":{\"culled\":%u,\"culled_pixels\":%lu,\"total_culled\":%lu,"
+				 "\"clears_skipped\":%lu},",
+				 culledLayers, culledPixels, culledLayerCount, skippedClearCount);
+	reply_append(reply, length, "\"backend\":{\"name\":\"%s\",\"composite_time\":%.3f,"
+				 "\"max_composite_time\":%.3f,\"readback_bytes\":%lu,\"repaint_fraction\":%.3f,"
+				 "\"cursor_frames\":%lu,\"server_cursor\":%s},",
+				 backendNames[compositeBackend], compositeTime, maxCompositeTime, cpuFetchedBytes,
+				 renderRepaintFraction, cursorOnlyFrames, serverCursorWindow ? "true" : "false");
+	
+	reply_append(reply, length, "\"windows\":[");
+	
+	for (w = list; w; w = w->next)
+	{
+		if (w->a.map_state != IsViewable)
+			continue;
+		
+		reply_append(reply, length, "%s{\"id\":%lu,\"game\":%llu,\"fps\":%.2f,\"jitter\":%.3f,"
+					 "\"frames\":%u,\"dropped\":%u,\"duplicated\":%u,\"presents\":%u,"
+					 "\"focus_score\":%.3f}",
+					 first ? "" : ",", w->id, w->gameID,
+					 w->frameIntervalAverage > 0.0f ? 1000.0f / w->frameIntervalAverage : 0.0f,
+					 sqrtf(w->cold->frameIntervalVariance),
+					 w->cold->clientFrameCount, w->cold->droppedFrames, w->cold->duplicatedFrames,
+					 w->cold->clientPresentCount, w->gameID ? w->focusScore : 0.0f);
+		first = False;
+	}
+	
+	reply_append(reply, length, "]}");
+}
+
+static Bool
+parse_toggle (const char *value, Bool *result)
+{
+	if (!strcmp(value, "1") || !strcmp(value, "on"))
+		*result = True;
+	else if (!strcmp(value, "0") || !strcmp(value, "off"))
+		*result = False;
+	else
+		return False;
+	
+	return True;
+}
+
+static const char *
+control_set (Display *dpy, const char *name, const char *value)
+{
+	Bool toggle = False;
+	char *end;
+	
+	if (!strcmp(name, "presentation"))
+	{
+		long mode;
+		
+		for (mode = 0; mode < PRESENTATION_MODE_COUNT; mode++)
+		{
+			if (!strcmp(value, presentationModeNames[mode]))
+				break;
+		}
+		
+		if (mode == PRESENTATION_MODE_COUNT)
+			return "bad presentation mode";
+		
+		// Goes through the same path as the session setting it
+		XChangeProperty(dpy, root, presentationModeAtom, XA_CARDINAL, 32, PropModeReplace,
+						(unsigned char *)&mode, 1);
+		return NULL;
+	}
+	
+	if (!strcmp(name, "filter"))
+	{
+		if (!strcmp(value, "linear"))
+			scaleFilter = GL_LINEAR;
+		else if (!strcmp(value, "nearest"))
+			scaleFilter = GL_NEAREST;
+		else
+			return "bad filter";
+		return NULL;
+	}
+	
+	if (!strcmp(name, "texture_budget"))
+	{
+		unsigned long megabytes = strtoul(value, &end, 10);
+		
+		if (end == value || *end)
+			return "bad budget";
+		
+		textureBudget = megabytes * 1024 * 1024;
+		return NULL;
+	}
+	
+	if (!strcmp(name, "fade") || !strcmp(name, "cursor_hide"))
+	{
+		unsigned long ms = strtoul(value, &end, 10);
+		
+		if (end == value || *end)
+			return "bad duration";
+		
+		if (name[0] == 'f')
+			fadeOutDuration = ms;
+		else
+			cursorHideTime = ms;
+		return NULL;
+	}
+	
+	if (!parse_toggle(value, &toggle))
+		return "bad value";
+	
+	if (!strcmp(name, "hud"))
+	{
+		if (toggle && !hasPathRendering)
+			return "no GL_NV_path_rendering";
+		drawDebugInfo = toggle;
+	}
+	else if (!strcmp(name, "graph"))
+	{
+		drawFrameGraph = toggle;
+	}
+	else if (!strcmp(name, "unredirect"))
+	{
+		allowUnredirection = toggle;
+		focusDirty = True;
+	}
+	else if (!strcmp(name, "pacing"))
+	{
+		framePacing = toggle;
+		memset(&gamePacer, 0, sizeof(gamePacer));
+	}
+	else
+	{
+		return "unknown setting";
+	}
+	
+	return NULL;
+}
+
+/* Returns True if the command changed something that needs a repaint. */
+static Bool
+handle_control_command (Display *dpy, control_client *client, char *command)
+{
+	char reply[CONTROL_REPLY_SIZE];
+	int length = 0;
+	Bool changed = False;
+	char *verb, *name, *value, *saveptr;
+	
+	verb = strtok_r(command, " \t\r", &saveptr);
+	name = strtok_r(NULL, " \t\r", &saveptr);
+	value = strtok_r(NULL, " \t\r", &saveptr);
+	
+	if (!verb)
+		return False;
+	
+	if (!strcmp(verb, "stats"))
+	{
+		control_stats(dpy, reply, &length);
+	}
+	else if (!strcmp(verb, "profile"))
+	{
+		control_profile(reply, &length);
+	}
+	else if (!strcmp(verb, "set") && name && value)
+	{
+		const char *error = control_set(dpy, name, value);
+		
+		if (error)
+			reply_append(reply, &length, "{\"error\":\"%s\"}", error);
+		else
+			reply_append(reply, &length, "{\"ok\":true}");
+		
+		changed = !error;
+	}
+	else
+	{
+		reply_append(reply, &length, "{\"error\":\"unknown command\"}");
+	}
+	
+	// Cut-off JSON is worse than none; leave room for the newline too
+	if (length >= CONTROL_REPLY_SIZE - 1)
+	{
+		fprintf (stderr, "Control reply to \"%s\" doesn't fit in %d bytes\n", verb, CONTROL_REPLY_SIZE);
+		length = 0;
+		reply_append(reply, &length, "{\"error\":\"reply too long\"}");
+	}
+	reply[length++] = '\n';
+	
+	// Replies are small; a client that can't take one at once is dropped
+	// rather than allowed to stall compositing.
+	if (send(client->fd, reply, length, MSG_NOSIGNAL | MSG_DONTWAIT) != length)
+		close_control_client(client);
+	
+	return changed;
+}
+
+static Bool
+service_control_client (Display *dpy, control_client *client)
 {
-	Window w;
-	Atom a;
-	static char net_wm_cm[] = "_NET_WM_CM_Sxx";
+	Bool changed = False;
+	ssize_t result;
+	char *newline;
 	
-	snprintf (net_wm_cm, sizeof (net_wm_cm), "_NET_WM_CM_S%d", scr);
-	a = XInternAtom (dpy, net_wm_cm, False);
+	result = recv(client->fd, client->buffer + client->length,
+				  CONTROL_BUFFER_SIZE - 1 - client->length, MSG_DONTWAIT);
 	
-	w = XGetSelectionOwner (dpy, a);
-	if (w != None)
+	if (result == 0 || (result < 0 && errno != EAGAIN && errno != EINTR))
 	{
-		XTextProperty tp;
-		char **strs;
-		int count;
-		Atom winNameAtom = XInternAtom (dpy, "_NET_WM_NAME", False);
+		close_control_client(client);
+		return False;
+	}
+	
+	if (result < 0)
+		return False;
+	
+	client->length += result;
+	client->buffer[client->length] = '\0';
+	
+	while (client->fd >= 0 && (newline = strchr(client->buffer, '\n')))
+	{
+		*newline = '\0';
 		
-		if (!XGetTextProperty (dpy, w, &tp, winNameAtom) &&
-			!XGetTextProperty (dpy, w, &tp, XA_WM_NAME))
+		if (handle_control_command(dpy, client, client->buffer))
+			changed = True;
+		
+		client->length -= newline + 1 - client->buffer;
+		memmove(client->buffer, newline + 1, client->length + 1);
+	}
+	
+	// Nobody needs commands this long
+	if (client->fd >= 0 && client->length == CONTROL_BUFFER_SIZE - 1)
+		close_control_client(client);
+	
+	return changed;
+}
+
+static void
+accept_control_client (void)
+{
+	int fd = accept4(controlSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	int i;
+	
+	if (fd < 0)
+		return;
+	
+	for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+	{
+		if (controlClients[i].fd < 0)
 		{
-			fprintf (stderr,
-					 "Another composite manager is already running (0x%lx)\n",
-					 (unsigned long) w);
+			controlClients[i].fd = fd;
+			controlClients[i].length = 0;
+			return;
+		}
+	}
+	
+	close(fd);
+}
+
+static void
+force_repaint (Display *dpy)
+{
+	win *w = find_win(dpy, currentFocusWindow);
+	
+	if (w)
+		w->damaged = 1;
+	
+	renderFullRepaint = True;
+}
+
+/* Blocks until X events are pending. Returns False instead if a held-back
+ * paint became due or a control command changed state, so the main loop
+ * repaints without waiting on X.
+ */
+static Bool
+wait_for_events (Display *dpy)
+{
+	while (!XPending(dpy))
+	{
+		struct pollfd pfds[2 + CONTROL_MAX_CLIENTS];
+		control_client *clients[2 + CONTROL_MAX_CLIENTS] = { NULL };
+		struct timespec timeout;
+		Bool changed = False;
+		int count = 0;
+		int i;
+		
+		pfds[count].fd = ConnectionNumber(dpy);
+		pfds[count++].events = POLLIN;
+		
+		if (controlSocket >= 0)
+		{
+			pfds[count].fd = controlSocket;
+			pfds[count++].events = POLLIN;
+		}
+		
+		for (i = 0; i < CONTROL_MAX_CLIENTS; i++)
+		{
+			if (controlClients[i].fd < 0)
+				continue;
+			
+			clients[count] = &controlClients[i];
+			pfds[count].fd = controlClients[i].fd;
+			pfds[count++].events = POLLIN;
+		}
+		
+		if (scheduledPaintTime)
+		{
+			uint64_t now = get_time_in_microseconds();
+			
+			if (now >= scheduledPaintTime)
+				return False;
+			
+			timeout.tv_sec = (scheduledPaintTime - now) / 1000000;
+			timeout.tv_nsec = ((scheduledPaintTime - now) % 1000000) * 1000;
+		}
+		
+		int ready = ppoll(pfds, count, scheduledPaintTime ? &timeout : NULL, NULL);
+		
+		if (ready == 0)
 			return False;
+		
+		// Signals interrupt the wait; let the main loop see them
+		if (ready < 0)
+		{
+			if (xprofDumpRequested)
+				return False;
+			continue;
 		}
-		if (XmbTextPropertyToTextList (dpy, &tp, &strs, &count) == Success)
+		
+		for (i = 1; i < count; i++)
 		{
-			fprintf (stderr,
-					 "Another composite manager is already running (%s)\n",
-					 strs[0]);
+			if (!pfds[i].revents)
+				continue;
 			
-			XFreeStringList (strs);
+			if (!clients[i])
+				accept_control_client();
+			else if (service_control_client(dpy, clients[i]))
+				changed = True;
 		}
 		
-		XFree (tp.value);
+		if (changed)
+		{
+			force_repaint(dpy);
+			return False;
+		}
+	}
+	
+	return True;
+}
+
+/* Unless GL was asked for explicitly, problems with it make us fall back
+ * to XRender rather than exit.
+ */
+static Bool
+abandon_gl_backend (Display *dpy, const char *reason)
+{
+	fprintf (stderr, "%s\n", reason);
+	
+	if (backendRequested)
+		exit (1);
+	
+	if (glContext)
+	{
+		glXMakeCurrent(dpy, None, NULL);
+		glXDestroyContext(dpy, glContext);
+		glContext = NULL;
+	}
+	
+	return False;
+}
+
+static Bool
+init_gl_backend (Display *dpy)
+{
+	XWindowAttributes rootAttribs;
+	XVisualInfo visualInfoTemplate;
+	int visualInfoCount;
+	XVisualInfo *rootVisualInfo;
+	
+	XGetWindowAttributes (dpy, root, &rootAttribs);
+	
+	visualInfoTemplate.visualid = XVisualIDFromVisual (rootAttribs.visual);
+	
+	rootVisualInfo = XGetVisualInfo (dpy, VisualIDMask, &visualInfoTemplate, &visualInfoCount);
+	if (!visualInfoCount)
+		return abandon_gl_backend(dpy, "Could not get root window visual info");
+	
+	glContext = glXCreateContext(dpy, rootVisualInfo, NULL, True);
+	XFree(rootVisualInfo);
+	
+	if (!glContext)
+		return abandon_gl_backend(dpy, "Could not create GLX context");
+	if (!glXMakeCurrent(dpy, root, glContext))
+		return abandon_gl_backend(dpy, "Could not make GL context current");
+	
+	__pointer_to_glXBindTexImageEXT = (void *)glXGetProcAddress("glXBindTexImageEXT");
+	__pointer_to_glXReleaseTexImageEXT = (void *)glXGetProcAddress("glXReleaseTexImageEXT");
+	
+	if (!__pointer_to_glXBindTexImageEXT || !__pointer_to_glXReleaseTexImageEXT)
+		return abandon_gl_backend(dpy, "Could not get GLX_EXT_texture_from_pixmap entrypoints!");
+	
+	const char *renderer = (const char *)glGetString(GL_RENDERER);
+	
+	// Binding and sampling every frame on a software rasterizer costs a lot
+	// more than letting the X server composite
+	if (!backendRequested && renderer &&
+		(strstr(renderer, "llvmpipe") || strstr(renderer, "softpipe") ||
+		 strstr(renderer, "Software Rasterizer")))
+		return abandon_gl_backend(dpy, "Software GL renderer");
+	
+	__pointer_to_glXSwapIntervalEXT = (void *)glXGetProcAddress("glXSwapIntervalEXT");
+	if (__pointer_to_glXSwapIntervalEXT)
+	{
+		__pointer_to_glXSwapIntervalEXT(dpy, root, 1);
+	}
+	else
+	{
+		fprintf (stderr, "Could not find glXSwapIntervalEXT proc pointer\n");
+	}
+	
+	const char *glxExtensions = glXQueryExtensionsString(dpy, scr);
+	
+	if (glxExtensions && strstr(glxExtensions, "GLX_EXT_swap_control_tear"))
+		hasSwapControlTear = True;
+	
+	if (glxExtensions && strstr(glxExtensions, "GLX_OML_sync_control"))
+		__pointer_to_glXGetSyncValuesOML = (PFNGLXGETSYNCVALUESOMLPROC)glXGetProcAddress("glXGetSyncValuesOML");
+	
+	if (!strstr(glGetString(GL_EXTENSIONS), "GL_NV_path_rendering"))
+	{
+		drawDebugInfo = False;
+	}
+	else
+	{
+		hasPathRendering = True;
+		
+		__pointer_to_glGenPathsNV = (PFNGLGENPATHSNVPROC) glXGetProcAddress("glGenPathsNV");
+		__pointer_to_glPathGlyphRangeNV = (PFNGLPATHGLYPHRANGENVPROC) glXGetProcAddress("glPathGlyphRangeNV");
+		__pointer_to_glGetPathMetricRangeNV = (PFNGLGETPATHMETRICRANGENVPROC) glXGetProcAddress("glGetPathMetricRangeNV");
+		__pointer_to_glGetPathSpacingNV = (PFNGLGETPATHSPACINGNVPROC) glXGetProcAddress("glGetPathSpacingNV");
+		__pointer_to_glStencilFillPathInstancedNV = (PFNGLSTENCILFILLPATHINSTANCEDNVPROC) glXGetProcAddress("glStencilFillPathInstancedNV");
+		__pointer_to_glStencilStrokePathInstancedNV = (PFNGLSTENCILSTROKEPATHINSTANCEDNVPROC) glXGetProcAddress("glStencilStrokePathInstancedNV");
+		__pointer_to_glCoverFillPathInstancedNV = (PFNGLCOVERFILLPATHINSTANCEDNVPROC) glXGetProcAddress("glCoverFillPathInstancedNV");
+		__pointer_to_glCoverStrokePathInstancedNV = (PFNGLCOVERSTROKEPATHINSTANCEDNVPROC) glXGetProcAddress("glCoverStrokePathInstancedNV");
+	}
+	
+	int xsync_major, xsync_minor;
+	
+	if (XSyncQueryExtension(dpy, &xsync_event, &xsync_error) &&
+		XSyncInitialize(dpy, &xsync_major, &xsync_minor) &&
+		strstr(glGetString(GL_EXTENSIONS), "GL_EXT_x11_sync_object"))
+	{
+		__pointer_to_glImportSyncEXT = (PFNGLIMPORTSYNCEXTPROC) glXGetProcAddress("glImportSyncEXT");
+		__pointer_to_glWaitSync = (PFNGLWAITSYNCPROC) glXGetProcAddress("glWaitSync");
+		__pointer_to_glClientWaitSync = (PFNGLCLIENTWAITSYNCPROC) glXGetProcAddress("glClientWaitSync");
+		__pointer_to_glDeleteSync = (PFNGLDELETESYNCPROC) glXGetProcAddress("glDeleteSync");
+		
+		hasXFences = __pointer_to_glImportSyncEXT && __pointer_to_glWaitSync &&
+					 __pointer_to_glClientWaitSync && __pointer_to_glDeleteSync;
+	}
+	
+	if (!hasXFences)
+	{
+		fprintf (stderr, "No X fence synchronization, relying on implicit sync\n");
+	}
+	
+	if (strstr(glGetString(GL_EXTENSIONS), "GL_ARB_timer_query"))
+	{
+		__pointer_to_glGenQueries = (PFNGLGENQUERIESPROC) glXGetProcAddress("glGenQueries");
+		__pointer_to_glBeginQuery = (PFNGLBEGINQUERYPROC) glXGetProcAddress("glBeginQuery");
+		__pointer_to_glEndQuery = (PFNGLENDQUERYPROC) glXGetProcAddress("glEndQuery");
+		__pointer_to_glGetQueryObjectuiv = (PFNGLGETQUERYOBJECTUIVPROC) glXGetProcAddress("glGetQueryObjectuiv");
+		__pointer_to_glGetQueryObjectui64v = (PFNGLGETQUERYOBJECTUI64VPROC) glXGetProcAddress("glGetQueryObjectui64v");
 		
+		if (__pointer_to_glGenQueries && __pointer_to_glBeginQuery && __pointer_to_glEndQuery &&
+			__pointer_to_glGetQueryObjectuiv && __pointer_to_glGetQueryObjectui64v)
+		{
+			__pointer_to_glGenQueries(2 * LAYER_COUNT, &layerTimerQueries[0][0]);
+			hasTimerQueries = True;
+		}
+	}
+	
+	if (strstr(glGetString(GL_EXTENSIONS), "GL_ARB_framebuffer_object"))
+	{
+		__pointer_to_glGenFramebuffers = (PFNGLGENFRAMEBUFFERSPROC) glXGetProcAddress("glGenFramebuffers");
+		__pointer_to_glBindFramebuffer = (PFNGLBINDFRAMEBUFFERPROC) glXGetProcAddress("glBindFramebuffer");
+		__pointer_to_glFramebufferTexture2D = (PFNGLFRAMEBUFFERTEXTURE2DPROC) glXGetProcAddress("glFramebufferTexture2D");
+		__pointer_to_glCheckFramebufferStatus = (PFNGLCHECKFRAMEBUFFERSTATUSPROC) glXGetProcAddress("glCheckFramebufferStatus");
+		__pointer_to_glBlitFramebuffer = (PFNGLBLITFRAMEBUFFERPROC) glXGetProcAddress("glBlitFramebuffer");
+		
+		hasSceneFramebuffer = __pointer_to_glGenFramebuffers && __pointer_to_glBindFramebuffer &&
+							  __pointer_to_glFramebufferTexture2D && __pointer_to_glCheckFramebufferStatus &&
+							  __pointer_to_glBlitFramebuffer;
+	}
+	
+	glEnable(GL_TEXTURE_2D);
+	glGenTextures(1, &cursorTextureName);
+	
+	return True;
+}
+
+static void
+init_cpu_backend (Display *dpy)
+{
+	XGCValues gcValues;
+	
+	if (!XShmQueryExtension(dpy))
+	{
+		fprintf (stderr, "No MIT-SHM extension, needed for CPU compositing\n");
+		exit (1);
+	}
+	
+	cpuBackBufferImage = XShmCreateImage(dpy, DefaultVisual(dpy, scr), DefaultDepth(dpy, scr), ZPixmap,
+										 NULL, &cpuBackBufferShm, root_width, root_height);
+	
+	if (!cpuBackBufferImage || cpuBackBufferImage->bits_per_pixel != 32 ||
+		!create_shm_segment(dpy, &cpuBackBufferShm,
+							(unsigned long)cpuBackBufferImage->bytes_per_line * root_height))
+	{
+		fprintf (stderr, "Could not create CPU compositing back buffer\n");
+		exit (1);
+	}
+	
+	cpuBackBufferImage->data = cpuBackBufferShm.shmaddr;
+	
+	cpuBackBuffer.pixels = (uint32_t *)cpuBackBufferImage->data;
+	cpuBackBuffer.stride = cpuBackBufferImage->bytes_per_line / sizeof(uint32_t);
+	cpuBackBuffer.width = root_width;
+	cpuBackBuffer.height = root_height;
+	
+	// Windows are all redirected, so this draws over the whole screen
+	gcValues.subwindow_mode = IncludeInferiors;
+	gcValues.graphics_exposures = False;
+	cpuPresentGC = XCreateGC(dpy, root, GCSubwindowMode | GCGraphicsExposures, &gcValues);
+	
+	cpu_composite_init(0);
+	
+	// Nothing to draw the HUD with
+	drawDebugInfo = False;
+	drawFrameGraph = False;
+	
+	fprintf (stderr, "Compositing on the CPU with %s kernels\n", cpu_composite_isa());
+}
+
+static void
+init_render_backend (Display *dpy)
+{
+	compositeBackend = BACKEND_RENDER;
+	
+	rootBufferPixmap = XCreatePixmap(dpy, root, root_width, root_height, DefaultDepth(dpy, scr));
+	rootBuffer = XRenderCreatePicture(dpy, rootBufferPixmap,
+									  XRenderFindVisualFormat(dpy, DefaultVisual(dpy, scr)), 0, NULL);
+	
+	// Nothing to draw the HUD with
+	drawDebugInfo = False;
+	drawFrameGraph = False;
+	
+	fprintf (stderr, "Compositing with XRender\n");
+}
+
+static const char *eventNames[LASTEvent] = {
+	[MotionNotify] = "MotionNotify",
+	[LeaveNotify] = "LeaveNotify",
+	[Expose] = "Expose",
+	[CreateNotify] = "CreateNotify",
+	[DestroyNotify] = "DestroyNotify",
+	[UnmapNotify] = "UnmapNotify",
+	[MapNotify] = "MapNotify",
+	[ReparentNotify] = "ReparentNotify",
+	[ConfigureNotify] = "ConfigureNotify",
+	[CirculateNotify] = "CirculateNotify",
+	[PropertyNotify] = "PropertyNotify",
+	[ClientMessage] = "ClientMessage",
+	[GenericEvent] = "GenericEvent",
+};
+
+static const char *
+event_name (XEvent *ev)
+{
+	if (ev->type < LASTEvent && eventNames[ev->type])
+		return eventNames[ev->type];
+	if (ev->type == damage_event + XDamageNotify)
+		return "DamageNotify";
+	if (ev->type == xfixes_event + XFixesCursorNotify)
+		return "CursorNotify";
+	
+	return "event";
+}
+
+/* Handles an event, charging the requests and blocking calls it made to
+ * its type. */
+static void
+xprof_handle_event (Display *dpy, XEvent *ev)
+{
+	unsigned long request = NextRequest (dpy);
+	unsigned long calls = xprofTotal.calls;
+	uint64_t time = xprofTotal.time;
+	xprof_event_stats *stats;
+	
+	TRACE_BEGIN(event_name(ev), ev->xany.window);
+	handle_event (dpy, ev);
+	TRACE_END(event_name(ev));
+	
+	if (ev->type < LASTEvent)
+		stats = &xprofEvents[ev->type];
+	else if (ev->type == damage_event + XDamageNotify)
+		stats = &xprofEvents[XPROF_EVENT_DAMAGE];
+	else
+		stats = &xprofEvents[XPROF_EVENT_OTHER];
+	
+	time = xprofTotal.time - time;
+	
+	stats->count++;
+	stats->requests += NextRequest (dpy) - request;
+	stats->calls += xprofTotal.calls - calls;
+	stats->time += time;
+	if (time > stats->maxTime)
+		stats->maxTime = time;
+	
+	if (debugEvents && xprofTotal.calls != calls)
+		printf ("event %x: %lu blocking calls, %lluus\n", ev->type,
+				xprofTotal.calls - calls, (unsigned long long)time);
+}
+
+/* Whether ev can be dropped because the next event in the queue carries
+ * the same information, or more.
+ */
+static Bool
+event_superseded (Display *dpy, XEvent *ev)
+{
+	XEvent next;
+	
+	if (!QLength(dpy))
+		return False;
+	
+	XPeekEvent(dpy, &next);
+	
+	if (next.type != ev->type)
 		return False;
+	
+	switch (ev->type) {
+		case MotionNotify:
+			return next.xmotion.window == ev->xmotion.window;
+		case PropertyNotify:
+			// Handlers read the current value of the property anyway
+			return next.xproperty.window == ev->xproperty.window &&
+				next.xproperty.atom == ev->xproperty.atom;
+		case ConfigureNotify:
+			// A resize has to be seen to let go of the old pixmap
+			return next.xconfigure.window == ev->xconfigure.window &&
+				next.xconfigure.width == ev->xconfigure.width &&
+				next.xconfigure.height == ev->xconfigure.height;
+		default:
+			if (ev->type == damage_event + XDamageNotify)
+			{
+				XDamageNotifyEvent *de = (XDamageNotifyEvent *) ev;
+				XDamageNotifyEvent *nextDamage = (XDamageNotifyEvent *) &next;
+				win *w;
+				
+				if (nextDamage->drawable != de->drawable)
+					return False;
+				
+				w = lookup_win(de->drawable);
+				if (w)
+					add_damage_box(w, &de->area);
+				
+				return True;
+			}
+			return False;
+	}
+}
+
+static Bool
+is_structure_event (Display *dpy, XEvent *ev, XPointer arg)
+{
+	switch (ev->type) {
+		case CreateNotify:
+		case DestroyNotify:
+		case MapNotify:
+		case UnmapNotify:
+		case ReparentNotify:
+		case ConfigureNotify:
+		case CirculateNotify:
+			return True;
+		default:
+			return False;
 	}
+}
+
+/* Handles queued events until the next paint is getting close. Whatever is
+ * left, apart from changes to the window tree that the paint depends on,
+ * stays in the queue for the next pass of the main loop.
+ */
+static void
+drain_events (Display *dpy)
+{
+	uint64_t start = get_time_in_microseconds();
+	uint64_t interval = refreshInterval * 1000.0f;
+	uint64_t deadline;
+	XEvent ev;
+	
+	if (scheduledPaintTime)
+		deadline = scheduledPaintTime;
+	else if (lastVblankTime && interval)
+	{
+		deadline = lastVblankTime;
+		if (start > lastVblankTime)
+			deadline += ((start - lastVblankTime) / interval + 1) * interval;
+	}
+	else
+		deadline = start + interval;
 	
-	w = XCreateSimpleWindow (dpy, RootWindow (dpy, scr), 0, 0, 1, 1, 0, None,
-							 None);
-	
-	Xutf8SetWMProperties (dpy, w, "steamcompmgr", "steamcompmgr", NULL, 0, NULL, NULL,
-						  NULL);
-	
-	Atom atomWmCheck = XInternAtom(dpy, "_NET_SUPPORTING_WM_CHECK", False);
-	XChangeProperty(dpy, root, atomWmCheck,
-					XA_WINDOW, 32, PropModeReplace, (unsigned char *)&w, 1);
-	XChangeProperty(dpy, w, atomWmCheck,
-					XA_WINDOW, 32, PropModeReplace, (unsigned char *)&w, 1);
+	deadline = deadline > start + EVENT_PAINT_MARGIN + EVENT_MIN_BUDGET ?
+		deadline - EVENT_PAINT_MARGIN : start + EVENT_MIN_BUDGET;
 	
+	TRACE_BEGIN("events", QLength (dpy));
 	
-	Atom fullScreenSupported = XInternAtom(dpy, "_NET_WM_STATE_FULLSCREEN", False);
-	XChangeProperty(dpy, root, XInternAtom(dpy, "_NET_SUPPORTED", False),
-					XA_ATOM, 32, PropModeAppend, (unsigned char *)&fullScreenSupported, 1);
+	do {
+		XNextEvent (dpy, &ev);
+		
+		if (event_superseded(dpy, &ev))
+		{
+			coalescedEventCount++;
+			continue;
+		}
+		
+		xprof_handle_event (dpy, &ev);
+	} while (QLength (dpy) && get_time_in_microseconds() < deadline);
 	
-	XSetSelectionOwner (dpy, a, w, 0);
+	if (QLength (dpy))
+	{
+		deferredEventCount += QLength (dpy);
+		
+		while (XCheckIfEvent(dpy, &ev, is_structure_event, NULL))
+		{
+			xprof_handle_event (dpy, &ev);
+			deferredEventCount--;
+		}
+	}
 	
-	ourWindow = w;
+	TRACE_END("events");
 	
-	exposeEvent.type = Expose;
-	exposeEvent.xexpose.window = ourWindow;
-	exposeEvent.xexpose.width = 1;
-	exposeEvent.xexpose.height = 1;
+	uint64_t drainTime = get_time_in_microseconds() - start;
 	
-	return True;
+	if (drainTime > maxEventDrainTime)
+		maxEventDrainTime = drainTime;
 }
 
 int
 main (int argc, char **argv)
 {
 	Display	   *dpy;
-	XEvent	    ev;
 	Window	    root_return, parent_return;
 	Window	    *children;
 	unsigned int    nchildren;
@@ -1817,7 +6655,9 @@ main (int argc, char **argv)
 	char	    *display = NULL;
 	int		    o;
 	
-	while ((o = getopt (argc, argv, "D:I:O:d:r:o:l:t:scnufFCaSvV")) != -1)
+	startupTime = get_time_in_microseconds();
+	
+	while ((o = getopt (argc, argv, "D:I:O:d:r:o:l:t:k:b:R:B:T:scnufFCaSvVgpx")) != -1)
 	{
 		switch (o) {
 			case 'd':
@@ -1835,9 +6675,40 @@ main (int argc, char **argv)
 			case 'V':
 				debugEvents = True;
 				break;
+			case 'g':
+				drawFrameGraph = True;
+				break;
+			case 'p':
+				framePacing = True;
+				break;
+			case 'x':
+				serverCursor = True;
+				break;
 			case 'u':
 				allowUnredirection = True;
 				break;
+			case 'k':
+				controlSocketPath = optarg;
+				break;
+			case 'T':
+				tracePath = optarg;
+				break;
+			case 'b':
+				textureBudget = strtoul(optarg, NULL, 10) * 1024 * 1024;
+				break;
+			case 'R':
+				readyFd = atoi(optarg);
+				break;
+			case 'B':
+				for (compositeBackend = 0; compositeBackend < BACKEND_COUNT; compositeBackend++)
+				{
+					if (!strcmp(optarg, backendNames[compositeBackend]))
+						break;
+				}
+				if (compositeBackend == BACKEND_COUNT)
+					usage (argv[0]);
+				backendRequested = True;
+				break;
 			default:
 				usage (argv[0]);
 				break;
@@ -1851,9 +6722,22 @@ main (int argc, char **argv)
 		exit (1);
 	}
 	XSetErrorHandler (error);
+	
+	struct sigaction action;
+	
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_sigusr1;
+	sigaction(SIGUSR1, &action, NULL);
+	
+	if (tracePath && !trace_init(tracePath))
+		exit (1);
+	
 	if (synchronize)
 		XSynchronize (dpy, 1);
 	scr = DefaultScreen (dpy);
+	
+	mark_startup_phase("connect");
+
 	root = RootWindow (dpy, scr);
 	
 	if (!XRenderQueryExtension (dpy, &render_event, &render_error))
@@ -1884,38 +6768,55 @@ main (int argc, char **argv)
 		fprintf (stderr, "No XShape extension\n");
 		exit (1);
 	}
-	if (!XFixesQueryExtension (dpy, &xfixes_event, &xfixes_error))
+	if (XPresentQueryExtension (dpy, &present_opcode, &present_event, &present_error))
 	{
-		fprintf (stderr, "No XFixes extension\n");
-		exit (1);
+		hasPresent = True;
+	}
+	else
+	{
+		fprintf (stderr, "No Present extension, estimating vblank timing\n");
 	}
 	
+	mark_startup_phase("extensions");
+	
 	if (!register_cm(dpy))
 	{
 		exit (1);
 	}
 	
+	if (!controlSocketPath && getenv("XDG_RUNTIME_DIR"))
+	{
+		static char defaultSocketPath[256];
+		
+		snprintf(defaultSocketPath, sizeof(defaultSocketPath), "%s/steamcompmgr.sock",
+				 getenv("XDG_RUNTIME_DIR"));
+		controlSocketPath = defaultSocketPath;
+	}
+	
+	init_control_socket();
+	
+	mark_startup_phase("register");
+	
 	/* get atoms */
-	steamAtom = XInternAtom (dpy, STEAM_PROP, False);
-	gameAtom = XInternAtom (dpy, GAME_PROP, False);
-	overlayAtom = XInternAtom (dpy, OVERLAY_PROP, False);
-	opacityAtom = XInternAtom (dpy, OPACITY_PROP, False);
-	gamesRunningAtom = XInternAtom (dpy, GAMES_RUNNING_PROP, False);
-	screenScaleAtom = XInternAtom (dpy, SCREEN_SCALE_PROP, False);
-	screenZoomAtom = XInternAtom (dpy, SCREEN_MAGNIFICATION_PROP, False);
-	winTypeAtom = XInternAtom (dpy, "_NET_WM_WINDOW_TYPE", False);
-	winDesktopAtom = XInternAtom (dpy, "_NET_WM_WINDOW_TYPE_DESKTOP", False);
-	winDockAtom = XInternAtom (dpy, "_NET_WM_WINDOW_TYPE_DOCK", False);
-	winToolbarAtom = XInternAtom (dpy, "_NET_WM_WINDOW_TYPE_TOOLBAR", False);
-	winMenuAtom = XInternAtom (dpy, "_NET_WM_WINDOW_TYPE_MENU", False);
-	winUtilAtom = XInternAtom (dpy, "_NET_WM_WINDOW_TYPE_UTILITY", False);
-	winSplashAtom = XInternAtom (dpy, "_NET_WM_WINDOW_TYPE_SPLASH", False);
-	winDialogAtom = XInternAtom (dpy, "_NET_WM_WINDOW_TYPE_DIALOG", False);
-	winNormalAtom = XInternAtom (dpy, "_NET_WM_WINDOW_TYPE_NORMAL", False);
-	sizeHintsAtom = XInternAtom (dpy, "WM_NORMAL_HINTS", False);
-	fullscreenAtom = XInternAtom (dpy, "_NET_WM_STATE_FULLSCREEN", False);
-	WMStateAtom = XInternAtom (dpy, "_NET_WM_STATE", False);
-	WMStateHiddenAtom = XInternAtom (dpy, "_NET_WM_STATE_HIDDEN", False);
+	char *atomNames[ATOM_COUNT];
+	Atom atoms[ATOM_COUNT];
+	
+	for (i = 0; i < ATOM_COUNT; i++)
+		atomNames[i] = atomTable[i].name;
+	
+	Status internStatus;
+	
+	XPROF(XPROF_INTERN_ATOMS, internStatus = XInternAtoms (dpy, atomNames, ATOM_COUNT, False, atoms));
+	if (!internStatus)
+	{
+		fprintf (stderr, "Could not intern atoms\n");
+		exit (1);
+	}
+	
+	for (i = 0; i < ATOM_COUNT; i++)
+		*atomTable[i].atom = atoms[i];
+	
+	mark_startup_phase("atoms");
 	
 	pa.subwindow_mode = IncludeInferiors;
 	
@@ -1930,77 +6831,29 @@ main (int argc, char **argv)
 	allDamage = None;
 	clipChanged = True;
 	
-	XWindowAttributes rootAttribs;
-	XVisualInfo visualInfoTemplate;
-	int visualInfoCount;
-	XVisualInfo *rootVisualInfo;
-	
-	XGetWindowAttributes (dpy, root, &rootAttribs);
-	
-	visualInfoTemplate.visualid = XVisualIDFromVisual (rootAttribs.visual);
-	
-	rootVisualInfo = XGetVisualInfo (dpy, VisualIDMask, &visualInfoTemplate, &visualInfoCount);
-	if (!visualInfoCount)
-	{
-		fprintf (stderr, "Could not get root window visual info\n");
-		exit (1);
-	}
-	
-	glContext = glXCreateContext(dpy, rootVisualInfo, NULL, True);
-	if (!glContext)
-	{
-		fprintf (stderr, "Could not create GLX context\n");
-		exit (1);
-	}
-	if (!glXMakeCurrent(dpy, root, glContext))
-	{
-		fprintf (stderr, "Could not make GL context current\n");
-		exit (1);
-	}
-	
-	__pointer_to_glXSwapIntervalEXT = (void *)glXGetProcAddress("glXSwapIntervalEXT");
-	if (__pointer_to_glXSwapIntervalEXT)
-	{
-		__pointer_to_glXSwapIntervalEXT(dpy, root, 1);
-	}
-	else
-	{
-		fprintf (stderr, "Could not find glXSwapIntervalEXT proc pointer\n");
-	}
-	
-	__pointer_to_glXBindTexImageEXT = (void *)glXGetProcAddress("glXBindTexImageEXT");
-	__pointer_to_glXReleaseTexImageEXT = (void *)glXGetProcAddress("glXReleaseTexImageEXT");
+	if (compositeBackend == BACKEND_CPU)
+		init_cpu_backend(dpy);
+	else if (compositeBackend == BACKEND_RENDER || !init_gl_backend(dpy))
+		init_render_backend(dpy);
 	
-	if (!__pointer_to_glXBindTexImageEXT || !__pointer_to_glXReleaseTexImageEXT)
-	{
-		fprintf (stderr, "Could not get GLX_EXT_texture_from_pixmap entrypoints!\n");
-		exit (1);
-	}
+	XF86VidModeModeLine modeLine;
+	int dotClock;
 	
-	if (!strstr(glGetString(GL_EXTENSIONS), "GL_NV_path_rendering"))
-	{
-		drawDebugInfo = False;
-	}
-	else
+	if (XF86VidModeGetModeLine(dpy, scr, &dotClock, &modeLine) &&
+		dotClock && modeLine.htotal && modeLine.vtotal)
 	{
-		__pointer_to_glGenPathsNV = (PFNGLGENPATHSNVPROC) glXGetProcAddress("glGenPathsNV");
-		__pointer_to_glPathGlyphRangeNV = (PFNGLPATHGLYPHRANGENVPROC) glXGetProcAddress("glPathGlyphRangeNV");
-		__pointer_to_glGetPathMetricRangeNV = (PFNGLGETPATHMETRICRANGENVPROC) glXGetProcAddress("glGetPathMetricRangeNV");
-		__pointer_to_glGetPathSpacingNV = (PFNGLGETPATHSPACINGNVPROC) glXGetProcAddress("glGetPathSpacingNV");
-		__pointer_to_glStencilFillPathInstancedNV = (PFNGLSTENCILFILLPATHINSTANCEDNVPROC) glXGetProcAddress("glStencilFillPathInstancedNV");
-		__pointer_to_glStencilStrokePathInstancedNV = (PFNGLSTENCILSTROKEPATHINSTANCEDNVPROC) glXGetProcAddress("glStencilStrokePathInstancedNV");
-		__pointer_to_glCoverFillPathInstancedNV = (PFNGLCOVERFILLPATHINSTANCEDNVPROC) glXGetProcAddress("glCoverFillPathInstancedNV");
-		__pointer_to_glCoverStrokePathInstancedNV = (PFNGLCOVERSTROKEPATHINSTANCEDNVPROC) glXGetProcAddress("glCoverStrokePathInstancedNV");
+		// Dot clock is in kHz, so this comes out in milliseconds
+		refreshInterval = (float)modeLine.htotal * modeLine.vtotal / dotClock;
+		
+		if (modeLine.privsize)
+			XFree(modeLine.private);
 	}
 	
-	glEnable(GL_TEXTURE_2D);
-	glGenTextures(1, &cursorTextureName);
-	
-	if (drawDebugInfo)
-		init_text_rendering();
-	
-	XFree(rootVisualInfo);
+	mark_startup_phase("backend");
 	
+	// Keep the grab to what needs to be atomic: redirecting, selecting
+	// input and taking stock of the existing windows. Setting them up
+	// happens after, with anything that changed meanwhile already queued.
 	XGrabServer (dpy);
 	
 	if (doRender)
@@ -2016,13 +6869,35 @@ main (int argc, char **argv)
 				  LeaveWindowMask|
 				  PropertyChangeMask);
 	XShapeSelectInput (dpy, root, ShapeNotifyMask);
+	if (hasPresent)
+	{
+		XPresentSelectInput (dpy, root, PresentCompleteNotifyMask);
+		
+		// Get a first vblank timestamp right away
+		XPresentNotifyMSC (dpy, root, presentSwapSerial, 0, 0, 0);
+	}
 	XFixesSelectCursorInput(dpy, root, XFixesDisplayCursorNotifyMask);
 	XQueryTree (dpy, root, &root_return, &parent_return, &children, &nchildren);
-	for (i = 0; i < nchildren; i++)
-		add_win (dpy, children[i], i ? children[i-1] : None, 0);
-	XFree (children);
+	prefetched_win *prefetched = prefetch_windows (dpy, children, nchildren);
 	
 	XUngrabServer (dpy);
+	XFlush (dpy);
+	
+	mark_startup_phase("grab");
+	
+	if (prefetched)
+	{
+		add_prefetched_windows (dpy, prefetched, nchildren);
+		free (prefetched);
+	}
+	else
+	{
+		for (i = 0; i < nchildren; i++)
+			add_win (dpy, children[i], i ? children[i-1] : None, 0);
+	}
+	XFree (children);
+	
+	mark_startup_phase("windows");
 	
 	XF86VidModeLockModeSwitch(dpy, scr, True);
 	
@@ -2031,258 +6906,56 @@ main (int argc, char **argv)
 	apply_cursor_state(dpy);
 	
 	gamesRunningCount = get_prop(dpy, root, gamesRunningAtom, 0);
+	rootPresentationMode = get_prop(dpy, root, presentationModeAtom, PRESENTATION_MODE_FIFO);
 	overscanScaleRatio = get_prop(dpy, root, screenScaleAtom, 0xFFFFFFFF) / (double)0xFFFFFFFF;
 	zoomScaleRatio = get_prop(dpy, root, screenZoomAtom, 0xFFFF) / (double)0xFFFF;
 	
 	globalScaleRatio = overscanScaleRatio * zoomScaleRatio;
 	
+	Bool restarted = restore_state_checkpoint(dpy);
+	
 	determine_and_apply_focus(dpy);
 	
+	// Put up the window we had before the restart without waiting for it
+	// to draw again
+	if (restarted && find_win(dpy, currentFocusWindow))
+		find_win(dpy, currentFocusWindow)->damaged = 1;
+	
+	// We own the selection, everything is redirected and the windows that
+	// were there are set up. Waiting for an actual frame would never end in
+	// an empty session, as that needs a client to draw something.
+	mark_startup_phase("ready");
+	notify_ready();
+	
 	for (;;)
 	{
 		focusDirty = False;
 		
-		do {
-			XNextEvent (dpy, &ev);
-			if ((ev.type & 0x7f) != KeymapNotify)
-				discard_ignore (dpy, ev.xany.serial);
-			if (debugEvents)
-			{
-				printf ("event %x\n", ev.type);
-			}
-			switch (ev.type) {
-				case CreateNotify:
-					if (ev.xcreatewindow.parent == root)
-						add_win (dpy, ev.xcreatewindow.window, 0, ev.xcreatewindow.serial);
-					break;
-				case ConfigureNotify:
-					configure_win (dpy, &ev.xconfigure);
-					break;
-				case DestroyNotify:
-				{
-					win * w = find_win(dpy, ev.xdestroywindow.window);
-					
-					if (w && w->id == ev.xdestroywindow.window)
-						destroy_win (dpy, ev.xdestroywindow.window, True, True);
-					break;
-				}
-				case MapNotify:
-				{
-					win * w = find_win(dpy, ev.xmap.window);
-					
-					if (w && w->id == ev.xmap.window)
-						map_win (dpy, ev.xmap.window, ev.xmap.serial);
-					break;
-				}
-				case UnmapNotify:
-				{
-					win * w = find_win(dpy, ev.xunmap.window);
-					
-					if (w && w->id == ev.xunmap.window)
-						unmap_win (dpy, ev.xunmap.window, True);
-					break;
-				}
-				case ReparentNotify:
-					if (ev.xreparent.parent == root)
-						add_win (dpy, ev.xreparent.window, 0, ev.xreparent.serial);
-					else
-					{
-						win * w = find_win(dpy, ev.xreparent.window);
-						
-						if (w && w->id == ev.xreparent.window)
-						{
-							destroy_win (dpy, ev.xreparent.window, False, True);
-						}
-						else
-						{
-							// If something got reparented _to_ a toplevel window,
-							// go check for the fullscreen workaround again.
-							w = find_win(dpy, ev.xreparent.parent);
-							if (w)
-							{
-								get_size_hints(dpy, w);
-								focusDirty = True;
-							}
-						}
-					}
-					break;
-				case CirculateNotify:
-					circulate_win (dpy, &ev.xcirculate);
-					break;
-				case Expose:
-					break;
-				case PropertyNotify:
-					/* check if Trans property was changed */
-					if (ev.xproperty.atom == opacityAtom)
-					{
-						/* reset mode and redraw window */
-						win * w = find_win(dpy, ev.xproperty.window);
-						win * mainOverlayWindow = find_win(dpy, currentOverlayWindow);
-						if (w && w->isOverlay)
-						{
-							unsigned int newOpacity = get_prop(dpy, w->id, opacityAtom, TRANSLUCENT);
-							
-							if (newOpacity != w->opacity)
-							{
-								w->damaged = 1;
-								w->opacity = newOpacity;
-							}
-							
-							if (w->opacity && w->isOverlay && unredirectedWindow != None)
-							{
-								XCompositeRedirectWindow(dpy, unredirectedWindow, CompositeRedirectManual);
-								ensure_win_resources(dpy, find_win(dpy, unredirectedWindow));
-								unredirectedWindow = None;
-							}
-							
-							if (w->isOverlay)
-							{
-								set_win_hidden(dpy, w, w->opacity == TRANSLUCENT);
-							}
-							
-							unsigned int maxOpacity = 0;
-							
-							for (w = list; w; w = w->next)
-							{
-								if (w->isOverlay)
-								{
-									if (w->a.width == 1920 && w->opacity >= maxOpacity)
-									{
-										currentOverlayWindow = w->id;
-										maxOpacity = w->opacity;
-									}
-								}
-							}
-						}
-					}
-					if (ev.xproperty.atom == steamAtom)
-					{
-						win * w = find_win(dpy, ev.xproperty.window);
-						if (w)
-						{
-							w->isSteam = get_prop(dpy, w->id, steamAtom, 0);
-							focusDirty = True;
-						}
-					}
-					if (ev.xproperty.atom == gameAtom)
-					{
-						win * w = find_win(dpy, ev.xproperty.window);
-						if (w)
-						{
-							w->gameID = get_prop(dpy, w->id, gameAtom, 0);
-							focusDirty = True;
-						}
-					}
-					if (ev.xproperty.atom == overlayAtom)
-					{
-						win * w = find_win(dpy, ev.xproperty.window);
-						if (w)
-						{
-							w->isOverlay = get_prop(dpy, w->id, overlayAtom, 0);
-							focusDirty = True;
-							
-							// Overlay windows need a RGBA pixmap, so destroy the old one there
-							// It'll be reallocated as RGBA in ensure_win_resources()
-							if (w->pixmap && w->isOverlay)
-							{
-								teardown_win_resources(dpy, w);
-							}
-						}
-					}
-					if (ev.xproperty.atom == sizeHintsAtom)
-					{
-						win * w = find_win(dpy, ev.xproperty.window);
-						if (w)
-						{
-							get_size_hints(dpy, w);
-							focusDirty = True;
-						}
-					}
-					if (ev.xproperty.atom == gamesRunningAtom)
-					{
-						gamesRunningCount = get_prop(dpy, root, gamesRunningAtom, 0);
-						
-						focusDirty = True;
-					}
-					if (ev.xproperty.atom == screenScaleAtom)
-					{
-						overscanScaleRatio = get_prop(dpy, root, screenScaleAtom, 0xFFFFFFFF) / (double)0xFFFFFFFF;
-						
-						globalScaleRatio = overscanScaleRatio * zoomScaleRatio;
-						
-						win *w;
-						
-						if (w = find_win(dpy, currentFocusWindow))
-							w->damaged = 1;
-						
-						focusDirty = True;
-					}
-					if (ev.xproperty.atom == screenZoomAtom)
-					{
-						zoomScaleRatio = get_prop(dpy, root, screenZoomAtom, 0xFFFF) / (double)0xFFFF;
-						
-						globalScaleRatio = overscanScaleRatio * zoomScaleRatio;
-						
-						win *w;
-						
-						if (w = find_win(dpy, currentFocusWindow))
-							w->damaged = 1;
-						
-						focusDirty = True;
-					}
-					break;
-					case ClientMessage:
-					{
-						win * w = find_win(dpy, ev.xclient.window);
-						if (w)
-						{
-							if (ev.xclient.data.l[1] == fullscreenAtom)
-							{
-								w->isFullscreen = ev.xclient.data.l[0];
-								
-								focusDirty = True;
-							}
-						}
-						break;
-					}
-					case LeaveNotify:
-						if (ev.xcrossing.window == currentFocusWindow)
-						{
-							// This shouldn't happen due to our pointer barriers,
-							// but there is a known X server bug; warp to last good
-							// position.
-							XWarpPointer(dpy, None, currentFocusWindow, 0, 0, 0, 0,
-										 cursorX, cursorY);
-						}
-						break;
-					case MotionNotify:
-					{
-						win * w = find_win(dpy, ev.xmotion.window);
-						if (w && w->id == currentFocusWindow)
-						{
-							handle_mouse_movement( dpy, ev.xmotion.x, ev.xmotion.y );
-						}
-						break;
-					}
-					default:
-						if (ev.type == damage_event + XDamageNotify)
-						{
-							damage_win (dpy, (XDamageNotifyEvent *) &ev);
-						}
-						else if (ev.type == xfixes_event + XFixesCursorNotify)
-						{
-							cursorImageDirty = True;
-						}
-						break;
-			}
-		} while (QLength (dpy));
+		// If a paint is being held back, only wait for events until it's due
+		if (wait_for_events(dpy))
+			drain_events(dpy);
+		
+		flush_damage(dpy);
+		
+		if (xprofDumpRequested)
+		{
+			xprof_dump(stderr);
+			xprofDumpRequested = False;
+		}
 		
 		if (focusDirty == True)
 			determine_and_apply_focus(dpy);
 		
+		checkpoint_state(dpy);
+		
 		if (doRender)
 		{
 			paint_all(dpy);
+			xprof_end_frame(dpy);
+			
+			// Idle with no paint held back; get ready for what's likely next
+			if (!QLength(dpy) && !scheduledPaintTime && !fadeOutWindow.id)
+				prewarm_likely_windows(dpy);
 			
 			// If we're in the middle of a fade, pump an event into the loop to
 			// make sure we keep pushing frames even if the app isn't updating.
@@ -2294,9 +6967,14 @@ main (int argc, char **argv)
 			int win_x, win_y;
 			unsigned int mask_return;
 			
-			XQueryPointer(dpy, DefaultRootWindow(dpy), &window_returned,
-						  &child, &root_x, &root_y, &win_x, &win_y,
-						&mask_return);
+			XPROF(XPROF_MAIN_QUERY_POINTER,
+				  XQueryPointer(dpy, DefaultRootWindow(dpy), &window_returned,
+								&child, &root_x, &root_y, &win_x, &win_y,
+								&mask_return));
+			
+			// Nothing gets composited to notice the server cursor moving
+			if (serverCursorWindow)
+				handle_mouse_movement(dpy, root_x, root_y);
 			
 			if ( mask_return & ( Button1Mask | Button2Mask | Button3Mask | Button4Mask | Button5Mask ) )
 			{
@@ -2306,7 +6984,7 @@ main (int argc, char **argv)
 			}
 			
 			if (!hideCursorForMovement &&
-				(get_time_in_milliseconds() - lastCursorMovedTime) > CURSOR_HIDE_TIME)
+				(get_time_in_milliseconds() - lastCursorMovedTime) > cursorHideTime)
 			{
 				hideCursorForMovement = True;
 				apply_cursor_state(dpy);
@@ -2317,12 +6995,12 @@ main (int argc, char **argv)
 				// Rearm warp count
 				if (w)
 				{
-					w->mouseMoved = 0;
+					w->cold->mouseMoved = 0;
 				}
 				
 				if (w && focusedWindowNeedsScale && gameFocused)
 				{
-					w->damaged = 1;
+					damage_cursor(w);
 				}
 			}
 		}
@@ -0,0 +1,169 @@
+/*
+ * Timeline tracing.
+ *
+ * The compositor thread only stores a timestamp, a phase, a name pointer and
+ * an argument into a single-producer, single-consumer ring; formatting and
+ * file IO happen on a writer thread that drains the ring every few
+ * milliseconds. If the ring fills up, new events are dropped and counted.
+ *
+ * The output uses the JSON array form of the Chrome trace event format and
+ * is never terminated, so a trace cut short by a crash still opens.
+ * Timestamps are CLOCK_MONOTONIC microseconds, the same clock most games and
+ * graphics drivers trace with.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#define			RING_SIZE 65536		/* power of two */
+#define			FLUSH_INTERVAL 20	/* milliseconds */
+
+typedef struct _trace_record {
+	uint64_t	time;
+	uint64_t	arg;
+	const char	*name;
+	char		phase;
+} trace_record;
+
+int traceEnabled;
+
+static trace_record		ring[RING_SIZE];
+static unsigned int		ringHead;		/* written by the compositor thread */
+static unsigned int		ringTail;		/* written by the writer thread */
+static unsigned long	droppedCount;
+
+static FILE				*traceFile;
+static pthread_t		writerThread;
+static int				stopping;
+static int				pid;
+
+static uint64_t
+get_time_in_microseconds (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+trace_event (char phase, const char *name, uint64_t arg)
+{
+	unsigned int head = ringHead;
+	trace_record *record;
+
+	if (head - __atomic_load_n(&ringTail, __ATOMIC_ACQUIRE) >= RING_SIZE)
+	{
+		droppedCount++;
+		return;
+	}
+
+	record = &ring[head & (RING_SIZE - 1)];
+	record->time = get_time_in_microseconds();
+	record->arg = arg;
+	record->name = name;
+	record->phase = phase;
+
+	__atomic_store_n(&ringHead, head + 1, __ATOMIC_RELEASE);
+}
+
+static void
+write_records (void)
+{
+	unsigned int head = __atomic_load_n(&ringHead, __ATOMIC_ACQUIRE);
+	unsigned int tail = ringTail;
+
+	if (head == tail)
+		return;
+
+	for (; tail != head; tail++)
+	{
+		trace_record *record = &ring[tail & (RING_SIZE - 1)];
+
+		fprintf (traceFile, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d",
+				 record->name, record->phase, (unsigned long long)record->time, pid, pid);
+
+		if (record->phase == 'i')
+			fprintf (traceFile, ",\"s\":\"p\"");
+
+		if (record->phase != 'E')
+			fprintf (traceFile, ",\"args\":{\"value\":%llu}", (unsigned long long)record->arg);
+
+		fprintf (traceFile, "},\n");
+	}
+
+	__atomic_store_n(&ringTail, tail, __ATOMIC_RELEASE);
+	fflush (traceFile);
+}
+
+static void *
+writer_thread (void *data)
+{
+	struct timespec interval = { 0, FLUSH_INTERVAL * 1000000 };
+
+	while (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+	{
+		nanosleep(&interval, NULL);
+		write_records();
+	}
+
+	return NULL;
+}
+
+int
+trace_init (const char *path)
+{
+	traceFile = fopen(path, "w");
+	if (!traceFile)
+	{
+		fprintf (stderr, "Couldn't open trace file %s: %s\n", path, strerror(errno));
+		return 0;
+	}
+
+	pid = getpid();
+
+	fprintf (traceFile, "[\n");
+	fprintf (traceFile, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,"
+			 "\"args\":{\"name\":\"compositor\"}},\n", pid, pid);
+
+	if (pthread_create(&writerThread, NULL, writer_thread, NULL) != 0)
+	{
+		fprintf (stderr, "Couldn't start the trace writer thread\n");
+		fclose(traceFile);
+		traceFile = NULL;
+		return 0;
+	}
+
+	traceEnabled = 1;
+	atexit(trace_shutdown);
+
+	return 1;
+}
+
+void
+trace_shutdown (void)
+{
+	if (!traceFile)
+		return;
+
+	traceEnabled = 0;
+	__atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+	pthread_join(writerThread, NULL);
+
+	write_records();
+	fclose(traceFile);
+	traceFile = NULL;
+}
+
+unsigned long
+trace_dropped (void)
+{
+	return droppedCount;
+}
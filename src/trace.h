@@ -0,0 +1,33 @@
+/*
+ * Timeline tracing: spans and instant events go into an in-memory ring and
+ * a background thread writes them out in the Chrome trace event format,
+ * which ui.perfetto.dev and chrome://tracing can open.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+extern int traceEnabled;
+
+/* Starts writing to path; returns 0 and prints why on failure. */
+int trace_init (const char *path);
+
+/* Writes out whatever is left and stops the writer thread. */
+void trace_shutdown (void);
+
+/* Events dropped because the writer couldn't keep up. */
+unsigned long trace_dropped (void);
+
+/* Names must be string literals or otherwise outlive the trace. */
+void trace_event (char phase, const char *name, uint64_t arg);
+
+#define TRACE_BEGIN(name, arg) \
+	do { if (traceEnabled) trace_event('B', name, arg); } while (0)
+#define TRACE_END(name) \
+	do { if (traceEnabled) trace_event('E', name, 0); } while (0)
+#define TRACE_INSTANT(name, arg) \
+	do { if (traceEnabled) trace_event('i', name, arg); } while (0)
+
+#endif
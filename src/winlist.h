@@ -0,0 +1,158 @@
+/*
+ * The window stacking list and the table of windows by ID. Include once per
+ * program, after defining the win type with next, prev and hashNext
+ * pointers and an id; the list and the table are static to that file.
+ */
+
+#ifndef WINLIST_H
+#define WINLIST_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Windows by ID, chained through hashNext; kept below a load factor of one
+#define WIN_HASH_INITIAL_SIZE 64
+
+static win			*list;		/* topmost window */
+static win			*listTail;	/* bottom window */
+
+static win			**winHash;
+static unsigned int	winHashSize;
+static unsigned int	winCount;
+
+static inline unsigned int
+win_hash (unsigned long id)
+{
+	// Client IDs differ in the high bits, resources of one client in the low ones
+	return (id ^ (id >> 12) ^ (id >> 21)) & (winHashSize - 1);
+}
+
+static inline win *
+lookup_win (unsigned long id)
+{
+	win *w;
+
+	if (id == 0 || !winHash)
+		return NULL;
+
+	for (w = winHash[win_hash(id)]; w; w = w->hashNext)
+	{
+		if (w->id == id)
+			return w;
+	}
+
+	return NULL;
+}
+
+static inline void
+hash_win (win *w)
+{
+	unsigned int bucket;
+
+	if (winCount + 1 > winHashSize)
+	{
+		unsigned int oldSize = winHashSize;
+		win **oldHash = winHash;
+		unsigned int i;
+
+		winHashSize = oldSize ? oldSize * 2 : WIN_HASH_INITIAL_SIZE;
+		winHash = calloc(winHashSize, sizeof(win *));
+		if (!winHash)
+		{
+			fprintf(stderr, "Couldn't allocate the window table\n");
+			exit(1);
+		}
+
+		for (i = 0; i < oldSize; i++)
+		{
+			while (oldHash[i])
+			{
+				win *v = oldHash[i];
+
+				oldHash[i] = v->hashNext;
+				bucket = win_hash(v->id);
+				v->hashNext = winHash[bucket];
+				winHash[bucket] = v;
+			}
+		}
+
+		free(oldHash);
+	}
+
+	bucket = win_hash(w->id);
+	w->hashNext = winHash[bucket];
+	winHash[bucket] = w;
+	winCount++;
+}
+
+static inline void
+unhash_win (win *w)
+{
+	win **p;
+
+	for (p = &winHash[win_hash(w->id)]; *p; p = &(*p)->hashNext)
+	{
+		if (*p == w)
+		{
+			*p = w->hashNext;
+			winCount--;
+			break;
+		}
+	}
+}
+
+static inline void
+unlink_win (win *w)
+{
+	if (w->prev)
+		w->prev->next = w->next;
+	else
+		list = w->next;
+
+	if (w->next)
+		w->next->prev = w->prev;
+	else
+		listTail = w->prev;
+
+	w->next = w->prev = NULL;
+}
+
+/* Stacks w right on top of below, or at the very bottom if below is NULL. */
+static inline void
+link_win_above (win *w, win *below)
+{
+	w->next = below;
+	w->prev = below ? below->prev : listTail;
+
+	if (w->prev)
+		w->prev->next = w;
+	else
+		list = w;
+
+	if (below)
+		below->prev = w;
+	else
+		listTail = w;
+}
+
+/* Stacks w right on top of the window with ID above, or at the bottom if
+ * there's no such window, like a ConfigureNotify does. Returns 0 if w was
+ * already there. */
+static inline int
+restack_win_above (win *w, unsigned long above)
+{
+	win *below;
+
+	if ((w->next ? w->next->id : 0) == above)
+		return 0;
+
+	below = lookup_win(above);
+	if (below == w)
+		return 0;
+
+	unlink_win(w);
+	link_win_above(w, below);
+	return 1;
+}
+
+#endif
@@ -0,0 +1,112 @@
+/*
+ * Times the CPU backend's compositing operations on a 1080p frame: a 720p
+ * game scaled up with both filters, unscaled copies and a full-screen
+ * overlay blended with its alpha.
+ *
+ * usage: cpucomposite_bench [threads] [frames]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "cpucomposite.h"
+
+#define DST_WIDTH 1920
+#define DST_HEIGHT 1080
+#define GAME_WIDTH 1280
+#define GAME_HEIGHT 720
+
+static uint64_t
+get_time_in_microseconds (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+init_surface (cpu_surface *surface, int width, int height, uint32_t seed)
+{
+	int i;
+
+	surface->width = surface->stride = width;
+	surface->height = height;
+	surface->pixels = malloc(width * height * sizeof(uint32_t));
+	if (!surface->pixels)
+	{
+		fprintf(stderr, "Out of memory\n");
+		exit(1);
+	}
+
+	for (i = 0; i < width * height; i++)
+	{
+		seed = seed * 1664525 + 1013904223;
+		surface->pixels[i] = seed;
+	}
+}
+
+static void
+report (const char *name, uint64_t time, int frames)
+{
+	double frameTime = time / 1000.0 / frames;
+
+	printf("%-24s %8.3fms %10.1f Mpixel/s\n", name, frameTime,
+		   (double)DST_WIDTH * DST_HEIGHT / frameTime / 1000.0);
+}
+
+int
+main (int argc, char **argv)
+{
+	int threads = argc > 1 ? atoi(argv[1]) : 0;
+	int frames = argc > 2 ? atoi(argv[2]) : 200;
+	cpu_surface dst, game, fullscreen, overlay;
+	uint64_t start;
+	int i;
+
+	if (frames <= 0)
+		frames = 1;
+
+	cpu_composite_init(threads);
+
+	init_surface(&dst, DST_WIDTH, DST_HEIGHT, 1);
+	init_surface(&game, GAME_WIDTH, GAME_HEIGHT, 2);
+	init_surface(&fullscreen, DST_WIDTH, DST_HEIGHT, 3);
+	init_surface(&overlay, DST_WIDTH, DST_HEIGHT, 4);
+
+	printf("%s kernels, %d frames of %dx%d\n", cpu_composite_isa(), frames, DST_WIDTH, DST_HEIGHT);
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < frames; i++)
+		cpu_fill_rect(&dst, 0, 0, DST_WIDTH, DST_HEIGHT, 0xFF000000, 255);
+	report("fill", get_time_in_microseconds() - start, frames);
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < frames; i++)
+		cpu_draw_surface(&dst, &fullscreen, 0, 0, DST_WIDTH, DST_HEIGHT, 255, 0, 0);
+	report("copy", get_time_in_microseconds() - start, frames);
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < frames; i++)
+		cpu_draw_surface(&dst, &game, 0, 0, DST_WIDTH, DST_HEIGHT, 255, 0, 0);
+	report("720p scaled, nearest", get_time_in_microseconds() - start, frames);
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < frames; i++)
+		cpu_draw_surface(&dst, &game, 0, 0, DST_WIDTH, DST_HEIGHT, 255, 0, 1);
+	report("720p scaled, bilinear", get_time_in_microseconds() - start, frames);
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < frames; i++)
+		cpu_draw_surface(&dst, &overlay, 0, 0, DST_WIDTH, DST_HEIGHT, 255, 1, 0);
+	report("overlay, source alpha", get_time_in_microseconds() - start, frames);
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < frames; i++)
+		cpu_draw_surface(&dst, &fullscreen, 0, 0, DST_WIDTH, DST_HEIGHT, 128, 0, 0);
+	report("fade, alpha 128", get_time_in_microseconds() - start, frames);
+
+	return 0;
+}
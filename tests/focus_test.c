@@ -0,0 +1,413 @@
+/*
+ * Replays recorded map, damage and stacking sequences against the game
+ * focus scoring and counts how often focus would switch windows.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "focus.h"
+
+#define SCREEN_WIDTH 1920
+#define SCREEN_HEIGHT 1080
+// Same as the compositor's client frame statistics and rescoring period
+#define FRAME_STATS_SMOOTHING 0.1f
+#define FRAME_STATS_IDLE_THRESHOLD 500.0f
+#define RESCORE_PERIOD 250
+#define MAX_WINDOWS 8
+
+static int failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+typedef enum {
+	EVENT_MAP,
+	EVENT_UNMAP,
+	EVENT_RATE,		/* starts rendering at fps frames per second, 0 stops */
+	EVENT_RAISE,
+} event_type;
+
+typedef struct _replay_event {
+	unsigned int	time;	/* msec */
+	event_type		type;
+	int				window;
+	float			fps;
+} replay_event;
+
+typedef struct _replay_win {
+	int				width, height;
+	int				overrideRedirect;
+	int				mapped;
+	float			fps;
+	uint64_t		nextFrame;
+	focus_candidate	candidate;
+} replay_win;
+
+typedef struct _replay_result {
+	int				switches;		/* focus moving after the first pick */
+	int				naiveSwitches;	/* same, always focusing the latest damage */
+	int				focus;			/* window focused at the end */
+	unsigned int	lastSwitchTime;
+} replay_result;
+
+static unsigned long damageSequence;
+
+/* The clock the compositor takes map and damage times from. */
+static uint64_t
+get_time_in_microseconds (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void
+damage_win (replay_win *w, uint64_t now)
+{
+	focus_candidate *c = &w->candidate;
+
+	if (c->lastDamageTime)
+	{
+		float interval = (now - c->lastDamageTime) / 1000.0f;
+
+		if (interval < FRAME_STATS_IDLE_THRESHOLD)
+		{
+			if (c->frameInterval == 0.0f)
+				c->frameInterval = interval;
+			else
+				c->frameInterval += FRAME_STATS_SMOOTHING * (interval - c->frameInterval);
+		}
+	}
+
+	c->lastDamageTime = now;
+	c->damageSequence = ++damageSequence;
+}
+
+static void
+raise_win (int *stack, int *stackCount, int window)
+{
+	int i, j;
+
+	for (i = 0; i < *stackCount; i++)
+	{
+		if (stack[i] == window)
+		{
+			for (j = i; j > 0; j--)
+				stack[j] = stack[j - 1];
+			stack[0] = window;
+			return;
+		}
+	}
+
+	for (j = *stackCount; j > 0; j--)
+		stack[j] = stack[j - 1];
+	stack[0] = window;
+	(*stackCount)++;
+}
+
+/* Runs the events over duration msec. Focus is rescored on every map,
+ * unmap and restack, and every RESCORE_PERIOD while windows render, like
+ * the compositor does. */
+static replay_result
+replay (replay_win *windows, int windowCount, const replay_event *events,
+		int eventCount, unsigned int duration)
+{
+	replay_result result = { 0, 0, -1, 0 };
+	focus_candidate candidates[MAX_WINDOWS];
+	int candidateWindows[MAX_WINDOWS];
+	int stack[MAX_WINDOWS];
+	int stackCount = 0;
+	int naiveFocus = -1;
+	uint64_t focusStartTime = 0;
+	unsigned int lastRescore = 0;
+	unsigned int time;
+	int next = 0;
+	int i;
+
+	damageSequence = 0;
+
+	for (time = 0; time <= duration; time++)
+	{
+		uint64_t now = (uint64_t)time * 1000 + 1000000;
+		int dirty = 0;
+
+		for (; next < eventCount && events[next].time == time; next++)
+		{
+			const replay_event *event = &events[next];
+			replay_win *w = &windows[event->window];
+
+			switch (event->type)
+			{
+				case EVENT_MAP:
+					w->mapped = 1;
+					w->candidate.mapTime = now;
+					w->candidate.lastDamageTime = 0;
+					w->candidate.frameInterval = 0.0f;
+					w->candidate.damageSequence = 0;
+					raise_win(stack, &stackCount, event->window);
+					break;
+				case EVENT_UNMAP:
+					w->mapped = 0;
+					break;
+				case EVENT_RATE:
+					w->fps = event->fps;
+					w->nextFrame = now;
+					break;
+				case EVENT_RAISE:
+					raise_win(stack, &stackCount, event->window);
+					break;
+			}
+
+			dirty = 1;
+		}
+
+		for (i = 0; i < windowCount; i++)
+		{
+			replay_win *w = &windows[i];
+
+			if (w->mapped && w->fps > 0.0f && now >= w->nextFrame)
+			{
+				damage_win(w, now);
+				w->nextFrame += 1000000.0f / w->fps;
+			}
+		}
+
+		if (!dirty && time - lastRescore < RESCORE_PERIOD)
+			continue;
+
+		int count = 0, current = -1, latest = -1, focus;
+
+		for (i = 0; i < stackCount; i++)
+		{
+			replay_win *w = &windows[stack[i]];
+
+			if (!w->mapped)
+				continue;
+
+			w->candidate.area = (float)w->width * w->height / (SCREEN_WIDTH * SCREEN_HEIGHT);
+			w->candidate.overrideRedirect = w->overrideRedirect;
+
+			if (stack[i] == result.focus)
+				current = count;
+			if (latest < 0 || w->candidate.damageSequence >
+				windows[latest].candidate.damageSequence)
+				latest = stack[i];
+
+			candidates[count] = w->candidate;
+			candidateWindows[count++] = stack[i];
+		}
+
+		lastRescore = time;
+		focus = focus_pick(candidates, count, current, now, focusStartTime);
+
+		if (focus >= 0 && candidateWindows[focus] != result.focus)
+		{
+			if (result.focus >= 0)
+			{
+				result.switches++;
+				result.lastSwitchTime = time;
+			}
+			result.focus = candidateWindows[focus];
+			focusStartTime = now;
+		}
+
+		if (latest >= 0 && latest != naiveFocus)
+		{
+			if (naiveFocus >= 0)
+				result.naiveSwitches++;
+			naiveFocus = latest;
+		}
+	}
+
+	return result;
+}
+
+/* A launcher animating its menu while the game it started loads, shows a
+ * slow progress screen and then renders at full rate. */
+static void
+test_launcher_then_game (void)
+{
+	replay_win windows[2] = {
+		{ 1280, 720 },
+		{ 1920, 1080 },
+	};
+	const replay_event events[] = {
+		{ 0, EVENT_MAP, 0 },
+		{ 0, EVENT_RATE, 0, 30.0f },
+		{ 4000, EVENT_MAP, 1 },
+		{ 4000, EVENT_RATE, 1, 4.0f },
+		{ 7000, EVENT_RATE, 1, 60.0f },
+	};
+	replay_result result = replay(windows, 2, events, sizeof(events) / sizeof(events[0]), 15000);
+
+	CHECK(result.switches == 1);
+	CHECK(result.focus == 1);
+	CHECK(result.lastSwitchTime >= 7000);
+}
+
+/* A splash screen mapped and unmapped over and over on top of a game that
+ * keeps rendering; focus has to stay on the game. */
+static void
+test_splash_flapping (void)
+{
+	replay_win windows[2] = {
+		{ 1920, 1080 },
+		{ 800, 450 },
+	};
+	replay_event events[64];
+	int count = 0;
+	unsigned int time;
+	replay_result result;
+
+	events[count++] = (replay_event){ 0, EVENT_MAP, 0 };
+	events[count++] = (replay_event){ 0, EVENT_RATE, 0, 60.0f };
+	events[count++] = (replay_event){ 1000, EVENT_RATE, 1, 30.0f };
+
+	for (time = 1000; time < 8000; time += 1200)
+	{
+		events[count++] = (replay_event){ time, EVENT_MAP, 1 };
+		events[count++] = (replay_event){ time + 600, EVENT_UNMAP, 1 };
+	}
+
+	result = replay(windows, 2, events, count, 10000);
+
+	CHECK(result.switches == 0);
+	CHECK(result.focus == 0);
+	// Going by the latest damage alone flips back and forth
+	CHECK(result.naiveSwitches >= 10);
+}
+
+/* A launcher stub that renders at full rate hands over to the real game
+ * and stops drawing; focus moves once, and only after the dwell time. */
+static void
+test_game_handoff (void)
+{
+	replay_win windows[2] = {
+		{ 1920, 1080 },
+		{ 1920, 1080 },
+	};
+	const replay_event events[] = {
+		{ 0, EVENT_MAP, 0 },
+		{ 0, EVENT_RATE, 0, 60.0f },
+		{ 5000, EVENT_MAP, 1 },
+		{ 5000, EVENT_RATE, 1, 60.0f },
+		{ 5500, EVENT_RATE, 0, 0.0f },
+	};
+	replay_result result = replay(windows, 2, events, sizeof(events) / sizeof(events[0]), 12000);
+
+	CHECK(result.switches == 1);
+	CHECK(result.focus == 1);
+	CHECK(result.lastSwitchTime >= 5500);
+}
+
+/* Two games rendering at the same rate swapping places on top of each other
+ * every half second; focus doesn't follow. */
+static void
+test_restack_flapping (void)
+{
+	replay_win windows[2] = {
+		{ 1920, 1080 },
+		{ 1920, 1080 },
+	};
+	replay_event events[64];
+	int count = 0;
+	unsigned int time;
+	replay_result result;
+
+	events[count++] = (replay_event){ 0, EVENT_MAP, 0 };
+	events[count++] = (replay_event){ 0, EVENT_RATE, 0, 60.0f };
+	events[count++] = (replay_event){ 0, EVENT_MAP, 1 };
+	events[count++] = (replay_event){ 0, EVENT_RATE, 1, 60.0f };
+
+	for (time = 500; time < 10000; time += 500)
+		events[count++] = (replay_event){ time, EVENT_RAISE, (time / 500) % 2 };
+
+	result = replay(windows, 2, events, count, 10000);
+
+	CHECK(result.switches == 0);
+}
+
+/* Override redirect windows only get focus when nothing else can have it,
+ * and leaving one is never held back. */
+static void
+test_override_redirect (void)
+{
+	replay_win windows[2] = {
+		{ 1920, 1080, 1 },
+		{ 640, 480 },
+	};
+	const replay_event events[] = {
+		{ 0, EVENT_MAP, 0 },
+		{ 0, EVENT_RATE, 0, 60.0f },
+		{ 0, EVENT_MAP, 1 },
+		{ 0, EVENT_RATE, 1, 10.0f },
+		{ 3000, EVENT_UNMAP, 1 },
+		{ 3100, EVENT_MAP, 1 },
+	};
+	replay_result result = replay(windows, 2, events, sizeof(events) / sizeof(events[0]), 5000);
+
+	CHECK(result.switches == 2);
+	CHECK(result.focus == 1);
+	CHECK(result.lastSwitchTime == 3100);
+}
+
+static void
+test_score (void)
+{
+	uint64_t now = 10000000;
+	focus_candidate idle = { 0.0f, 0, now, 1.0f, 0, 0 };
+	focus_candidate rendering = { 16.7f, now, now - FOCUS_SETTLE_TIME * 1000, 1.0f, 1, 0 };
+
+	// Settled, full-screen, on top and with the latest damage
+	CHECK(focus_score(&rendering, 0, 1, now) > 0.99f);
+
+	// Just mapped and nothing drawn yet
+	CHECK(focus_score(&idle, 0, 1, now) < 0.36f);
+
+	// A window that stopped drawing a second ago is down to 1 FPS
+	CHECK(focus_score(&rendering, 0, 2, now + 1000000) <
+		  focus_score(&rendering, 0, 2, now) - 0.4f);
+}
+
+/* Map times come off the same clock as the time focus is scored at, so a
+ * window gains the whole age weight once it has settled. */
+static void
+test_age (void)
+{
+	uint64_t mapTime = get_time_in_microseconds();
+	uint64_t settled = mapTime + FOCUS_SETTLE_TIME * 1000;
+	focus_candidate c = { 0.0f, 0, mapTime, 1.0f, 0, 0 };
+	float gain = focus_score(&c, 0, 1, settled) - focus_score(&c, 0, 1, mapTime);
+
+	CHECK(gain > FOCUS_WEIGHT_AGE - 0.001f && gain < FOCUS_WEIGHT_AGE + 0.001f);
+	CHECK(focus_score(&c, 0, 1, get_time_in_microseconds()) < focus_score(&c, 0, 1, settled));
+}
+
+int
+main (void)
+{
+	test_score();
+	test_age();
+	test_launcher_then_game();
+	test_splash_flapping();
+	test_game_handoff();
+	test_restack_flapping();
+	test_override_redirect();
+
+	if (failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
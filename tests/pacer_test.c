@@ -0,0 +1,256 @@
+/*
+ * Drives the frame pacer with a fake 60Hz vblank clock and checks how long
+ * each client frame ends up on screen.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+
+#include "pacer.h"
+
+#define REFRESH_INTERVAL 16667
+#define CLOCK_START 1000000
+
+static int failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+/* First vblank a frame that's ready at the given time can make. */
+static uint64_t
+next_vblank (uint64_t time)
+{
+	uint64_t n = (time - CLOCK_START + REFRESH_INTERVAL - 1) / REFRESH_INTERVAL;
+
+	return CLOCK_START + n * REFRESH_INTERVAL;
+}
+
+/* Feeds frames arriving every frameInterval usec, and stores how many
+ * vblanks each one stayed on screen for. Returns the time after the last
+ * frame. */
+static uint64_t
+run_frames (frame_pacer *pacer, uint64_t time, uint64_t frameInterval,
+			int count, int *holds)
+{
+	uint64_t previous = 0;
+	int i;
+
+	pacer_set_cadence(pacer, frameInterval / 1000.0f, REFRESH_INTERVAL / 1000.0f);
+
+	for (i = 0; i < count; i++)
+	{
+		uint64_t target = pacer_schedule_frame(pacer, next_vblank(time), REFRESH_INTERVAL);
+
+		pacer_frame_presented(pacer, 1);
+
+		if (i > 0)
+			holds[i - 1] = (target - previous) / REFRESH_INTERVAL;
+		previous = target;
+		time += frameInterval;
+	}
+
+	return time;
+}
+
+static void
+test_full_rate (void)
+{
+	frame_pacer pacer = { 0 };
+
+	pacer_set_cadence(&pacer, 16.6f, REFRESH_INTERVAL / 1000.0f);
+	CHECK(!pacer_active(&pacer));
+
+	pacer_set_cadence(&pacer, 0.0f, REFRESH_INTERVAL / 1000.0f);
+	CHECK(!pacer_active(&pacer));
+}
+
+static void
+test_30fps (void)
+{
+	frame_pacer pacer = { 0 };
+	int holds[63];
+	int i;
+
+	run_frames(&pacer, CLOCK_START + 100, 33333, 64, holds);
+	CHECK(pacer_active(&pacer));
+
+	for (i = 0; i < 63; i++)
+		CHECK(holds[i] == 2);
+}
+
+static void
+test_40fps (void)
+{
+	frame_pacer pacer = { 0 };
+	int holds[63];
+	int i;
+
+	run_frames(&pacer, CLOCK_START + 100, 25000, 64, holds);
+
+	for (i = 0; i < 63; i++)
+		CHECK(holds[i] == (i % 2 ? 2 : 1));
+}
+
+static void
+test_45fps (void)
+{
+	frame_pacer pacer = { 0 };
+	int holds[63];
+	int i;
+
+	run_frames(&pacer, CLOCK_START + 100, 22222, 64, holds);
+
+	for (i = 0; i < 63; i++)
+		CHECK(holds[i] == (i % 3 == 2 ? 2 : 1));
+}
+
+static void
+test_24fps (void)
+{
+	frame_pacer pacer = { 0 };
+	int holds[63];
+	int i;
+
+	run_frames(&pacer, CLOCK_START + 100, 41667, 64, holds);
+	CHECK(pacer_active(&pacer));
+
+	for (i = 0; i < 63; i++)
+		CHECK(holds[i] == (i % 2 ? 3 : 2));
+}
+
+static void
+test_50fps (void)
+{
+	frame_pacer pacer = { 0 };
+	int holds[63];
+	int i;
+
+	run_frames(&pacer, CLOCK_START + 100, 20000, 64, holds);
+	CHECK(pacer_active(&pacer));
+
+	for (i = 0; i < 63; i++)
+		CHECK(holds[i] == (i % 5 == 4 ? 2 : 1));
+}
+
+static void
+test_early_frame (void)
+{
+	frame_pacer pacer = { 0 };
+	int holds[7];
+	uint64_t last, target;
+
+	run_frames(&pacer, CLOCK_START + 100, 33333, 8, holds);
+	last = pacer.lastVblank;
+
+	// Shows up right after the previous one went out; still gets its slot
+	target = pacer_schedule_frame(&pacer, last + REFRESH_INTERVAL, REFRESH_INTERVAL);
+	CHECK(target == last + 2 * REFRESH_INTERVAL);
+	pacer_frame_presented(&pacer, 1);
+	CHECK(pacer.lastVblank == target);
+	CHECK(pacer.targetVblank == 0);
+}
+
+static void
+test_late_frame (void)
+{
+	frame_pacer pacer = { 0 };
+	int holds[7];
+	uint64_t last, late, target;
+
+	run_frames(&pacer, CLOCK_START + 100, 25000, 8, holds);
+	last = pacer.lastVblank;
+
+	// Misses its slot by three vblanks: goes out at the next one and the
+	// 1/2 pattern starts over from there
+	late = last + 5 * REFRESH_INTERVAL;
+	target = pacer_schedule_frame(&pacer, late, REFRESH_INTERVAL);
+	CHECK(target == late);
+	CHECK(pacer.accumulator == 0.0f);
+	pacer_frame_presented(&pacer, 1);
+
+	target = pacer_schedule_frame(&pacer, late + REFRESH_INTERVAL, REFRESH_INTERVAL);
+	CHECK(target == late + REFRESH_INTERVAL);
+	pacer_frame_presented(&pacer, 1);
+
+	target = pacer_schedule_frame(&pacer, late + 2 * REFRESH_INTERVAL, REFRESH_INTERVAL);
+	CHECK(target == late + 3 * REFRESH_INTERVAL);
+	pacer_frame_presented(&pacer, 1);
+}
+
+static void
+test_unpaced_frame (void)
+{
+	frame_pacer pacer = { 0 };
+	int holds[7];
+	uint64_t late;
+
+	run_frames(&pacer, CLOCK_START + 100, 33333, 8, holds);
+
+	// Something else got composited in between: the pattern is lost
+	pacer_schedule_frame(&pacer, pacer.lastVblank + REFRESH_INTERVAL, REFRESH_INTERVAL);
+	pacer_frame_presented(&pacer, 0);
+	CHECK(pacer.lastVblank == 0);
+
+	late = CLOCK_START + 100 * REFRESH_INTERVAL;
+	CHECK(pacer_schedule_frame(&pacer, late, REFRESH_INTERVAL) == late);
+}
+
+static void
+test_cadence_change (void)
+{
+	frame_pacer pacer = { 0 };
+	int holds[31];
+	uint64_t time;
+	int i;
+
+	time = run_frames(&pacer, CLOCK_START + 100, 25000, 8, holds);
+	CHECK(pacer.accumulator != 0.0f);
+
+	// Measurement noise around 40 FPS neither changes nor re-phases anything
+	pacer_set_cadence(&pacer, 25.3f, REFRESH_INTERVAL / 1000.0f);
+	CHECK(fabsf(pacer.ratio - 1.5f) < 0.001f);
+	CHECK(pacer.accumulator != 0.0f);
+
+	// 33.1ms is 30 FPS
+	pacer_set_cadence(&pacer, 33.1f, REFRESH_INTERVAL / 1000.0f);
+	CHECK(pacer.ratio == 2.0f);
+	CHECK(pacer.accumulator == 0.0f);
+
+	run_frames(&pacer, time, 33333, 32, holds);
+	for (i = 0; i < 31; i++)
+		CHECK(holds[i] == 2);
+
+	// Back to full rate switches pacing off
+	pacer_set_cadence(&pacer, 16.7f, REFRESH_INTERVAL / 1000.0f);
+	CHECK(!pacer_active(&pacer));
+}
+
+int
+main (void)
+{
+	test_full_rate();
+	test_30fps();
+	test_40fps();
+	test_45fps();
+	test_24fps();
+	test_50fps();
+	test_early_frame();
+	test_late_frame();
+	test_unpaced_frame();
+	test_cadence_change();
+
+	if (failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,188 @@
+/*
+ * Times restacking and looking up windows in the stacking list, against
+ * walking a singly linked list the way it was done before.
+ *
+ * usage: winlist_bench [windows] [restacks]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef struct _win {
+	struct _win		*next;
+	struct _win		*prev;
+	struct _win		*hashNext;
+	unsigned long	id;
+} win;
+
+#include "winlist.h"
+
+typedef struct _old_win {
+	struct _old_win	*next;
+	unsigned long	id;
+} old_win;
+
+static old_win *oldList;
+
+static uint32_t seed = 1;
+
+static uint64_t
+get_time_in_microseconds (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int
+random_below (unsigned int n)
+{
+	seed = seed * 1664525 + 1013904223;
+	return (seed >> 8) % n;
+}
+
+static unsigned long
+window_id (int i)
+{
+	return ((unsigned long)(i % 7 + 1) << 21) | (i + 1);
+}
+
+static old_win *
+old_lookup_win (unsigned long id)
+{
+	old_win *w;
+
+	for (w = oldList; w; w = w->next)
+	{
+		if (w->id == id)
+			return w;
+	}
+
+	return NULL;
+}
+
+static void
+old_restack_win (old_win *w, unsigned long above)
+{
+	old_win **prev;
+
+	if ((w->next ? w->next->id : 0) == above)
+		return;
+
+	for (prev = &oldList; *prev; prev = &(*prev)->next)
+	{
+		if (*prev == w)
+			break;
+	}
+	*prev = w->next;
+
+	for (prev = &oldList; *prev; prev = &(*prev)->next)
+	{
+		if ((*prev)->id == above)
+			break;
+	}
+	w->next = *prev;
+	*prev = w;
+}
+
+static void
+report (const char *name, uint64_t time, int count)
+{
+	printf("%-24s %8.1fms %8.1fns each\n", name, time / 1000.0, time * 1000.0 / count);
+}
+
+int
+main (int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 1000;
+	int restacks = argc > 2 ? atoi(argv[2]) : 100000;
+	win *windows;
+	old_win *oldWindows;
+	unsigned int *moves;
+	unsigned long check = 0;
+	uint64_t start;
+	int i;
+
+	if (count < 2)
+		count = 2;
+	if (restacks <= 0)
+		restacks = 1;
+
+	windows = calloc(count, sizeof(win));
+	oldWindows = calloc(count, sizeof(old_win));
+	moves = malloc(restacks * 2 * sizeof(unsigned int));
+	if (!windows || !oldWindows || !moves)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		windows[i].id = oldWindows[i].id = window_id(i);
+		link_win_above(&windows[i], list);
+		hash_win(&windows[i]);
+		oldWindows[i].next = oldList;
+		oldList = &oldWindows[i];
+	}
+
+	// The same random window goes above the same random sibling in both
+	for (i = 0; i < restacks; i++)
+	{
+		moves[i * 2] = random_below(count);
+		moves[i * 2 + 1] = (moves[i * 2] + 1 + random_below(count - 1)) % count;
+	}
+
+	printf("%d restacks over %d windows\n", restacks, count);
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < restacks; i++)
+	{
+		win *w = lookup_win(window_id(moves[i * 2]));
+
+		restack_win_above(w, window_id(moves[i * 2 + 1]));
+	}
+	report("restack", get_time_in_microseconds() - start, restacks);
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < restacks; i++)
+	{
+		old_win *w = old_lookup_win(window_id(moves[i * 2]));
+
+		old_restack_win(w, window_id(moves[i * 2 + 1]));
+	}
+	report("restack, list walk", get_time_in_microseconds() - start, restacks);
+
+	// Both ended up in the same order
+	{
+		win *w = list;
+		old_win *o = oldList;
+
+		for (; w && o; w = w->next, o = o->next)
+		{
+			if (w->id != o->id)
+				break;
+		}
+
+		if (w || o)
+		{
+			fprintf(stderr, "Stacking orders differ\n");
+			return 1;
+		}
+	}
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < restacks; i++)
+		check += lookup_win(window_id(moves[i]))->id;
+	report("lookup", get_time_in_microseconds() - start, restacks);
+
+	start = get_time_in_microseconds();
+	for (i = 0; i < restacks; i++)
+		check -= old_lookup_win(window_id(moves[i]))->id;
+	report("lookup, list walk", get_time_in_microseconds() - start, restacks);
+
+	return check != 0;
+}
@@ -0,0 +1,243 @@
+/*
+ * Adds, restacks and removes windows at random and checks the stacking list
+ * and the ID table against a plain array after every step.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+typedef struct _win {
+	struct _win		*next;
+	struct _win		*prev;
+	struct _win		*hashNext;
+	unsigned long	id;
+} win;
+
+#include "winlist.h"
+
+#define MAX_WINDOWS 300
+#define STEPS 20000
+
+static int failures;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) \
+		{ \
+			fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+			failures++; \
+		} \
+	} while (0)
+
+static win windows[MAX_WINDOWS];
+static int live[MAX_WINDOWS];
+
+// Window IDs top-first, the way the list was kept before it was linked
+// both ways
+static unsigned long order[MAX_WINDOWS];
+static int orderCount;
+
+static uint32_t seed = 1;
+
+static unsigned int
+random_below (unsigned int n)
+{
+	seed = seed * 1664525 + 1013904223;
+	return (seed >> 8) % n;
+}
+
+/* IDs the way the server hands them out: the client in the high bits. */
+static unsigned long
+window_id (int i)
+{
+	return ((unsigned long)(i % 7 + 1) << 21) | (i + 1);
+}
+
+static int
+order_index (unsigned long id)
+{
+	int i;
+
+	for (i = 0; i < orderCount; i++)
+	{
+		if (order[i] == id)
+			return i;
+	}
+
+	return -1;
+}
+
+static void
+order_remove (unsigned long id)
+{
+	int i = order_index(id);
+
+	for (; i < orderCount - 1; i++)
+		order[i] = order[i + 1];
+	orderCount--;
+}
+
+/* Inserts id right on top of above, or at the bottom if it isn't there. */
+static void
+order_insert (unsigned long id, unsigned long above)
+{
+	int i = order_index(above);
+	int j;
+
+	if (i < 0)
+		i = orderCount;
+
+	for (j = orderCount; j > i; j--)
+		order[j] = order[j - 1];
+	order[i] = id;
+	orderCount++;
+}
+
+static int
+check_list (void)
+{
+	win *w, *prev = NULL;
+	int i = 0;
+
+	for (w = list; w; prev = w, w = w->next, i++)
+	{
+		if (i >= orderCount || w->id != order[i] || w->prev != prev)
+			return 0;
+	}
+
+	return i == orderCount && listTail == prev && winCount == (unsigned int)orderCount;
+}
+
+static int
+check_table (void)
+{
+	int i;
+
+	for (i = 0; i < MAX_WINDOWS; i++)
+	{
+		win *w = lookup_win(window_id(i));
+
+		if (live[i] ? w != &windows[i] : w != NULL)
+			return 0;
+	}
+
+	return lookup_win(0) == NULL;
+}
+
+/* Picks a window to stack something above: a live one most of the time,
+ * otherwise one that's gone, which stacks at the bottom. */
+static unsigned long
+random_sibling (void)
+{
+	if (orderCount && random_below(8))
+		return order[random_below(orderCount)];
+
+	return window_id(random_below(MAX_WINDOWS));
+}
+
+static void
+test_random_steps (void)
+{
+	int step;
+
+	for (step = 0; step < STEPS; step++)
+	{
+		int i = random_below(MAX_WINDOWS);
+		win *w = &windows[i];
+		unsigned int action = random_below(10);
+
+		if (!live[i])
+		{
+			unsigned long above = random_sibling();
+
+			if (!lookup_win(above))
+				above = 0;
+
+			w->id = window_id(i);
+			link_win_above(w, lookup_win(above));
+			hash_win(w);
+			live[i] = 1;
+			order_insert(w->id, above);
+		}
+		else if (action == 0)
+		{
+			unlink_win(w);
+			unhash_win(w);
+			live[i] = 0;
+			order_remove(w->id);
+		}
+		else
+		{
+			unsigned long above = random_sibling();
+			unsigned long before[MAX_WINDOWS];
+			int moved;
+
+			memcpy(before, order, orderCount * sizeof(order[0]));
+			moved = restack_win_above(w, above);
+			if (above != w->id)
+			{
+				order_remove(w->id);
+				order_insert(w->id, above);
+			}
+
+			// Whenever the order changes, focus has to be looked at again
+			CHECK(moved || !memcmp(before, order, orderCount * sizeof(order[0])));
+		}
+
+		if (!check_list() || !check_table())
+		{
+			fprintf(stderr, "step %d: list or table out of sync\n", step);
+			failures++;
+			return;
+		}
+	}
+}
+
+static void
+test_edges (void)
+{
+	win *w;
+
+	while ((w = list))
+	{
+		unlink_win(w);
+		unhash_win(w);
+		live[w - windows] = 0;
+	}
+	orderCount = 0;
+	CHECK(!list && !listTail && winCount == 0);
+
+	windows[0].id = window_id(0);
+	link_win_above(&windows[0], NULL);
+	hash_win(&windows[0]);
+	windows[1].id = window_id(1);
+	link_win_above(&windows[1], &windows[0]);
+	hash_win(&windows[1]);
+
+	// Above itself or where it already is: nothing to do
+	CHECK(!restack_win_above(&windows[1], windows[1].id));
+	CHECK(!restack_win_above(&windows[1], windows[0].id));
+	CHECK(!restack_win_above(&windows[0], 0));
+
+	// To the bottom, then back on top
+	CHECK(restack_win_above(&windows[1], 0));
+	CHECK(list == &windows[0] && listTail == &windows[1]);
+	CHECK(restack_win_above(&windows[1], windows[0].id));
+	CHECK(list == &windows[1] && listTail == &windows[0]);
+}
+
+int
+main (void)
+{
+	test_random_steps();
+	test_edges();
+
+	if (failures)
+	{
+		fprintf(stderr, "%d check(s) failed\n", failures);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,421 @@
+/*
+ * Times the focus scan over the stacking list with window records laid out
+ * the way they were before they were split into hot and cold parts, one
+ * malloc per window with the whole XWindowAttributes inside, against the
+ * current layout. The records mirror the real ones field for field, with
+ * the X and GL types replaced by ones of the same size. The cache is
+ * flushed before every scan, since the scan runs between frames, after
+ * painting has gone through everything else.
+ *
+ * usage: winscan_bench [windows] [scans]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+
+typedef int Bool;
+typedef unsigned long XID;
+typedef void *pointer;
+
+#define IsViewable 2
+#define InputOutput 1
+
+#define FLUSH_SIZE (32 * 1024 * 1024)
+
+// XWindowAttributes
+typedef struct _old_attributes {
+	int			x, y;
+	int			width, height;
+	int			border_width;
+	int			depth;
+	pointer		visual;
+	XID			root;
+	int			class;
+	int			bit_gravity;
+	int			win_gravity;
+	int			backing_store;
+	unsigned long	backing_planes;
+	unsigned long	backing_pixel;
+	Bool		save_under;
+	XID			colormap;
+	Bool		map_installed;
+	int			map_state;
+	long		all_event_masks;
+	long		your_event_mask;
+	long		do_not_propagate_mask;
+	Bool		override_redirect;
+	pointer		screen;
+} old_attributes;
+
+typedef struct _old_win {
+	struct _old_win	*next;
+	struct _old_win	*prev;
+	struct _old_win	*hashNext;
+	XID			id;
+	XID			pixmap;
+	XID			glxPixmap;
+	pointer		fbConfig;
+	unsigned int	texName;
+	XID			fence;
+	pointer		glFence;
+	Bool		fenceTriggered;
+	Bool		fenceDirty;
+	unsigned long	textureSize;
+	unsigned int	lastPaintTime;
+	Bool		evicted;
+	uint32_t	*cpuPixels;
+	int			cpuWidth, cpuHeight;
+	XID			picture;
+	int			damageBoxX1, damageBoxY1, damageBoxX2, damageBoxY2;
+	old_attributes	a;
+	int			mode;
+	int			damaged;
+	XID			damage;
+	unsigned int	opacity;
+	unsigned long	map_sequence;
+	unsigned long	damage_sequence;
+	uint64_t	lastDamageTime;
+	uint64_t	mapTime;
+	float		focusScore;
+	float		frameIntervalAverage;
+	float		frameIntervalVariance;
+	unsigned int	clientFrameCount;
+	unsigned int	framesSincePaint;
+	unsigned int	droppedFrames;
+	unsigned int	duplicatedFrames;
+	unsigned int	presentationMode;
+	uint32_t	presentSerial;
+	Bool		presentPending;
+	unsigned int	clientPresentCount;
+	uint32_t	feedbackSwapSerial;
+	uint32_t	feedbackClientSerial;
+	Bool		isSteam;
+	unsigned long long int gameID;
+	Bool		isOverlay;
+	Bool		isFullscreen;
+	Bool		isHidden;
+	Bool		sizeHintsSpecified;
+	unsigned int	requestedWidth;
+	unsigned int	requestedHeight;
+	Bool		nudged;
+	Bool		ignoreOverrideRedirect;
+	Bool		validContents;
+	Bool		mouseMoved;
+} old_win;
+
+typedef struct _win_attributes {
+	int			x, y;
+	int			width, height;
+	int			border_width;
+	int			depth;
+	int			class;
+	int			map_state;
+	Bool		override_redirect;
+} win_attributes;
+
+typedef struct _win_cold {
+	float		frameIntervalVariance;
+	unsigned int	clientFrameCount;
+	unsigned int	droppedFrames;
+	unsigned int	duplicatedFrames;
+	XID			presentEventId;
+	uint32_t	presentSerial;
+	Bool		presentPending;
+	unsigned int	clientPresentCount;
+	uint32_t	feedbackSwapSerial;
+	uint32_t	feedbackClientSerial;
+	Bool		sizeHintsSpecified;
+	unsigned int	requestedWidth;
+	unsigned int	requestedHeight;
+	Bool		nudged;
+	int			mouseMoved;
+	XID			visualid;
+	XID			windowType;
+	pointer		opaqueRects;
+	int			opaqueRectCount;
+} win_cold;
+
+typedef struct _win {
+	struct _win		*next;
+	struct _win		*prev;
+	struct _win		*hashNext;
+	XID			id;
+	XID			pixmap;
+	XID			glxPixmap;
+	pointer		fbConfig;
+	unsigned int	texName;
+	XID			fence;
+	pointer		glFence;
+	Bool		fenceTriggered;
+	Bool		fenceDirty;
+	unsigned long	textureSize;
+	unsigned int	lastPaintTime;
+	Bool		evicted;
+	uint32_t	*cpuPixels;
+	int			cpuWidth, cpuHeight;
+	XID			picture;
+	int			damageBoxX1, damageBoxY1, damageBoxX2, damageBoxY2;
+	unsigned int	damageEvents;
+	Bool		damageFlooded;
+	Bool		damageSubtractPending;
+	uint64_t	damageFloodTime;
+	win_attributes	a;
+	int			mode;
+	int			damaged;
+	XID			damage;
+	unsigned int	opacity;
+	unsigned long	map_sequence;
+	unsigned long	damage_sequence;
+	uint64_t	lastDamageTime;
+	uint64_t	mapTime;
+	float		focusScore;
+	float		frameIntervalAverage;
+	unsigned int	framesSincePaint;
+	unsigned int	presentationMode;
+	Bool		isSteam;
+	unsigned long long int gameID;
+	Bool		isOverlay;
+	Bool		isFullscreen;
+	Bool		isHidden;
+	Bool		ignoreOverrideRedirect;
+	Bool		validContents;
+	Bool		passive;
+	win_cold	*cold;
+} win;
+
+// What the scan hands to focus_pick
+typedef struct _candidate {
+	float		frameInterval;
+	uint64_t	lastDamageTime;
+	uint64_t	mapTime;
+	float		area;
+	unsigned long	damageSequence;
+	int			overrideRedirect;
+} candidate;
+
+static candidate *candidates;
+
+static uint32_t seed = 1;
+
+static uint64_t
+get_time_in_microseconds (void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int
+random_below (unsigned int n)
+{
+	seed = seed * 1664525 + 1013904223;
+	return (seed >> 8) % n;
+}
+
+static void
+flush_cache (unsigned char *buffer)
+{
+	int i;
+
+	for (i = 0; i < FLUSH_SIZE; i += 64)
+		buffer[i]++;
+}
+
+/* The two loops of determine_and_apply_focus over the list. */
+static unsigned long
+old_scan (old_win *list)
+{
+	unsigned long maxDamageSequence = 0, check = 0;
+	unsigned int maxOpacity = 0;
+	int count = 0;
+	old_win *w;
+
+	for (w = list; w; w = w->next)
+	{
+		if (w->gameID && w->a.map_state == IsViewable && w->a.class == InputOutput &&
+			w->damage_sequence >= maxDamageSequence)
+			maxDamageSequence = w->damage_sequence;
+	}
+
+	for (w = list; w; w = w->next)
+	{
+		if (w->isSteam)
+			check += w->id;
+
+		if (w->gameID && w->a.map_state == IsViewable && w->a.class == InputOutput)
+		{
+			candidate *c = &candidates[count++];
+
+			c->frameInterval = w->frameIntervalAverage;
+			c->lastDamageTime = w->lastDamageTime;
+			c->mapTime = w->mapTime;
+			c->area = (float)w->a.width * w->a.height / (1920.0f * 1080.0f);
+			c->damageSequence = w->damage_sequence;
+			c->overrideRedirect = w->a.override_redirect && !w->ignoreOverrideRedirect;
+		}
+
+		if (w->isOverlay && w->a.width == 1920 && w->opacity >= maxOpacity)
+			maxOpacity = w->opacity;
+	}
+
+	return check + count + maxDamageSequence + maxOpacity;
+}
+
+static unsigned long
+scan (win *list)
+{
+	unsigned long maxDamageSequence = 0, check = 0;
+	unsigned int maxOpacity = 0;
+	int count = 0;
+	win *w;
+
+	for (w = list; w; w = w->next)
+	{
+		if (w->gameID && w->a.map_state == IsViewable && w->a.class == InputOutput &&
+			w->damage_sequence >= maxDamageSequence)
+			maxDamageSequence = w->damage_sequence;
+	}
+
+	for (w = list; w; w = w->next)
+	{
+		if (w->isSteam)
+			check += w->id;
+
+		if (w->gameID && w->a.map_state == IsViewable && w->a.class == InputOutput)
+		{
+			candidate *c = &candidates[count++];
+
+			c->frameInterval = w->frameIntervalAverage;
+			c->lastDamageTime = w->lastDamageTime;
+			c->mapTime = w->mapTime;
+			c->area = (float)w->a.width * w->a.height / (1920.0f * 1080.0f);
+			c->damageSequence = w->damage_sequence;
+			c->overrideRedirect = w->a.override_redirect && !w->ignoreOverrideRedirect;
+		}
+
+		if (w->isOverlay && w->a.width == 1920 && w->opacity >= maxOpacity)
+			maxOpacity = w->opacity;
+	}
+
+	return check + count + maxDamageSequence + maxOpacity;
+}
+
+static void
+report (const char *name, uint64_t time, int count)
+{
+	printf("%-24s %8.1fms %8.2fus each\n", name, time / 1000.0, (double)time / count);
+}
+
+int
+main (int argc, char **argv)
+{
+	int count = argc > 1 ? atoi(argv[1]) : 200;
+	int scans = argc > 2 ? atoi(argv[2]) : 2000;
+	old_win **oldWindows;
+	old_win *oldList = NULL;
+	win *windows;
+	win_cold *cold;
+	win *list = NULL;
+	unsigned int *order;
+	unsigned char *flush;
+	unsigned long check = 0;
+	uint64_t time;
+	int i;
+
+	if (count < 1)
+		count = 1;
+	if (scans <= 0)
+		scans = 1;
+
+	oldWindows = malloc(count * sizeof(old_win *));
+	windows = calloc(count, sizeof(win));
+	cold = calloc(count, sizeof(win_cold));
+	order = malloc(count * sizeof(unsigned int));
+	candidates = malloc(count * sizeof(candidate));
+	flush = calloc(FLUSH_SIZE, 1);
+	if (!oldWindows || !windows || !cold || !order || !candidates || !flush)
+	{
+		fprintf(stderr, "Out of memory\n");
+		return 1;
+	}
+
+	// Windows are created one after the other, old records with a malloc
+	// each and new ones out of the slab arrays, and then restacked at random
+	for (i = 0; i < count; i++)
+	{
+		old_win *o = calloc(1, sizeof(old_win));
+		win *w = &windows[i];
+
+		if (!o)
+		{
+			fprintf(stderr, "Out of memory\n");
+			return 1;
+		}
+
+		w->cold = &cold[i];
+		o->id = w->id = i + 1;
+		o->a.map_state = w->a.map_state = random_below(4) ? 0 : IsViewable;
+		o->a.class = w->a.class = InputOutput;
+		o->a.width = w->a.width = 1920;
+		o->a.height = w->a.height = 1080;
+		o->gameID = w->gameID = random_below(8) ? 0 : 1 + random_below(4);
+		o->isSteam = w->isSteam = i == 0;
+		o->isOverlay = w->isOverlay = i == 1;
+		o->opacity = w->opacity = 0xffffffff;
+		o->damage_sequence = w->damage_sequence = random_below(100000);
+		o->lastDamageTime = w->lastDamageTime = random_below(1000000);
+		o->mapTime = w->mapTime = random_below(1000000);
+		o->frameIntervalAverage = w->frameIntervalAverage = 16.7f;
+		oldWindows[i] = o;
+		order[i] = i;
+	}
+
+	for (i = count - 1; i > 0; i--)
+	{
+		unsigned int j = random_below(i + 1);
+		unsigned int t = order[i];
+
+		order[i] = order[j];
+		order[j] = t;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		oldWindows[order[i]]->next = oldList;
+		oldList = oldWindows[order[i]];
+		windows[order[i]].next = list;
+		list = &windows[order[i]];
+	}
+
+	printf("%d scans over %d windows, %zu byte records before, %zu + %zu now\n",
+		   scans, count, sizeof(old_win), sizeof(win), sizeof(win_cold));
+
+	time = 0;
+	for (i = 0; i < scans; i++)
+	{
+		uint64_t start;
+
+		flush_cache(flush);
+		start = get_time_in_microseconds();
+		check += old_scan(oldList);
+		time += get_time_in_microseconds() - start;
+	}
+	report("scan, one record", time, scans);
+
+	time = 0;
+	for (i = 0; i < scans; i++)
+	{
+		uint64_t start;
+
+		flush_cache(flush);
+		start = get_time_in_microseconds();
+		check -= scan(list);
+		time += get_time_in_microseconds() - start;
+	}
+	report("scan, hot and cold", time, scans);
+
+	return check != 0;
+}